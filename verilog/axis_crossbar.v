@@ -0,0 +1,29 @@
+`default_nettype none
+
+module axis_crossbar #(
+  parameter DATA_WIDTH = 256,
+  parameter KEEP_WIDTH = DATA_WIDTH / 8
+) (
+  input                   clk,
+  input  [DATA_WIDTH-1:0] in_axis_tdata,
+  input  [KEEP_WIDTH-1:0] in_axis_tkeep,
+  input                   in_axis_tlast,
+  input                   in_axis_tvalid,
+  output                  in_axis_tready,
+  output [DATA_WIDTH-1:0] out_axis_tdata,
+  output [KEEP_WIDTH-1:0] out_axis_tkeep,
+  output                  out_axis_tlast,
+  output                  out_axis_tvalid,
+  input                   out_axis_tready
+);
+
+// Simply mirror data in and out
+assign out_axis_tdata = in_axis_tdata;
+assign out_axis_tkeep = in_axis_tkeep;
+assign out_axis_tlast = in_axis_tlast;
+assign out_axis_tvalid = in_axis_tvalid;
+assign in_axis_tready = out_axis_tready;
+
+endmodule
+
+`default_nettype wire
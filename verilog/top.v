@@ -1,34 +1,43 @@
 `include "crossbar.v"
 
-module top (
+// Port i of each bus is lanes [8*i +: 8] of ctrl and [64*i +: 64] of data, and
+// is connected to the i-th DPDK port in --config, in order of port ID.
+module top #(
+  parameter NUM_PORTS = 1
+) (
   input  reset,
   input  clk,
 
-  input  [ 7:0] eth_in_xgmii_ctrl,
-  input  [63:0] eth_in_xgmii_data,
-  output [ 7:0] eth_out_xgmii_ctrl,
-  output [63:0] eth_out_xgmii_data,
+  input  [ 8*NUM_PORTS-1:0] eth_in_xgmii_ctrl,
+  input  [64*NUM_PORTS-1:0] eth_in_xgmii_data,
+  output [ 8*NUM_PORTS-1:0] eth_out_xgmii_ctrl,
+  output [64*NUM_PORTS-1:0] eth_out_xgmii_data,
 
-  output [ 7:0] pcie_out_xgmii_ctrl,
-  output [63:0] pcie_out_xgmii_data,
-  input  [ 7:0] pcie_in_xgmii_ctrl,
-  input  [63:0] pcie_in_xgmii_data
+  output [ 8*NUM_PORTS-1:0] pcie_out_xgmii_ctrl,
+  output [64*NUM_PORTS-1:0] pcie_out_xgmii_data,
+  input  [ 8*NUM_PORTS-1:0] pcie_in_xgmii_ctrl,
+  input  [64*NUM_PORTS-1:0] pcie_in_xgmii_data
 );
 
-crossbar crossbar_rx_inst (
-  .clk(clk),
-  .eth_in_xgmii_ctrl(eth_in_xgmii_ctrl),
-  .eth_in_xgmii_data(eth_in_xgmii_data),
-  .eth_out_xgmii_ctrl(pcie_out_xgmii_ctrl),
-  .eth_out_xgmii_data(pcie_out_xgmii_data)
-);
+genvar i;
+generate
+  for (i = 0; i < NUM_PORTS; i = i + 1) begin : port
+    crossbar crossbar_rx_inst (
+      .clk(clk),
+      .eth_in_xgmii_ctrl(eth_in_xgmii_ctrl[8*i +: 8]),
+      .eth_in_xgmii_data(eth_in_xgmii_data[64*i +: 64]),
+      .eth_out_xgmii_ctrl(pcie_out_xgmii_ctrl[8*i +: 8]),
+      .eth_out_xgmii_data(pcie_out_xgmii_data[64*i +: 64])
+    );
 
-crossbar crossbar_tx_inst (
-  .clk(clk),
-  .eth_in_xgmii_ctrl(pcie_in_xgmii_ctrl),
-  .eth_in_xgmii_data(pcie_in_xgmii_data),
-  .eth_out_xgmii_ctrl(eth_out_xgmii_ctrl),
-  .eth_out_xgmii_data(eth_out_xgmii_data)
-);
+    crossbar crossbar_tx_inst (
+      .clk(clk),
+      .eth_in_xgmii_ctrl(pcie_in_xgmii_ctrl[8*i +: 8]),
+      .eth_in_xgmii_data(pcie_in_xgmii_data[64*i +: 64]),
+      .eth_out_xgmii_ctrl(eth_out_xgmii_ctrl[8*i +: 8]),
+      .eth_out_xgmii_data(eth_out_xgmii_data[64*i +: 64])
+    );
+  end
+endgenerate
 
 endmodule
@@ -0,0 +1,67 @@
+`include "axis_crossbar.v"
+
+module top #(
+  parameter AXIS_DATA_WIDTH = 256,
+  parameter AXIS_KEEP_WIDTH = AXIS_DATA_WIDTH / 8
+) (
+  input  reset,
+  input  clk,
+
+  input  [AXIS_DATA_WIDTH-1:0] eth_in_axis_tdata,
+  input  [AXIS_KEEP_WIDTH-1:0] eth_in_axis_tkeep,
+  input                        eth_in_axis_tlast,
+  input                        eth_in_axis_tvalid,
+  output                       eth_in_axis_tready,
+  output [AXIS_DATA_WIDTH-1:0] eth_out_axis_tdata,
+  output [AXIS_KEEP_WIDTH-1:0] eth_out_axis_tkeep,
+  output                       eth_out_axis_tlast,
+  output                       eth_out_axis_tvalid,
+  input                        eth_out_axis_tready,
+
+  output [AXIS_DATA_WIDTH-1:0] pcie_out_axis_tdata,
+  output [AXIS_KEEP_WIDTH-1:0] pcie_out_axis_tkeep,
+  output                       pcie_out_axis_tlast,
+  output                       pcie_out_axis_tvalid,
+  input                        pcie_out_axis_tready,
+  input  [AXIS_DATA_WIDTH-1:0] pcie_in_axis_tdata,
+  input  [AXIS_KEEP_WIDTH-1:0] pcie_in_axis_tkeep,
+  input                        pcie_in_axis_tlast,
+  input                        pcie_in_axis_tvalid,
+  output                       pcie_in_axis_tready
+);
+
+axis_crossbar #(
+  .DATA_WIDTH(AXIS_DATA_WIDTH),
+  .KEEP_WIDTH(AXIS_KEEP_WIDTH)
+) crossbar_rx_inst (
+  .clk(clk),
+  .in_axis_tdata(eth_in_axis_tdata),
+  .in_axis_tkeep(eth_in_axis_tkeep),
+  .in_axis_tlast(eth_in_axis_tlast),
+  .in_axis_tvalid(eth_in_axis_tvalid),
+  .in_axis_tready(eth_in_axis_tready),
+  .out_axis_tdata(pcie_out_axis_tdata),
+  .out_axis_tkeep(pcie_out_axis_tkeep),
+  .out_axis_tlast(pcie_out_axis_tlast),
+  .out_axis_tvalid(pcie_out_axis_tvalid),
+  .out_axis_tready(pcie_out_axis_tready)
+);
+
+axis_crossbar #(
+  .DATA_WIDTH(AXIS_DATA_WIDTH),
+  .KEEP_WIDTH(AXIS_KEEP_WIDTH)
+) crossbar_tx_inst (
+  .clk(clk),
+  .in_axis_tdata(pcie_in_axis_tdata),
+  .in_axis_tkeep(pcie_in_axis_tkeep),
+  .in_axis_tlast(pcie_in_axis_tlast),
+  .in_axis_tvalid(pcie_in_axis_tvalid),
+  .in_axis_tready(pcie_in_axis_tready),
+  .out_axis_tdata(eth_out_axis_tdata),
+  .out_axis_tkeep(eth_out_axis_tkeep),
+  .out_axis_tlast(eth_out_axis_tlast),
+  .out_axis_tvalid(eth_out_axis_tvalid),
+  .out_axis_tready(eth_out_axis_tready)
+);
+
+endmodule
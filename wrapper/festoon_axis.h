@@ -0,0 +1,113 @@
+#ifndef FESTOON_AXIS_H
+#define FESTOON_AXIS_H
+
+#include <rte_cycles.h>
+#include <rte_mbuf.h>
+#include <rte_memcpy.h>
+
+#include <string.h>
+
+#include "festoon_common.h"
+#include "festoon_xgmii.h"
+#include "params.h"
+
+// A single AXI-Stream beat of Width bits, as driven into and sampled from the
+// model. Packets are carried without preamble, from byte 0 of the beat.
+template <unsigned Width>
+struct axis_beat {
+  static_assert(Width >= 64 && Width <= 512 && (Width & (Width - 1)) == 0,
+                "AXI-Stream width must be a power of two from 64 to 512 bits");
+  static constexpr unsigned bytes = Width / 8;
+
+  uint8_t data[bytes];  // tdata, byte 0 in the lowest lane
+  uint64_t keep;        // tkeep, one bit per data byte
+  bool last;            // tlast, set on the final beat of a packet
+};
+
+// Cursor over a packet being cut into AXI-Stream beats
+struct axis_encoder {
+  rte_mbuf *pkt;  // Packet being encoded, nullptr when there is none
+  uint32_t off;   // Next byte of pkt to encode
+};
+
+// Copy a beat field into a Verilator signal of any width. Signals are stored
+// little-endian in CData through QData, and in 32 bit words for VlWide.
+template <typename Sig>
+static inline void vl_store(Sig &sig, const void *src, unsigned len) {
+  memcpy(&sig, src, len);
+}
+
+// Copy a Verilator signal of any width out into a beat field
+template <typename Sig>
+static inline void vl_load(void *dst, const Sig &sig, unsigned len) {
+  memcpy(dst, &sig, len);
+}
+
+// Produce the next beat of the loaded packet. The encoder frees the packet
+// once its last beat is out.
+template <unsigned Width>
+static inline void axis_encode_beat(axis_encoder *enc, axis_beat<Width> *beat) {
+  uint32_t n = RTE_MIN(rte_pktmbuf_pkt_len(enc->pkt) - enc->off, axis_beat<Width>::bytes);
+
+  rte_memcpy(beat->data, rte_pktmbuf_mtod_offset(enc->pkt, void *, enc->off), n);
+  beat->keep = n == 64 ? ~0ULL : (1ULL << n) - 1;
+  enc->off += n;
+  beat->last = enc->off == rte_pktmbuf_pkt_len(enc->pkt);
+
+  if (beat->last) {
+    rte_pktmbuf_free(enc->pkt);
+    enc->pkt = nullptr;
+  }
+}
+
+// Reassemble a beat coming out of the model. Packets are collected in the
+// same burst as XGMII ones, so xgmii_decoder_flush passes them on. It has to be
+// called after every last beat to keep the burst from overflowing.
+template <unsigned Width>
+static inline void axis_decode_beat(xgmii_decoder *dec, const axis_beat<Width> *beat) {
+  unsigned n = __builtin_popcountll(beat->keep);
+
+  // First beat of a packet
+  if (!dec->in_pkt) {
+    dec->in_pkt = true;
+    dec->pkt_len = 0;
+    dec->pkt = rte_pktmbuf_alloc(dec->mp);
+    if (likely(dec->pkt != nullptr))
+      dec->pkt_data = rte_pktmbuf_mtod(dec->pkt, uint8_t *);
+    else
+      dec->nb_dropped++;
+  }
+
+  if (likely(dec->pkt != nullptr)) {
+    if (unlikely(dec->pkt_len + n > MAX_PACKET_SZ)) {
+      rte_pktmbuf_free(dec->pkt);
+      dec->pkt = nullptr;
+      dec->nb_dropped++;
+    } else {
+      rte_memcpy(dec->pkt_data + dec->pkt_len, beat->data, n);
+      dec->pkt_len += n;
+    }
+  }
+  dec->pending_beats++;
+
+  if (!beat->last)
+    return;
+
+  dec->in_pkt = false;
+  if (likely(dec->pkt != nullptr)) {
+    dec->pkt->data_len = dec->pkt_len;
+    dec->pkt->pkt_len = dec->pkt_len;
+    if (unlikely(lat_enabled()))
+      lat_decoded(dec->pkt, dec->port_id, dec->tid, dec->clock);
+    dec->done[dec->nb_done++] = dec->pkt;
+    dec->pkt = nullptr;
+
+    // Start the flush timeout when the first packet of a burst is done
+    if (dec->nb_done == 1) {
+      dec->pending_tsc = rte_rdtsc();
+      dec->pending_beats = 0;
+    }
+  }
+}
+
+#endif
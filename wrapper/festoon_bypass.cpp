@@ -0,0 +1,282 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rte_byteorder.h>
+#include <rte_ether.h>
+#include <rte_ip.h>
+
+#include "festoon_bypass.h"
+#include "festoon_common.h"
+#include "festoon_latency.h"
+
+bypass_config bypass_conf;
+bool bypass_on = false;
+
+// Rings each side of each port bypasses the model to
+struct bypass_rings {
+  rte_ring *rings[FLOW_STEER_MAX_RINGS];
+  unsigned nb_rings;
+};
+
+static bypass_rings bypass_ring_sets[RTE_MAX_ETHPORTS][2];
+
+// Packets each lcore has let through so far, to sample them
+struct bypass_lcore {
+  uint32_t count;
+} __rte_cache_aligned;
+
+static bypass_lcore bypass_lcores[RTE_MAX_LCORE + 1];
+
+// What rules are matched on, pulled out of a packet
+struct bypass_tuple {
+  uint32_t addr[2];  // Source and destination, in network order, for IPv4
+  uint16_t port[2];  // Source and destination ports, if has_ports
+  uint8_t proto;
+  bool ipv4, has_ports;
+};
+
+// Parse "A.B.C.D[/LEN]" into an address and mask
+static int bypass_parse_addr(const char *arg, uint32_t *addr, uint32_t *mask) {
+  char buf[INET_ADDRSTRLEN + 3], *slash, *end = NULL;
+  unsigned long len = 32;
+  in_addr in;
+
+  if (strlen(arg) >= sizeof(buf))
+    return -1;
+  strcpy(buf, arg);
+
+  if ((slash = strchr(buf, '/')) != NULL) {
+    *slash = '\0';
+    errno = 0;
+    len = strtoul(slash + 1, &end, 10);
+    if (errno != 0 || end == slash + 1 || *end != '\0' || len > 32)
+      return -1;
+  }
+  if (inet_pton(AF_INET, buf, &in) != 1)
+    return -1;
+
+  *mask = len == 0 ? 0 : rte_cpu_to_be_32(UINT32_MAX << (32 - len));
+  *addr = in.s_addr & *mask;
+  return 0;
+}
+
+// Parse "N[-M]" into a port range
+static int bypass_parse_ports(const char *arg, uint16_t *lo, uint16_t *hi) {
+  char *end = NULL;
+  unsigned long first, last;
+
+  errno = 0;
+  first = last = strtoul(arg, &end, 10);
+  if (errno != 0 || end == arg || first > UINT16_MAX)
+    return -1;
+  if (*end == '-') {
+    arg = end + 1;
+    last = strtoul(arg, &end, 10);
+    if (errno != 0 || end == arg || last > UINT16_MAX || last < first)
+      return -1;
+  }
+  if (*end != '\0')
+    return -1;
+
+  *lo = first;
+  *hi = last;
+  return 0;
+}
+
+static int bypass_parse_proto(const char *arg, uint8_t *proto) {
+  char *end = NULL;
+  unsigned long num;
+
+  if (!strcmp(arg, "tcp")) {
+    *proto = IPPROTO_TCP;
+  } else if (!strcmp(arg, "udp")) {
+    *proto = IPPROTO_UDP;
+  } else if (!strcmp(arg, "sctp")) {
+    *proto = IPPROTO_SCTP;
+  } else if (!strcmp(arg, "icmp")) {
+    *proto = IPPROTO_ICMP;
+  } else {
+    errno = 0;
+    num = strtoul(arg, &end, 10);
+    if (errno != 0 || end == arg || *end != '\0' || num == 0 || num > UINT8_MAX)
+      return -1;
+    *proto = num;
+  }
+  return 0;
+}
+
+int bypass_add_rule(const char *arg) {
+  char buf[256], *field, *val, *save = NULL;
+  bypass_rule rule;
+  int ret = 0;
+
+  if (bypass_conf.nb_rules == BYPASS_MAX_RULES || strlen(arg) >= sizeof(buf))
+    return -1;
+  strcpy(buf, arg);
+
+  memset(&rule, 0, sizeof(rule));
+  rule.port_hi[0] = rule.port_hi[1] = UINT16_MAX;
+
+  for (field = strtok_r(buf, ",", &save); field != NULL && ret == 0;
+       field = strtok_r(NULL, ",", &save)) {
+    if ((val = strchr(field, '=')) == NULL)
+      return -1;
+    *val++ = '\0';
+
+    if (!strcmp(field, "proto"))
+      ret = bypass_parse_proto(val, &rule.proto);
+    else if (!strcmp(field, "src"))
+      ret = bypass_parse_addr(val, &rule.addr[0], &rule.mask[0]);
+    else if (!strcmp(field, "dst"))
+      ret = bypass_parse_addr(val, &rule.addr[1], &rule.mask[1]);
+    else if (!strcmp(field, "sport"))
+      ret = bypass_parse_ports(val, &rule.port_lo[0], &rule.port_hi[0]);
+    else if (!strcmp(field, "dport"))
+      ret = bypass_parse_ports(val, &rule.port_lo[1], &rule.port_hi[1]);
+    else
+      ret = -1;
+  }
+  if (ret < 0)
+    return -1;
+
+  bypass_conf.rules[bypass_conf.nb_rules++] = rule;
+  return 0;
+}
+
+void bypass_init(void) {
+  bypass_on = bypass_conf.nb_rules != 0 || bypass_conf.sample > 1 || bypass_conf.flow_sample > 1;
+  if (bypass_on)
+    RTE_LOG(INFO, APP, "Model sees 1 in %u flows and 1 in %u packets%s\n",
+            RTE_MAX(bypass_conf.flow_sample, 1U), RTE_MAX(bypass_conf.sample, 1U),
+            bypass_conf.nb_rules ? " matching the rules" : "");
+}
+
+void bypass_set_rings(uint16_t port_id, uint8_t tid, rte_ring *const *rings, unsigned nb_rings) {
+  bypass_rings *br = &bypass_ring_sets[port_id][tid];
+
+  br->nb_rings = RTE_MIN(nb_rings, (unsigned)FLOW_STEER_MAX_RINGS);
+  memcpy(br->rings, rings, br->nb_rings * sizeof(rings[0]));
+}
+
+// Same parsing as flow_hash(). Returns false for packets that aren't IP.
+static bool bypass_parse(const rte_mbuf *pkt, bypass_tuple *t) {
+  const rte_ether_hdr *eth = rte_pktmbuf_mtod(pkt, const rte_ether_hdr *);
+  const uint8_t *end = rte_pktmbuf_mtod(pkt, const uint8_t *) + rte_pktmbuf_data_len(pkt);
+  const rte_ipv4_hdr *ip4;
+  const rte_ipv6_hdr *ip6;
+  const uint16_t *ports = nullptr;
+
+  if (unlikely(rte_pktmbuf_data_len(pkt) < sizeof(*eth)))
+    return false;
+
+  switch (eth->ether_type) {
+  case RTE_BE16(RTE_ETHER_TYPE_IPV4):
+    if (unlikely(rte_pktmbuf_data_len(pkt) < sizeof(*eth) + sizeof(*ip4)))
+      return false;
+    ip4 = (const rte_ipv4_hdr *)(eth + 1);
+    t->addr[0] = ip4->src_addr;
+    t->addr[1] = ip4->dst_addr;
+    t->proto = ip4->next_proto_id;
+    t->ipv4 = true;
+    if (!rte_ipv4_frag_pkt_is_fragmented(ip4))
+      ports = (const uint16_t *)((const uint8_t *)ip4 + rte_ipv4_hdr_len(ip4));
+    break;
+  case RTE_BE16(RTE_ETHER_TYPE_IPV6):
+    if (unlikely(rte_pktmbuf_data_len(pkt) < sizeof(*eth) + sizeof(*ip6)))
+      return false;
+    ip6 = (const rte_ipv6_hdr *)(eth + 1);
+    t->proto = ip6->proto;
+    t->ipv4 = false;
+    ports = (const uint16_t *)(ip6 + 1);
+    break;
+  default:
+    return false;
+  }
+
+  t->has_ports = ports != nullptr && (const uint8_t *)(ports + 2) <= end &&
+                 (t->proto == IPPROTO_TCP || t->proto == IPPROTO_UDP || t->proto == IPPROTO_SCTP);
+  if (t->has_ports) {
+    t->port[0] = rte_be_to_cpu_16(ports[0]);
+    t->port[1] = rte_be_to_cpu_16(ports[1]);
+  }
+  return true;
+}
+
+// Whether a rule matches, with the packet's source and destination swapped
+// round if reverse
+static bool bypass_rule_match(const bypass_rule *r, const bypass_tuple *t, unsigned reverse) {
+  unsigned i, f;
+
+  if (r->proto != 0 && r->proto != t->proto)
+    return false;
+
+  for (i = 0; i < 2; i++) {
+    f = i ^ reverse;
+    if (r->mask[i] != 0 && (!t->ipv4 || (t->addr[f] & r->mask[i]) != r->addr[i]))
+      return false;
+    if ((r->port_lo[i] != 0 || r->port_hi[i] != UINT16_MAX) &&
+        (!t->has_ports || t->port[f] < r->port_lo[i] || t->port[f] > r->port_hi[i]))
+      return false;
+  }
+  return true;
+}
+
+static bool bypass_to_model(const rte_mbuf *pkt, bypass_lcore *lc) {
+  bypass_tuple t;
+  unsigned i;
+
+  if (bypass_conf.nb_rules != 0) {
+    if (!bypass_parse(pkt, &t))
+      return false;
+    for (i = 0; i < bypass_conf.nb_rules; i++) {
+      if (bypass_rule_match(&bypass_conf.rules[i], &t, 0) ||
+          bypass_rule_match(&bypass_conf.rules[i], &t, 1))
+        break;
+    }
+    if (i == bypass_conf.nb_rules)
+      return false;
+  }
+
+  // Both directions of a flow hash the same way, so replies are sampled too
+  if (bypass_conf.flow_sample > 1 && flow_hash(pkt) % bypass_conf.flow_sample != 0)
+    return false;
+
+  return bypass_conf.sample <= 1 || lc->count++ % bypass_conf.sample == 0;
+}
+
+unsigned bypass_burst(rte_mbuf **pkts, unsigned nb_pkts, uint16_t port_id, uint8_t tid) {
+  const bypass_rings *br = &bypass_ring_sets[port_id][tid];
+  unsigned lcore_id = rte_lcore_id(), i, nb = 0, nb_bypass = 0, nb_tx;
+  bypass_lcore *lc = &bypass_lcores[lcore_id < RTE_MAX_LCORE ? lcore_id : RTE_MAX_LCORE];
+  rte_mbuf *bypass[FLOW_STEER_MAX_BURST];
+
+  for (i = 0; i < nb_pkts; i++) {
+    if (bypass_to_model(pkts[i], lc)) {
+      pkts[nb++] = pkts[i];
+      continue;
+    }
+
+    // Leave the flags it came in with behind, like a packet out of the model,
+    // and don't time it through a model it never went through
+    pkts[i]->ol_flags = 0;
+    if (unlikely(lat_enabled()))
+      lat_get_stamp(pkts[i])->in = 0;
+    bypass[nb_bypass++] = pkts[i];
+  }
+
+  if (nb_bypass == 0)
+    return nb;
+
+  nb_tx = br->nb_rings ? flow_steer_burst(br->rings, br->nb_rings, bypass, nb_bypass) : 0;
+  if (nb_tx) get_kni_stats()[port_id].bypass_packets[tid] += nb_tx;
+
+  if (unlikely(nb_tx < nb_bypass)) {
+    kni_burst_free_mbufs(&bypass[nb_tx], nb_bypass - nb_tx);
+    get_kni_stats()[port_id].bypass_dropped[tid] += nb_bypass - nb_tx;
+  }
+
+  return nb;
+}
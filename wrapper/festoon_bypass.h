@@ -0,0 +1,54 @@
+#ifndef FESTOON_BYPASS_H
+#define FESTOON_BYPASS_H
+
+#include <rte_mbuf.h>
+#include <rte_ring.h>
+
+#include "params.h"
+
+// Traffic sampling. Packets coming in from the NIC or the host are classified
+// before they are queued for the model, and the ones it isn't to see go
+// straight to the TX ring on the other side of the port, as if it had passed
+// them through untouched. A packet goes through the model if it matches one
+// of the rules, or there are none, and it is in the packets or flows sampled.
+
+// 5-tuple a packet is matched against, either way round so that replies go
+// the same way as the flow. Only IPv4 packets have addresses to match.
+struct bypass_rule {
+  uint32_t addr[2], mask[2];          // Source and destination, in network order. 0/0 for any.
+  uint16_t port_lo[2], port_hi[2];    // Source and destination port ranges, 0-65535 for any
+  uint8_t proto;                      // IP protocol, or 0 for any
+};
+
+struct bypass_config {
+  uint32_t sample;       // 1 in this many packets goes through the model, 0 or 1 for all
+  uint32_t flow_sample;  // 1 in this many flows, by flow_hash(), 0 or 1 for all
+  bypass_rule rules[BYPASS_MAX_RULES];
+  unsigned nb_rules;
+};
+
+extern bypass_config bypass_conf;
+
+// Whether any packets are kept out of the model, set by bypass_init()
+extern bool bypass_on;
+
+static inline bool bypass_enabled() {
+  return bypass_on;
+}
+
+// Parse a rule like "proto=tcp,src=10.0.0.0/8,dport=80-89" into bypass_conf
+int bypass_add_rule(const char *arg);
+
+// Start classifying packets, if bypass_conf keeps any out of the model
+void bypass_init(void);
+
+// Rings packets coming in on side tid of a port bypass the model to: the
+// Ethernet TX rings for packets from the host, and the other way round
+void bypass_set_rings(uint16_t port_id, uint8_t tid, rte_ring *const *rings, unsigned nb_rings);
+
+// Send the packets of a burst of up to FLOW_STEER_MAX_BURST that bypass the
+// model to their rings, keeping the rest in order at the start of pkts.
+// Returns how many are left for the model.
+unsigned bypass_burst(rte_mbuf **pkts, unsigned nb_pkts, uint16_t port_id, uint8_t tid);
+
+#endif
@@ -1,9 +1,20 @@
+#include <rte_ether.h>
+#include <rte_ip.h>
+#include <rte_jhash.h>
 #include <rte_mbuf.h>
+#include <rte_ring.h>
 
 #include "festoon_common.h"
 
-/* kni device statistics array */
-kni_interface_stats kni_stats[RTE_MAX_ETHPORTS];
+/* kni device statistics, per lcore */
+kni_lcore_stats kni_stats[RTE_MAX_LCORE + 1];
+
+/* Sums of the counters when they were last reset */
+static kni_interface_stats kni_stats_base[RTE_MAX_ETHPORTS];
+
+static_assert(sizeof(kni_interface_stats) % sizeof(uint64_t) == 0,
+              "Stats are summed as arrays of 64-bit counters");
+#define KNI_STATS_WORDS (sizeof(kni_interface_stats) / sizeof(uint64_t))
 
 void kni_burst_free_mbufs(rte_mbuf **pkts, unsigned num) {
   unsigned i;
@@ -16,6 +27,142 @@ void kni_burst_free_mbufs(rte_mbuf **pkts, unsigned num) {
   }
 }
 
-kni_interface_stats *get_kni_stats() {
-  return kni_stats;
-}
\ No newline at end of file
+static void kni_stats_sum(uint16_t port_id, kni_interface_stats *st) {
+  uint64_t *sum = (uint64_t *)st;
+  const uint64_t *words;
+  unsigned lcore_id, i;
+
+  memset(st, 0, sizeof(*st));
+  for (lcore_id = 0; lcore_id <= RTE_MAX_LCORE; lcore_id++) {
+    words = (const uint64_t *)&kni_stats[lcore_id].port[port_id];
+    for (i = 0; i < KNI_STATS_WORDS; i++)
+      sum[i] += __atomic_load_n(&words[i], __ATOMIC_RELAXED);
+  }
+}
+
+void kni_stats_read(uint16_t port_id, kni_interface_stats *st) {
+  const uint64_t *base = (const uint64_t *)&kni_stats_base[port_id];
+  uint64_t *sum = (uint64_t *)st;
+  unsigned i;
+
+  kni_stats_sum(port_id, st);
+  for (i = 0; i < KNI_STATS_WORDS; i++)
+    sum[i] -= base[i];
+}
+
+void kni_stats_reset(void) {
+  uint16_t port_id;
+
+  for (port_id = 0; port_id < RTE_MAX_ETHPORTS; port_id++)
+    kni_stats_sum(port_id, &kni_stats_base[port_id]);
+}
+
+#ifdef FESTOON_CYCLE_STATS
+/* Cycle accounting, per lcore, and what it was when last reset */
+lcore_cycle_stats cycle_stats[RTE_MAX_LCORE + 1];
+static lcore_cycle_stats cycle_stats_base[RTE_MAX_LCORE + 1];
+
+static_assert(sizeof(lcore_cycle_stats) % sizeof(uint64_t) == 0,
+              "Cycle stats are read as arrays of 64-bit counters");
+#define CYCLE_STATS_WORDS (sizeof(lcore_cycle_stats) / sizeof(uint64_t))
+
+void cycle_stats_read(unsigned lcore_id, lcore_cycle_stats *st) {
+  const uint64_t *words = (const uint64_t *)&cycle_stats[lcore_id];
+  const uint64_t *base = (const uint64_t *)&cycle_stats_base[lcore_id];
+  uint64_t *dst = (uint64_t *)st;
+  unsigned i;
+
+  for (i = 0; i < CYCLE_STATS_WORDS; i++)
+    dst[i] = __atomic_load_n(&words[i], __ATOMIC_RELAXED) - base[i];
+}
+
+void cycle_stats_reset(void) {
+  const uint64_t *words;
+  uint64_t *base;
+  unsigned lcore_id, i;
+
+  for (lcore_id = 0; lcore_id <= RTE_MAX_LCORE; lcore_id++) {
+    words = (const uint64_t *)&cycle_stats[lcore_id];
+    base = (uint64_t *)&cycle_stats_base[lcore_id];
+    for (i = 0; i < CYCLE_STATS_WORDS; i++)
+      base[i] = __atomic_load_n(&words[i], __ATOMIC_RELAXED);
+  }
+}
+#else
+void cycle_stats_read(unsigned, lcore_cycle_stats *st) {
+  memset(st, 0, sizeof(*st));
+}
+
+void cycle_stats_reset(void) {}
+#endif
+
+uint32_t flow_hash(const rte_mbuf *pkt) {
+  const rte_ether_hdr *eth = rte_pktmbuf_mtod(pkt, const rte_ether_hdr *);
+  const rte_ipv4_hdr *ip4;
+  const rte_ipv6_hdr *ip6;
+  const uint32_t *ip6_addr;
+  const uint16_t *ports = nullptr;
+  uint32_t addrs = 0, l4 = 0, proto;
+  unsigned i;
+
+  switch (eth->ether_type) {
+  case RTE_BE16(RTE_ETHER_TYPE_IPV4):
+    if (unlikely(rte_pktmbuf_data_len(pkt) < sizeof(*eth) + sizeof(*ip4)))
+      return 0;
+    ip4 = (const rte_ipv4_hdr *)(eth + 1);
+    addrs = ip4->src_addr ^ ip4->dst_addr;
+    proto = ip4->next_proto_id;
+
+    // Only the first fragment has ports, so leave them out for all of them
+    if (!rte_ipv4_frag_pkt_is_fragmented(ip4))
+      ports = (const uint16_t *)((const uint8_t *)ip4 + rte_ipv4_hdr_len(ip4));
+    break;
+  case RTE_BE16(RTE_ETHER_TYPE_IPV6):
+    if (unlikely(rte_pktmbuf_data_len(pkt) < sizeof(*eth) + sizeof(*ip6)))
+      return 0;
+    ip6 = (const rte_ipv6_hdr *)(eth + 1);
+    ip6_addr = (const uint32_t *)ip6->src_addr;
+    for (i = 0; i < 8; i++)
+      addrs ^= ip6_addr[i];
+    proto = ip6->proto;
+    ports = (const uint16_t *)(ip6 + 1);
+    break;
+  default:
+    return 0;
+  }
+
+  // XOR both ends together so that replies hash the same way
+  if (ports != nullptr && (proto == IPPROTO_TCP || proto == IPPROTO_UDP || proto == IPPROTO_SCTP) &&
+      (const uint8_t *)(ports + 2) <= rte_pktmbuf_mtod(pkt, const uint8_t *) + rte_pktmbuf_data_len(pkt))
+    l4 = ports[0] ^ ports[1];
+
+  return rte_jhash_3words(addrs, l4, proto, 0);
+}
+
+unsigned flow_steer_burst(rte_ring *const *rings, unsigned nb_rings, rte_mbuf **pkts,
+                          unsigned nb) {
+  rte_mbuf *bins[FLOW_STEER_MAX_RINGS][FLOW_STEER_MAX_BURST];
+  unsigned nb_bin[FLOW_STEER_MAX_RINGS] = {0};
+  unsigned i, r, nb_tx = 0, nb_left = 0, sent;
+
+  if (nb_rings == 1)
+    return rte_ring_enqueue_burst(rings[0], (void **)pkts, nb, nullptr);
+
+  for (i = 0; i < nb; i++) {
+    r = flow_hash(pkts[i]) % nb_rings;
+    bins[r][nb_bin[r]++] = pkts[i];
+  }
+
+  // Every packet is in a bin now, so the ones left over can go back at the end
+  for (r = 0; r < nb_rings; r++) {
+    if (nb_bin[r] == 0)
+      continue;
+
+    sent = rte_ring_enqueue_burst(rings[r], (void **)bins[r], nb_bin[r], nullptr);
+    nb_tx += sent;
+    for (i = sent; i < nb_bin[r]; i++)
+      pkts[nb - ++nb_left] = bins[r][i];
+  }
+
+  return nb_tx;
+}
@@ -1,12 +1,40 @@
 #ifndef FESTOON_COMMON_H
 #define FESTOON_COMMON_H
 
+#include <rte_cycles.h>
+#include <rte_lcore.h>
 #include <rte_mbuf.h>
+#include <rte_ring.h>
 
 #include "params.h"
 
 void kni_burst_free_mbufs(rte_mbuf **pkts, unsigned num);
 
+// Hash of a packet's flow, the same for both of its directions. Packets that
+// aren't IPv4 or IPv6 all hash to 0.
+uint32_t flow_hash(const rte_mbuf *pkt);
+
+// Enqueue a burst of up to FLOW_STEER_MAX_BURST packets into up to
+// FLOW_STEER_MAX_RINGS rings, keeping each flow on the same ring. Returns how
+// many were enqueued; the ones that weren't are left at the end of pkts.
+unsigned flow_steer_burst(rte_ring *const *rings, unsigned nb_rings, rte_mbuf **pkts,
+                          unsigned nb);
+
+// XGMII control characters
+#define XGMII_IDLE  0x07
+#define XGMII_START 0xfb
+#define XGMII_TERM  0xfd
+
+// A single XGMII beat, as carried on the XGMII rings
+struct xgmii_beat {
+  uint64_t data;    // 8 lanes of data, lane 0 in the lowest byte
+  uint8_t ctrl;     // Control bit for each lane
+  uint8_t rsvd[3];  // Pads the beat to 16 bytes
+  uint32_t repeat;  // Further idle beats this one stands for, if idles are run-length encoded
+};
+
+static_assert(sizeof(xgmii_beat) == 16, "XGMII beats must stay 16 bytes wide");
+
 // Structure of port parameters
 struct kni_port_params {
   uint16_t port_id;            // Port ID
@@ -19,10 +47,20 @@ struct kni_port_params {
   unsigned lcore_kni_mii_rx;   // lcore ID for XGMII recieve worker
   unsigned lcore_kni_mii_tx;   // lcore ID for XGMII transmit worker
   unsigned lcore_worker_vtop;  // lcore ID for Verilator worker
+  uint16_t vtop_port;          // Port on the model this one is wired to
+  uint16_t nb_eth_rxq;         // Number of Ethernet RX queues, spread by RSS
+  uint16_t nb_eth_txq;         // Number of Ethernet TX queues
+  unsigned lcore_eth_rxq[ETH_MAX_QUEUES];  // lcore ID for each RX queue, starting with lcore_eth_rx
+  unsigned lcore_eth_txq[ETH_MAX_QUEUES];  // lcore ID for each TX queue, starting with lcore_eth_tx
   uint32_t nb_lcore_k;         // Number of lcores for KNI multi kernel threads
   uint32_t nb_kni;             // Number of KNI devices to be created
   unsigned lcore_k[KNI_MAX_KTHREAD];     // lcore ID list for kthreads
   struct rte_kni *kni[KNI_MAX_KTHREAD];  // KNI context pointers
+  uint16_t host_port_id;       // Port ID of the virtio-user or TAP host interface
+  uint16_t nb_host_queues;     // Queue pairs on it, 0 when there is none
+  uint64_t host_rx_offloads;   // RX offloads negotiated with it
+  uint64_t host_tx_offloads;   // TX offloads negotiated with it
+  int host_link_up;            // Link state last given to it
 } __rte_cache_aligned;
 
 // Structure type for recording kni interface specific stats
@@ -37,10 +75,107 @@ struct kni_interface_stats {
   uint64_t kni_tx_dropped; // number of pkts received from XGMII, but failed to send to KNI
   uint64_t xgmii_rx_packets[2]; // number of pkts received from DPDK, and sent to FPGA
   uint64_t xgmii_rx_dropped[2]; // number of pkts received from DPDK, but failed to send to FPGA
+  uint64_t xgmii_rx_rejected[2]; // number of pkts received from DPDK, too long, segmented or unsplittable to send to FPGA
   uint64_t xgmii_tx_packets[2]; // number of pkts received from FPGA, and sent to DPDK
   uint64_t xgmii_tx_dropped[2]; // number of pkts received from FPGA, but failed to send to DPDK
+  uint64_t xgmii_dec_beats[2];  // number of XGMII beats decoded
+  uint64_t xgmii_out_dropped[2];  // number of XGMII beats out of the model that didn't fit in their ring
+  uint64_t xgmii_dec_cycles[2]; // TSC cycles spent decoding them
+  uint64_t split_packets[2];    // number of pkts whose header alone was sent to FPGA
+  uint64_t split_expired[2];    // number of parked pkts dropped to make room, their header lost in FPGA
+  uint64_t split_lost[2];       // number of headers received from FPGA, whose pkt was no longer parked
+  uint64_t bypass_packets[2];   // number of pkts received from NIC or KNI, and sent round FPGA to the other side
+  uint64_t bypass_dropped[2];   // number of pkts received from NIC or KNI, but failed to send round FPGA
 };
 
-kni_interface_stats *get_kni_stats();
+// Counters of every port, kept by one lcore. Each lcore only adds to its own,
+// so busy lcores don't bounce cache lines between them, and they are summed up
+// when read.
+struct kni_lcore_stats {
+  kni_interface_stats port[RTE_MAX_ETHPORTS];
+} __rte_cache_aligned;
+
+// Threads that aren't lcores share the block past the last lcore
+extern kni_lcore_stats kni_stats[RTE_MAX_LCORE + 1];
+
+// Counters of the calling lcore, to add to
+static inline kni_interface_stats *get_kni_stats() {
+  unsigned lcore_id = rte_lcore_id();
+
+  return kni_stats[lcore_id < RTE_MAX_LCORE ? lcore_id : RTE_MAX_LCORE].port;
+}
+
+// Sum of a port's counters over all lcores, since they were last reset
+void kni_stats_read(uint16_t port_id, kni_interface_stats *st);
+
+// Reset the counters of every port. What the lcores hold now is taken off
+// later reads, rather than clearing counters they may be adding to.
+void kni_stats_reset(void);
+
+// Where an lcore's TSC cycles go, when built with FESTOON_CYCLE_STATS. A poll
+// is one pass of its main_loop role, and is busy if it moved any packets or
+// beats.
+struct lcore_cycle_stats {
+  uint64_t busy_polls;
+  uint64_t empty_polls;
+  uint64_t busy_cycles;   // TSC cycles spent in busy polls
+  uint64_t empty_cycles;  // TSC cycles spent in empty ones
+  uint64_t packets;       // Packets read, written, encoded or decoded
+  uint64_t beats;         // XGMII beats encoded, decoded or passed through the model
+  uint64_t evals;         // Calls to the model's eval()
+  uint64_t eval_cycles;   // TSC cycles spent in them
+} __rte_cache_aligned;
+
+#ifdef FESTOON_CYCLE_STATS
+extern lcore_cycle_stats cycle_stats[RTE_MAX_LCORE + 1];
+
+static inline lcore_cycle_stats *get_cycle_stats() {
+  unsigned lcore_id = rte_lcore_id();
+
+  return &cycle_stats[lcore_id < RTE_MAX_LCORE ? lcore_id : RTE_MAX_LCORE];
+}
+
+static inline void cycle_stats_packets(uint64_t n) {
+  get_cycle_stats()->packets += n;
+}
+
+static inline void cycle_stats_beats(uint64_t n) {
+  get_cycle_stats()->beats += n;
+}
+
+// Times one poll of the calling lcore, from its construction to the end of
+// its scope
+class cycle_poll {
+public:
+  cycle_poll() : cs(get_cycle_stats()), work(cs->packets + cs->beats), start(rte_rdtsc()) {}
+
+  ~cycle_poll() {
+    uint64_t cycles = rte_rdtsc() - start;
+
+    if (cs->packets + cs->beats != work) {
+      cs->busy_polls++;
+      cs->busy_cycles += cycles;
+    } else {
+      cs->empty_polls++;
+      cs->empty_cycles += cycles;
+    }
+  }
+
+private:
+  lcore_cycle_stats *cs;
+  uint64_t work, start;
+};
+#else
+static inline void cycle_stats_packets(uint64_t) {}
+static inline void cycle_stats_beats(uint64_t) {}
+
+class cycle_poll {};
+#endif
+
+// Counters of an lcore since they were last reset, all zero without
+// FESTOON_CYCLE_STATS
+void cycle_stats_read(unsigned lcore_id, lcore_cycle_stats *st);
+
+void cycle_stats_reset(void);
 
 #endif
\ No newline at end of file
@@ -1,33 +1,45 @@
 #include <rte_ethdev.h>
 #include <rte_ring.h>
 
+#include "festoon_bypass.h"
 #include "festoon_common.h"
 #include "festoon_eth.h"
+#include "festoon_latency.h"
 
 /**
- * Interface to burst rx and enqueue mbufs into rx_q
+ * Interface to burst rx from one queue and enqueue mbufs into rx_q
  */
-void eth_ingress(kni_port_params *p, rte_ring *worker_rx_ring) {
+unsigned eth_ingress(kni_port_params *p, uint16_t queue, rte_ring *const *worker_rx_rings,
+                 unsigned nb_rings) {
   uint8_t i;
   uint16_t port_id;
-  unsigned nb_rx, nb_tx;
+  unsigned nb_rx, nb_tx, nb_pkts = 0;
   uint32_t nb_kni;
   struct rte_mbuf *pkts_burst[PKT_BURST_SZ];
 
-  if (p == NULL) return;
+  if (p == NULL) return 0;
 
   nb_kni = p->nb_kni;
   port_id = p->port_id;
   for (i = 0; i < nb_kni; i++) {
     /* Burst rx from eth */
-    nb_rx = rte_eth_rx_burst(port_id, 0, pkts_burst, PKT_BURST_SZ);
+    nb_rx = rte_eth_rx_burst(port_id, queue, pkts_burst, PKT_BURST_SZ);
     if (unlikely(nb_rx > PKT_BURST_SZ)) {
       RTE_LOG(ERR, APP, "Error transmitting from eth\n");
-      return;
+      return nb_pkts;
     }
+    cycle_stats_packets(nb_rx);
+    nb_pkts += nb_rx;
 
-    /* Burst tx to worker_rx_ring */
-    nb_tx = rte_ring_enqueue_burst(worker_rx_ring, (void **)pkts_burst, nb_rx, NULL);
+    if (unlikely(lat_enabled()))
+      lat_ingress(pkts_burst, nb_rx);
+
+    /* Send what the model isn't to see straight to the host */
+    if (bypass_enabled())
+      nb_rx = bypass_burst(pkts_burst, nb_rx, port_id, 0);
+
+    /* Burst tx to worker_rx_rings, keeping flows together */
+    nb_tx = flow_steer_burst(worker_rx_rings, nb_rings, pkts_burst, nb_rx);
 
     if (nb_tx) get_kni_stats()[port_id].eth_rx_packets += nb_tx;
 
@@ -37,34 +49,41 @@ void eth_ingress(kni_port_params *p, rte_ring *worker_rx_ring) {
       get_kni_stats()[port_id].eth_rx_dropped += nb_rx - nb_tx;
     }
   }
+
+  return nb_pkts;
 }
 
 /**
- * Interface to dequeue mbufs from tx_q and burst tx
+ * Interface to dequeue mbufs from tx_q and burst tx on one queue
  */
-void eth_egress(kni_port_params *p, rte_ring *worker_tx_ring) {
+unsigned eth_egress(kni_port_params *p, uint16_t queue, rte_ring *worker_tx_ring) {
   uint8_t i;
   uint16_t port_id;
-  unsigned nb_tx, nb_rx;
+  unsigned nb_tx, nb_rx, nb_pkts = 0;
   uint32_t nb_kni;
   struct rte_mbuf *pkts_burst[PKT_BURST_SZ];
 
-  if (p == NULL) return;
+  if (p == NULL) return 0;
 
   nb_kni = p->nb_kni;
   port_id = p->port_id;
   for (i = 0; i < nb_kni; i++) {
-    if (rte_ring_empty(worker_tx_ring)) return;
+    if (rte_ring_empty(worker_tx_ring)) return nb_pkts;
 
     /* Burst rx from kni */
     nb_rx = rte_ring_dequeue_burst(worker_tx_ring, (void **)pkts_burst, PKT_BURST_SZ, nullptr);
     if (unlikely(nb_rx > PKT_BURST_SZ)) {
       RTE_LOG(ERR, APP, "Error receiving from eth\n");
-      return;
+      return nb_pkts;
     }
+    cycle_stats_packets(nb_rx);
+    nb_pkts += nb_rx;
+
+    if (unlikely(lat_enabled()))
+      lat_egress(pkts_burst, nb_rx, port_id, 0);
 
     /* Burst tx to eth */
-    nb_tx = rte_eth_tx_burst(port_id, 0, pkts_burst, (uint16_t) nb_rx);
+    nb_tx = rte_eth_tx_burst(port_id, queue, pkts_burst, (uint16_t) nb_rx);
 
     if (nb_tx) get_kni_stats()[port_id].eth_tx_packets += nb_tx;
 
@@ -74,4 +93,6 @@ void eth_egress(kni_port_params *p, rte_ring *worker_tx_ring) {
       get_kni_stats()[port_id].eth_tx_dropped += nb_rx - nb_tx;
     }
   }
+
+  return nb_pkts;
 }
\ No newline at end of file
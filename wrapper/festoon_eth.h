@@ -3,8 +3,11 @@
 
 #include "festoon_common.h"
 
-void eth_ingress(kni_port_params *p, rte_ring *worker_rx_ring);
+// Rings are picked by flow_hash when there is more than one. Both return the
+// number of packets they took in.
+unsigned eth_ingress(kni_port_params *p, uint16_t queue, rte_ring *const *worker_rx_rings,
+                     unsigned nb_rings);
 
-void eth_egress(kni_port_params *p, rte_ring *worker_tx_ring);
+unsigned eth_egress(kni_port_params *p, uint16_t queue, rte_ring *worker_tx_ring);
 
 #endif
\ No newline at end of file
@@ -1,20 +1,25 @@
-#include <rte_kni.h>
 #include <rte_mbuf.h>
 
+// KNI was dropped in DPDK 23.11
+#ifdef RTE_LIB_KNI
+#include <rte_kni.h>
+
+#include "festoon_bypass.h"
 #include "festoon_common.h"
 #include "festoon_kni.h"
+#include "festoon_latency.h"
 
 // Push mbufs from ring into KNI TX
-void kni_egress(kni_port_params *p, rte_ring *tx_ring)
+unsigned kni_egress(kni_port_params *p, rte_ring *tx_ring)
 {
   uint8_t i;
   uint16_t port_id;
-  unsigned nb_rx, nb_tx;
+  unsigned nb_rx, nb_tx, nb_pkts = 0;
   uint32_t nb_kni;
   struct rte_mbuf *pkts_burst[PKT_BURST_SZ];
 
   if (p == NULL)
-    return;
+    return 0;
 
   nb_kni = p->nb_kni;
   port_id = p->port_id;
@@ -23,8 +28,13 @@ void kni_egress(kni_port_params *p, rte_ring *tx_ring)
     nb_rx = rte_ring_dequeue_burst(tx_ring, (void **)pkts_burst, PKT_BURST_SZ, nullptr);
     if (unlikely(nb_rx > PKT_BURST_SZ)) {
       RTE_LOG(ERR, APP, "Error transmitting to KNI\n");
-      return;
+      return nb_pkts;
     }
+    cycle_stats_packets(nb_rx);
+    nb_pkts += nb_rx;
+
+    if (unlikely(lat_enabled()))
+      lat_egress(pkts_burst, nb_rx, port_id, 1);
 
     // Burst rx to kni
     nb_tx = rte_kni_tx_burst(p->kni[i], pkts_burst, nb_rx);
@@ -37,19 +47,21 @@ void kni_egress(kni_port_params *p, rte_ring *tx_ring)
       get_kni_stats()[port_id].kni_rx_dropped += nb_rx - nb_tx;
     }
   }
+
+  return nb_pkts;
 }
 
 // Push mbufs from KNI RX into ring
-void kni_ingress(kni_port_params *p, rte_ring *rx_ring)
+unsigned kni_ingress(kni_port_params *p, rte_ring *const *rx_rings, unsigned nb_rings)
 {
   uint8_t i;
   uint16_t port_id;
-  unsigned nb_tx, nb_rx;
+  unsigned nb_tx, nb_rx, nb_pkts = 0;
   uint32_t nb_kni;
   struct rte_mbuf *pkts_burst[PKT_BURST_SZ];
 
   if (p == NULL)
-    return;
+    return 0;
 
   nb_kni = p->nb_kni;
   port_id = p->port_id;
@@ -58,11 +70,20 @@ void kni_ingress(kni_port_params *p, rte_ring *rx_ring)
     nb_rx = rte_kni_rx_burst(p->kni[i], pkts_burst, PKT_BURST_SZ);
     if (unlikely(nb_rx > PKT_BURST_SZ)) {
       RTE_LOG(ERR, APP, "Error receiving from KNI\n");
-      return;
+      return nb_pkts;
     }
+    cycle_stats_packets(nb_rx);
+    nb_pkts += nb_rx;
 
-    // Burst tx to ring
-    nb_tx = rte_ring_enqueue_burst(rx_ring, (void **)pkts_burst, nb_rx, NULL);
+    if (unlikely(lat_enabled()))
+      lat_ingress(pkts_burst, nb_rx);
+
+    // Send what the model isn't to see straight to the NIC
+    if (bypass_enabled())
+      nb_rx = bypass_burst(pkts_burst, nb_rx, port_id, 1);
+
+    // Burst tx to rings, keeping flows together
+    nb_tx = flow_steer_burst(rx_rings, nb_rings, pkts_burst, nb_rx);
     if (nb_tx) get_kni_stats()[port_id].kni_tx_packets += nb_tx;
 
     if (unlikely(nb_tx < nb_rx)) {
@@ -71,4 +92,8 @@ void kni_ingress(kni_port_params *p, rte_ring *rx_ring)
       get_kni_stats()[port_id].kni_tx_dropped += nb_rx - nb_tx;
     }
   }
+
+  return nb_pkts;
 }
+
+#endif
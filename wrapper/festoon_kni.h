@@ -5,8 +5,10 @@
 
 #include "festoon_common.h"
 
-void kni_ingress(kni_port_params *p, rte_ring *rx_ring);
+// Rings are picked by flow_hash when there is more than one. Both return the
+// number of packets they took in.
+unsigned kni_ingress(kni_port_params *p, rte_ring *const *rx_rings, unsigned nb_rings);
 
-void kni_egress(kni_port_params *p, rte_ring *tx_ring);
+unsigned kni_egress(kni_port_params *p, rte_ring *tx_ring);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,356 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <rte_cycles.h>
+#include <rte_errno.h>
+#include <rte_hash_crc.h>
+#include <rte_malloc.h>
+#include <rte_mbuf_dyn.h>
+
+#include "festoon_latency.h"
+
+const char *const lat_stage_names[LAT_NB_STAGES] = {
+  "ring", "encode", "dut", "decode", "egress", "total", "cycles"
+};
+const char *const lat_side_names[LAT_NB_SIDES] = {"eth", "host"};
+
+int lat_dynfield = -1;
+lat_port_hists *lat_hists[RTE_MAX_LCORE + 1][RTE_MAX_ETHPORTS];
+
+// Sums of the histograms when they were last reset, allocated by the first reset
+static lat_port_hists *lat_base[RTE_MAX_ETHPORTS];
+
+static_assert(sizeof(lat_port_hists) % sizeof(uint64_t) == 0,
+              "Histograms are summed as arrays of 64-bit counters");
+#define LAT_HIST_WORDS (sizeof(lat_port_hists) / sizeof(uint64_t))
+
+static_assert((LAT_TABLE_SZ & (LAT_TABLE_SZ - 1)) == 0, "LAT_TABLE_SZ must be a power of two");
+
+// A packet in the model, waiting for a decoder to match it. sig is 0 when the
+// slot is free, and LAT_SLOT_BUSY while it's being filled in or taken.
+struct lat_slot {
+  uint64_t sig;
+  uint64_t in;     // Stamp of the packet at ingress
+  uint64_t enc;    // TSC when the encoder was done with it
+  uint64_t clock;  // Model cycles then, or LAT_NO_CLOCK
+};
+
+#define LAT_SLOT_BUSY 1
+#define LAT_NO_CLOCK UINT64_MAX
+
+// Slots after the one a packet hashes to that it may be put in. Copies of the
+// same packet fill them in turn, and are mostly matched in the same order.
+#define LAT_PROBE 8
+
+static lat_slot *lat_table;
+static uint64_t lat_max_age;
+
+lat_port_hists *lat_hists_alloc(unsigned slot, uint16_t port_id) {
+  lat_port_hists *h;
+
+  h = (lat_port_hists *)rte_zmalloc("lat_port_hists", sizeof(*h), RTE_CACHE_LINE_SIZE);
+  if (h != nullptr)
+    __atomic_store_n(&lat_hists[slot][port_id], h, __ATOMIC_RELEASE);
+  return h;
+}
+
+int lat_init(void) {
+  rte_mbuf_dynfield desc;
+  int off;
+
+  lat_table = (lat_slot *)rte_zmalloc("lat_table", sizeof(lat_slot) * LAT_TABLE_SZ,
+                                      RTE_CACHE_LINE_SIZE);
+  if (lat_table == nullptr)
+    return -ENOMEM;
+  lat_max_age = rte_get_tsc_hz() * LAT_MAX_AGE_MS / 1000;
+
+  memset(&desc, 0, sizeof(desc));
+  snprintf(desc.name, sizeof(desc.name), "festoon_dynfield_latency");
+  desc.size = sizeof(lat_stamp);
+  desc.align = __alignof__(lat_stamp);
+
+  off = rte_mbuf_dynfield_register(&desc);
+  if (off < 0) {
+    rte_free(lat_table);
+    lat_table = nullptr;
+    return -rte_errno;
+  }
+
+  lat_dynfield = off;
+  return 0;
+}
+
+// TSC cycles from then to now. Stamps taken on other cores can be a little
+// ahead.
+static inline uint64_t lat_since(uint64_t now, uint64_t then) {
+  return now > then ? now - then : 0;
+}
+
+// What a packet is matched by across the model. The top bit keeps it clear of
+// a free or busy slot.
+static inline uint64_t lat_sig(const rte_mbuf *pkt) {
+  uint32_t len = rte_pktmbuf_pkt_len(pkt);
+  uint32_t hash = rte_hash_crc(rte_pktmbuf_mtod(pkt, const void *),
+                               RTE_MIN((uint32_t)rte_pktmbuf_data_len(pkt), (uint32_t)LAT_SIG_BYTES),
+                               len);
+
+  return (1ULL << 63) | ((uint64_t)len << 32) | hash;
+}
+
+void lat_ingress(rte_mbuf **pkts, unsigned nb_pkts) {
+  uint64_t now;
+  lat_stamp *st;
+  unsigned i;
+
+  if (nb_pkts == 0)
+    return;
+
+  now = rte_rdtsc();
+  for (i = 0; i < nb_pkts; i++) {
+    st = lat_get_stamp(pkts[i]);
+    st->in = now;
+    st->last = now;
+  }
+}
+
+void lat_dequeued(rte_mbuf **pkts, unsigned nb_pkts, uint16_t port_id, uint8_t side) {
+  lat_port_hists *h;
+  lat_stamp *st;
+  uint64_t now;
+  unsigned i;
+
+  if (nb_pkts == 0 || (h = lat_get_hists(port_id)) == nullptr)
+    return;
+
+  now = rte_rdtsc();
+  for (i = 0; i < nb_pkts; i++) {
+    if (pkts[i] == nullptr)
+      continue;
+    st = lat_get_stamp(pkts[i]);
+    if (st->in == 0)
+      continue;
+
+    lat_hist_add(&h->hist[side][LAT_RING], lat_since(now, st->in));
+    st->last = now;
+  }
+}
+
+void lat_encoded(rte_mbuf *pkt, uint16_t port_id, uint8_t side, const uint64_t *clock) {
+  lat_stamp *st = lat_get_stamp(pkt);
+  uint64_t now, sig, cur;
+  lat_port_hists *h;
+  lat_slot *slot;
+  unsigned i;
+
+  if (st->in == 0)
+    return;
+
+  now = rte_rdtsc();
+  h = lat_get_hists(port_id);
+  if (h != nullptr)
+    lat_hist_add(&h->hist[side][LAT_ENCODE], lat_since(now, st->last));
+
+  // Take a free slot, or one whose packet was lost in the model. If there's
+  // none, the packet just isn't timed past here.
+  sig = lat_sig(pkt);
+  for (i = 0; i < LAT_PROBE; i++) {
+    slot = &lat_table[(sig + i) & (LAT_TABLE_SZ - 1)];
+    cur = __atomic_load_n(&slot->sig, __ATOMIC_ACQUIRE);
+    if (cur == LAT_SLOT_BUSY ||
+        (cur != 0 && lat_since(now, __atomic_load_n(&slot->enc, __ATOMIC_RELAXED)) < lat_max_age))
+      continue;
+    if (!__atomic_compare_exchange_n(&slot->sig, &cur, LAT_SLOT_BUSY, false, __ATOMIC_ACQUIRE,
+                                     __ATOMIC_RELAXED))
+      continue;
+
+    __atomic_store_n(&slot->in, st->in, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->enc, now, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->clock,
+                     clock != nullptr ? __atomic_load_n(clock, __ATOMIC_RELAXED) : LAT_NO_CLOCK,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->sig, sig, __ATOMIC_RELEASE);
+    return;
+  }
+}
+
+void lat_decoded(rte_mbuf *pkt, uint16_t port_id, uint8_t side, const uint64_t *clock) {
+  lat_stamp *st = lat_get_stamp(pkt);
+  uint64_t now, sig, cur, in, enc, cycles;
+  lat_port_hists *h;
+  lat_slot *slot;
+  unsigned i;
+
+  // The mbuf is new, so the stamp has to be set either way
+  st->in = 0;
+  h = lat_get_hists(port_id);
+
+  sig = lat_sig(pkt);
+  for (i = 0; i < LAT_PROBE; i++) {
+    slot = &lat_table[(sig + i) & (LAT_TABLE_SZ - 1)];
+    cur = sig;
+    if (__atomic_load_n(&slot->sig, __ATOMIC_RELAXED) != sig ||
+        !__atomic_compare_exchange_n(&slot->sig, &cur, LAT_SLOT_BUSY, false, __ATOMIC_ACQUIRE,
+                                     __ATOMIC_RELAXED))
+      continue;
+
+    in = __atomic_load_n(&slot->in, __ATOMIC_RELAXED);
+    enc = __atomic_load_n(&slot->enc, __ATOMIC_RELAXED);
+    cycles = __atomic_load_n(&slot->clock, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->sig, 0, __ATOMIC_RELEASE);
+
+    now = rte_rdtsc();
+    if (h != nullptr) {
+      lat_hist_add(&h->hist[side][LAT_DUT], lat_since(now, enc));
+      if (clock != nullptr && cycles != LAT_NO_CLOCK)
+        lat_hist_add(&h->hist[side][LAT_CYCLES],
+                     lat_since(__atomic_load_n(clock, __ATOMIC_RELAXED), cycles));
+    }
+    st->in = in;
+    st->last = now;
+    return;
+  }
+
+  if (h != nullptr)
+    h->unmatched[side]++;
+}
+
+void lat_flushed(rte_mbuf **pkts, unsigned nb_pkts, uint16_t port_id, uint8_t side) {
+  lat_port_hists *h;
+  lat_stamp *st;
+  uint64_t now;
+  unsigned i;
+
+  if (nb_pkts == 0 || (h = lat_get_hists(port_id)) == nullptr)
+    return;
+
+  now = rte_rdtsc();
+  for (i = 0; i < nb_pkts; i++) {
+    st = lat_get_stamp(pkts[i]);
+    if (st->in == 0)
+      continue;
+
+    lat_hist_add(&h->hist[side][LAT_DECODE], lat_since(now, st->last));
+    st->last = now;
+  }
+}
+
+void lat_egress(rte_mbuf **pkts, unsigned nb_pkts, uint16_t port_id, uint8_t side) {
+  lat_port_hists *h;
+  lat_stamp *st;
+  uint64_t now;
+  unsigned i;
+
+  if (nb_pkts == 0 || (h = lat_get_hists(port_id)) == nullptr)
+    return;
+
+  now = rte_rdtsc();
+  for (i = 0; i < nb_pkts; i++) {
+    st = lat_get_stamp(pkts[i]);
+    if (st->in == 0)
+      continue;
+
+    lat_hist_add(&h->hist[side][LAT_EGRESS], lat_since(now, st->last));
+    lat_hist_add(&h->hist[side][LAT_TOTAL], lat_since(now, st->in));
+  }
+}
+
+// Sum of a port's histograms over all lcores. Returns false if no lcore has
+// recorded anything for it.
+static bool lat_sum(uint16_t port_id, lat_port_hists *sum) {
+  uint64_t *words = (uint64_t *)sum;
+  const uint64_t *src;
+  lat_port_hists *h;
+  unsigned slot, i;
+  bool found = false;
+
+  memset(sum, 0, sizeof(*sum));
+  for (slot = 0; slot <= RTE_MAX_LCORE; slot++) {
+    h = __atomic_load_n(&lat_hists[slot][port_id], __ATOMIC_ACQUIRE);
+    if (h == nullptr)
+      continue;
+
+    src = (const uint64_t *)h;
+    for (i = 0; i < LAT_HIST_WORDS; i++)
+      words[i] += __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    found = true;
+  }
+
+  return found;
+}
+
+void lat_read(uint16_t port_id, lat_port_hists *h) {
+  const lat_port_hists *base = __atomic_load_n(&lat_base[port_id], __ATOMIC_ACQUIRE);
+  uint64_t *words = (uint64_t *)h;
+  const uint64_t *base_words = (const uint64_t *)base;
+  unsigned i;
+
+  if (!lat_sum(port_id, h) || base == nullptr)
+    return;
+
+  for (i = 0; i < LAT_HIST_WORDS; i++)
+    words[i] -= base_words[i];
+}
+
+void lat_reset(void) {
+  lat_port_hists *base;
+  uint16_t port_id;
+
+  for (port_id = 0; port_id < RTE_MAX_ETHPORTS; port_id++) {
+    base = lat_base[port_id];
+    if (base == nullptr) {
+      base = (lat_port_hists *)rte_zmalloc("lat_base", sizeof(*base), RTE_CACHE_LINE_SIZE);
+      if (base == nullptr)
+        continue;
+      if (!lat_sum(port_id, base)) {
+        rte_free(base);
+        continue;
+      }
+      __atomic_store_n(&lat_base[port_id], base, __ATOMIC_RELEASE);
+      continue;
+    }
+
+    lat_sum(port_id, base);
+  }
+}
+
+// Largest value that lands in a bucket
+static uint64_t lat_bucket_top(unsigned bucket) {
+  unsigned msb;
+
+  if (bucket < (1 << LAT_SUB_BITS))
+    return bucket;
+
+  msb = (bucket >> LAT_SUB_BITS) + LAT_SUB_BITS - 1;
+  return (((uint64_t)((1 << LAT_SUB_BITS) | (bucket & ((1 << LAT_SUB_BITS) - 1))) + 1)
+          << (msb - LAT_SUB_BITS)) - 1;
+}
+
+void lat_summarize(const lat_hist *h, unsigned stage, lat_summary *s) {
+  static const double pcts[] = {0.5, 0.9, 0.99, 0.999};
+  double *outs[] = {&s->p50, &s->p90, &s->p99, &s->p999};
+  double scale = stage == LAT_CYCLES ? 1.0 : 1e9 / rte_get_tsc_hz();
+  uint64_t total = 0, seen = 0;
+  unsigned b, i = 0;
+
+  memset(s, 0, sizeof(*s));
+  s->count = h->count;
+  if (h->count == 0)
+    return;
+  s->mean = (double)h->sum / h->count * scale;
+
+  // Counters summed while lcores add to them may not quite agree, so
+  // percentiles go by the buckets alone
+  for (b = 0; b < LAT_BUCKETS; b++)
+    total += h->buckets[b];
+
+  for (b = 0; b < LAT_BUCKETS; b++) {
+    if (h->buckets[b] == 0)
+      continue;
+
+    seen += h->buckets[b];
+    while (i < RTE_DIM(pcts) && seen >= pcts[i] * total)
+      *outs[i++] = lat_bucket_top(b) * scale;
+    s->max = lat_bucket_top(b) * scale;
+  }
+}
@@ -0,0 +1,149 @@
+#ifndef FESTOON_LATENCY_H
+#define FESTOON_LATENCY_H
+
+#include <rte_branch_prediction.h>
+#include <rte_lcore.h>
+#include <rte_mbuf.h>
+
+#include "params.h"
+
+// Stages of a packet's way through the wrapper and the model. The ones up to
+// the model are counted on the side the packet came in from, and the rest on
+// the side it went out to.
+enum lat_stage {
+  LAT_RING,    // From ingress until the encoder took it off its ring
+  LAT_ENCODE,  // Until its last beat was queued for the model, or driven into it
+  LAT_DUT,     // Until the decoder had all of it back out of the model
+  LAT_DECODE,  // Held in the decoder's burst until it was passed on
+  LAT_EGRESS,  // In the TX ring until it was handed to the NIC or the host
+  LAT_TOTAL,   // From ingress to egress
+  LAT_CYCLES,  // Model clock cycles, run or skipped, over the same span as LAT_DUT
+  LAT_NB_STAGES
+};
+
+// Sides of a port, as XGMII tids: 0 for Ethernet and 1 for PCIe to the host
+#define LAT_NB_SIDES 2
+
+extern const char *const lat_stage_names[LAT_NB_STAGES];
+extern const char *const lat_side_names[LAT_NB_SIDES];
+
+// HDR-style histogram. Values below 2^LAT_SUB_BITS get a bucket each, and each
+// power of two above that is split into 2^LAT_SUB_BITS buckets, so they are
+// all within 1 / 2^LAT_SUB_BITS of the value. Values from 2^LAT_MAX_BITS up
+// land in the last bucket.
+#define LAT_SUB_BITS 3
+#define LAT_MAX_BITS 40
+#define LAT_BUCKETS ((LAT_MAX_BITS - LAT_SUB_BITS + 1) << LAT_SUB_BITS)
+
+struct lat_hist {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t buckets[LAT_BUCKETS];
+};
+
+// Histograms of one port kept by one lcore, made of 64-bit counters only so
+// they can be summed like kni_interface_stats
+struct lat_port_hists {
+  lat_hist hist[LAT_NB_SIDES][LAT_NB_STAGES];
+  uint64_t unmatched[LAT_NB_SIDES];  // Packets out of the model with no stamp to match
+};
+
+// Ingress stamp carried in an mbuf dynfield. in is 0 for packets that aren't
+// being timed.
+struct lat_stamp {
+  uint64_t in;    // TSC at ingress
+  uint64_t last;  // TSC at the end of the last stage
+};
+
+// Offset of the stamp in mbufs, or -1 while latency isn't being measured
+extern int lat_dynfield;
+
+// Histograms of each lcore and port, allocated the first time they're used.
+// Threads that aren't lcores share the ones past the last lcore.
+extern lat_port_hists *lat_hists[RTE_MAX_LCORE + 1][RTE_MAX_ETHPORTS];
+
+static inline bool lat_enabled() {
+  return lat_dynfield >= 0;
+}
+
+static inline lat_stamp *lat_get_stamp(rte_mbuf *pkt) {
+  return RTE_MBUF_DYNFIELD(pkt, lat_dynfield, lat_stamp *);
+}
+
+static inline unsigned lat_bucket(uint64_t val) {
+  unsigned msb;
+
+  if (val < (1 << LAT_SUB_BITS))
+    return val;
+
+  msb = 63 - __builtin_clzll(val);
+  if (msb >= LAT_MAX_BITS)
+    return LAT_BUCKETS - 1;
+
+  return ((msb - LAT_SUB_BITS + 1) << LAT_SUB_BITS) |
+         ((val >> (msb - LAT_SUB_BITS)) & ((1 << LAT_SUB_BITS) - 1));
+}
+
+static inline void lat_hist_add(lat_hist *h, uint64_t val) {
+  h->count++;
+  h->sum += val;
+  h->buckets[lat_bucket(val)]++;
+}
+
+lat_port_hists *lat_hists_alloc(unsigned slot, uint16_t port_id);
+
+// Histograms of the calling lcore for a port, or nullptr if they couldn't be
+// allocated
+static inline lat_port_hists *lat_get_hists(uint16_t port_id) {
+  unsigned lcore_id = rte_lcore_id(), slot = lcore_id < RTE_MAX_LCORE ? lcore_id : RTE_MAX_LCORE;
+  lat_port_hists *h = lat_hists[slot][port_id];
+
+  if (unlikely(h == nullptr))
+    h = lat_hists_alloc(slot, port_id);
+  return h;
+}
+
+// Register the stamp dynfield and the table stamps cross the model in. Until
+// then, none of the hooks below are called.
+int lat_init(void);
+
+// Hooks for each end of a stage, called only when lat_enabled(). Packets out
+// of the model are new mbufs, so stamps cross it in a table of in-flight
+// packets, matched by a hash of their first bytes and their length. The clock
+// is the model's cycle count, or nullptr if it isn't known.
+
+// Stamp packets coming in from the NIC or the host
+void lat_ingress(rte_mbuf **pkts, unsigned nb_pkts);
+
+// Packets taken off a ring by an encoder
+void lat_dequeued(rte_mbuf **pkts, unsigned nb_pkts, uint16_t port_id, uint8_t side);
+
+// The last beat of a packet is out of the encoder, which is about to free it
+void lat_encoded(rte_mbuf *pkt, uint16_t port_id, uint8_t side, const uint64_t *clock);
+
+// A packet has been reassembled by a decoder. It gets the stamp of the packet
+// that went into the model, if there is one.
+void lat_decoded(rte_mbuf *pkt, uint16_t port_id, uint8_t side, const uint64_t *clock);
+
+// Decoded packets are being passed on to the TX rings
+void lat_flushed(rte_mbuf **pkts, unsigned nb_pkts, uint16_t port_id, uint8_t side);
+
+// Packets are being handed to the NIC or the host
+void lat_egress(rte_mbuf **pkts, unsigned nb_pkts, uint16_t port_id, uint8_t side);
+
+// Sum of a port's histograms over all lcores, since they were last reset
+void lat_read(uint16_t port_id, lat_port_hists *h);
+
+// Reset the histograms of every port, the same way as kni_stats_reset()
+void lat_reset(void);
+
+// Summary of a histogram, in nanoseconds, or model cycles for LAT_CYCLES.
+// Percentiles are the top of the bucket they fall in.
+struct lat_summary {
+  uint64_t count;
+  double mean, p50, p90, p99, p999, max;
+};
+
+void lat_summarize(const lat_hist *h, unsigned stage, lat_summary *s);
+
+#endif
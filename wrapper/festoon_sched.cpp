@@ -0,0 +1,92 @@
+#include <string.h>
+
+#include <rte_cycles.h>
+#include <rte_lcore.h>
+#include <rte_log.h>
+#include <rte_power_intrinsics.h>
+#include <rte_ring.h>
+
+#include "festoon_sched.h"
+
+// Wake as soon as the producer's tail moves off the consumer's, so the ring
+// isn't empty any more
+static int sched_ring_wake(const uint64_t val, const uint64_t opaque[RTE_POWER_MONITOR_OPAQUE_SZ]) {
+  return (uint32_t)val != *(const volatile uint32_t *)opaque[0] ? -1 : 0;
+}
+
+void sched_monitor_ring(const rte_ring *r, rte_power_monitor_cond *pmc) {
+  pmc->addr = (volatile void *)&r->prod.tail;
+  pmc->fn = sched_ring_wake;
+  pmc->opaque[0] = (uintptr_t)&r->cons.tail;
+  pmc->size = sizeof(uint32_t);
+}
+
+// Fill in the addresses the stages wait on, returning how many there are.
+// Stages that can't be waited on are still run at least every
+// SCHED_IDLE_WAIT_US, so waiting on the rest is worth it.
+static unsigned sched_idle_monitor(sched_idle *idle) {
+  const sched_stage *st;
+  unsigned i, nb_pmc = 0;
+
+  for (i = 0; i < idle->sched->nb_stages; i++) {
+    st = &idle->sched->stages[i];
+    if (st->monitor != nullptr)
+      nb_pmc += st->monitor(st, &idle->pmc[nb_pmc], SCHED_MAX_STAGES - nb_pmc);
+  }
+
+  return nb_pmc;
+}
+
+void sched_idle_init(sched_idle *idle, const sched_lcore *sched, bool poll) {
+  static const char *const mode_names[] = {"polls", "waits on its rings", "pauses", "sleeps"};
+  rte_cpu_intrinsics intrinsics;
+  unsigned nb_pmc;
+
+  memset(idle, 0, sizeof(*idle));
+  idle->sched = sched;
+  if (poll) {
+    idle->mode = SCHED_WAIT_POLL;
+    return;
+  }
+
+  rte_cpu_get_intrinsics_support(&intrinsics);
+  idle->multi = intrinsics.power_monitor_multi;
+  idle->pause = intrinsics.power_pause;
+
+  nb_pmc = intrinsics.power_monitor ? sched_idle_monitor(idle) : 0;
+  if (nb_pmc == 1 || (nb_pmc > 1 && idle->multi))
+    idle->mode = SCHED_WAIT_MONITOR;
+  else
+    idle->mode = idle->pause ? SCHED_WAIT_PAUSE : SCHED_WAIT_SLEEP;
+
+  RTE_LOG(INFO, APP, "Lcore %u %s when idle\n", rte_lcore_id(), mode_names[idle->mode]);
+}
+
+void sched_idle_wait(sched_idle *idle) {
+  uint64_t now = rte_rdtsc(), hz = rte_get_tsc_hz();
+  unsigned nb_pmc;
+
+  // Give the CPU up once the lcore has been idle for long enough
+  if (idle->mode == SCHED_WAIT_SLEEP || now - idle->idle_tsc >= hz * SCHED_IDLE_SLEEP_MS / 1000) {
+    rte_delay_us_sleep(SCHED_IDLE_SLEEP_US);
+    return;
+  }
+
+  now += hz * SCHED_IDLE_WAIT_US / 1000000;
+  if (idle->mode == SCHED_WAIT_MONITOR) {
+    nb_pmc = sched_idle_monitor(idle);
+    if (nb_pmc == 1) {
+      rte_power_monitor(&idle->pmc[0], now);
+      return;
+    }
+    if (nb_pmc > 1 && idle->multi) {
+      rte_power_monitor_multi(idle->pmc, nb_pmc, now);
+      return;
+    }
+  }
+
+  if (idle->pause)
+    rte_power_pause(now);
+  else
+    rte_delay_us_sleep(SCHED_IDLE_SLEEP_US);
+}
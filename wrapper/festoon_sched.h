@@ -0,0 +1,110 @@
+#ifndef FESTOON_SCHED_H
+#define FESTOON_SCHED_H
+
+#include <rte_branch_prediction.h>
+#include <rte_cycles.h>
+#include <rte_pause.h>
+#include <rte_power_intrinsics.h>
+#include <rte_ring.h>
+#include <stdint.h>
+
+#include "params.h"
+
+// One stage of a port's pipeline, like reading the NIC or running the model
+struct sched_stage {
+  // Returns how much it did, in packets, beats or cycles
+  unsigned (*run)(const sched_stage *st);
+  // Whether the stage has anything on its input ring. nullptr for stages that
+  // poll a NIC or the host, or have to run regardless.
+  bool (*ready)(const sched_stage *st);
+  // Fill in up to max addresses to wait on for input, returning how many. It
+  // may fill in none, and nullptr is the same. Called before every wait, since
+  // NIC queues move on to a new descriptor each time.
+  unsigned (*monitor)(const sched_stage *st, rte_power_monitor_cond *pmc, unsigned max);
+  uint16_t port_id;
+  uint16_t queue;   // Ethernet queue, or shard of the model
+  uint16_t weight;  // Most times it is run in a row each round
+  uint8_t role;     // What the stage does, for logs and stats
+};
+
+// Stages sharing one lcore, which take turns run-to-completion
+struct sched_lcore {
+  sched_stage stages[SCHED_MAX_STAGES];
+  unsigned nb_stages;
+};
+
+static inline int sched_add(sched_lcore *sched, const sched_stage *st) {
+  if (sched->nb_stages == SCHED_MAX_STAGES)
+    return -1;
+
+  sched->stages[sched->nb_stages++] = *st;
+  return 0;
+}
+
+// Weighted round-robin over the stages. Each is run up to its weight times,
+// and passed over as soon as its input ring is empty. Returns how much they
+// did between them.
+static inline unsigned sched_round(const sched_lcore *sched) {
+  const sched_stage *st;
+  unsigned i, n, work = 0;
+
+  for (i = 0; i < sched->nb_stages; i++) {
+    st = &sched->stages[i];
+    for (n = 0; n < st->weight && (st->ready == nullptr || st->ready(st)); n++)
+      work += st->run(st);
+  }
+
+  return work;
+}
+
+// Wait on a ring until something is put on it
+void sched_monitor_ring(const rte_ring *r, rte_power_monitor_cond *pmc);
+
+// How an idle lcore waits for work, from the cheapest to wake to the lightest
+enum sched_wait_mode {
+  SCHED_WAIT_POLL,     // Keep polling flat out
+  SCHED_WAIT_MONITOR,  // UMWAIT on the stages' rings and queues until they're written to
+  SCHED_WAIT_PAUSE,    // TPAUSE for a while
+  SCHED_WAIT_SLEEP     // Sleep for a while
+};
+
+// Back-off state of one lcore. After SCHED_IDLE_SPIN rounds with nothing to
+// do it pauses between rounds, and after SCHED_IDLE_PAUSE more it waits in a
+// low power state for up to SCHED_IDLE_WAIT_US. Once it's been idle for
+// SCHED_IDLE_SLEEP_MS it sleeps, so the CPU can go to other processes.
+struct sched_idle {
+  const sched_lcore *sched;
+  uint32_t nb_empty;  // Rounds in a row with nothing to do
+  uint64_t idle_tsc;  // When they started
+  uint8_t mode;       // A sched_wait_mode
+  bool multi;         // Whether more than one address can be waited on at once
+  bool pause;         // Whether TPAUSE is there to fall back on
+  rte_power_monitor_cond pmc[SCHED_MAX_STAGES];
+};
+
+// Work out how the stages of an lcore can wait, or keep them polling if poll
+void sched_idle_init(sched_idle *idle, const sched_lcore *sched, bool poll);
+
+// Wait for work once the lcore has been idle for long enough
+void sched_idle_wait(sched_idle *idle);
+
+// Account for a round that did work, or back off after one that didn't
+static inline void sched_idle_update(sched_idle *idle, unsigned work) {
+  if (likely(work != 0)) {
+    idle->nb_empty = 0;
+    return;
+  }
+  if (unlikely(idle->mode == SCHED_WAIT_POLL))
+    return;
+
+  if (idle->nb_empty == 0)
+    idle->idle_tsc = rte_rdtsc();
+  if (idle->nb_empty < SCHED_IDLE_SPIN + SCHED_IDLE_PAUSE) {
+    if (idle->nb_empty++ >= SCHED_IDLE_SPIN)
+      rte_pause();
+    return;
+  }
+  sched_idle_wait(idle);
+}
+
+#endif
@@ -0,0 +1,166 @@
+#include <errno.h>
+#include <string.h>
+
+#include <rte_malloc.h>
+#include <rte_memcpy.h>
+
+#include "festoon_common.h"
+#include "festoon_latency.h"
+#include "festoon_split.h"
+
+uint32_t split_len = 0;
+
+static_assert((SPLIT_TABLE_SZ & (SPLIT_TABLE_SZ - 1)) == 0,
+              "SPLIT_TABLE_SZ must be a power of two");
+
+// Parked packets, each in the slot its tag falls in, with the tag in
+// hash.usr. A packet still parked when its slot comes round again is taken
+// as lost in the model, and freed.
+static rte_mbuf **split_table;
+static uint32_t split_next_tag;
+
+int split_init(uint32_t len) {
+  split_table = (rte_mbuf **)rte_zmalloc("split_table", sizeof(rte_mbuf *) * SPLIT_TABLE_SZ,
+                                         RTE_CACHE_LINE_SIZE);
+  if (split_table == nullptr)
+    return -ENOMEM;
+
+  split_len = len;
+  return 0;
+}
+
+rte_mbuf *split_header(rte_mbuf *pkt, uint16_t port_id, uint8_t tid) {
+  split_trailer tr;
+  rte_mbuf *hdr, *old;
+  uint8_t *data;
+
+  if (unlikely(!rte_pktmbuf_is_contiguous(pkt))) {
+    rte_pktmbuf_free(pkt);
+    return nullptr;
+  }
+
+  if (rte_pktmbuf_pkt_len(pkt) <= split_len) {
+    tr.magic = SPLIT_MAGIC_WHOLE;
+    tr.tag = 0;
+    data = (uint8_t *)rte_pktmbuf_append(pkt, sizeof(tr));
+    if (unlikely(data == nullptr)) {
+      rte_pktmbuf_free(pkt);
+      return nullptr;
+    }
+    memcpy(data, &tr, sizeof(tr));
+    return pkt;
+  }
+
+  hdr = rte_pktmbuf_alloc(pkt->pool);
+  if (unlikely(hdr == nullptr)) {
+    rte_pktmbuf_free(pkt);
+    return nullptr;
+  }
+
+  tr.magic = SPLIT_MAGIC;
+  tr.tag = __atomic_fetch_add(&split_next_tag, 1, __ATOMIC_RELAXED);
+  data = (uint8_t *)rte_pktmbuf_append(hdr, split_len + sizeof(tr));
+  rte_memcpy(data, rte_pktmbuf_mtod(pkt, void *), split_len);
+  memcpy(data + split_len, &tr, sizeof(tr));
+  hdr->port = pkt->port;
+  if (unlikely(lat_enabled()))
+    *lat_get_stamp(hdr) = *lat_get_stamp(pkt);
+
+  pkt->hash.usr = tr.tag;
+  old = __atomic_exchange_n(&split_table[tr.tag & (SPLIT_TABLE_SZ - 1)], pkt, __ATOMIC_ACQ_REL);
+  if (unlikely(old != nullptr)) {
+    rte_pktmbuf_free(old);
+    get_kni_stats()[port_id].split_expired[tid]++;
+  }
+  get_kni_stats()[port_id].split_packets[tid]++;
+
+  return hdr;
+}
+
+// Take the packet parked under tag out of the table, or nullptr if it's gone.
+// The tag is only read once the packet has been taken, since until then it
+// may be taken and freed by someone else.
+static rte_mbuf *split_claim(uint32_t tag) {
+  rte_mbuf **slot = &split_table[tag & (SPLIT_TABLE_SZ - 1)];
+  rte_mbuf *pkt = __atomic_exchange_n(slot, nullptr, __ATOMIC_ACQ_REL), *empty = nullptr;
+
+  if (pkt == nullptr || likely(pkt->hash.usr == tag))
+    return pkt;
+
+  // The slot holds another packet. Put it back, unless the slot has been
+  // parked in again meanwhile, which makes it the older of the two.
+  if (!__atomic_compare_exchange_n(slot, &empty, pkt, false, __ATOMIC_ACQ_REL,
+                                   __ATOMIC_RELAXED))
+    rte_pktmbuf_free(pkt);
+  return nullptr;
+}
+
+// Put one decoded header back in front of the rest of its packet. Returns the
+// whole packet, hdr if it wasn't split, or nullptr if it couldn't be rejoined.
+static rte_mbuf *split_rejoin_one(rte_mbuf *hdr) {
+  split_trailer tr;
+  rte_mbuf *pkt;
+  uint32_t len = rte_pktmbuf_data_len(hdr), hdr_len = len - sizeof(tr), rest_len;
+  uint8_t *data;
+
+  if (len < sizeof(tr))
+    return hdr;
+  memcpy(&tr, rte_pktmbuf_mtod_offset(hdr, void *, hdr_len), sizeof(tr));
+  if (tr.magic == SPLIT_MAGIC_WHOLE) {
+    rte_pktmbuf_trim(hdr, sizeof(tr));
+    return hdr;
+  }
+  if (tr.magic != SPLIT_MAGIC)
+    return hdr;
+
+  pkt = split_claim(tr.tag);
+  if (unlikely(pkt == nullptr)) {
+    rte_pktmbuf_free(hdr);
+    return nullptr;
+  }
+  rte_pktmbuf_adj(pkt, split_len);
+  rest_len = rte_pktmbuf_data_len(pkt);
+
+  // The model may have made the header longer. It mostly fits in the room the
+  // old one left, and failing that the rest is copied in behind it.
+  if (likely(rte_pktmbuf_headroom(pkt) >= hdr_len)) {
+    data = (uint8_t *)rte_pktmbuf_prepend(pkt, hdr_len);
+    rte_memcpy(data, rte_pktmbuf_mtod(hdr, void *), hdr_len);
+  } else if (rte_pktmbuf_tailroom(hdr) + sizeof(tr) >= rest_len) {
+    rte_pktmbuf_trim(hdr, sizeof(tr));
+    data = (uint8_t *)rte_pktmbuf_append(hdr, rest_len);
+    rte_memcpy(data, rte_pktmbuf_mtod(pkt, void *), rest_len);
+    rte_pktmbuf_free(pkt);
+    return hdr;
+  } else {
+    rte_pktmbuf_free(pkt);
+    rte_pktmbuf_free(hdr);
+    return nullptr;
+  }
+
+  // Pass it on like any other decoded packet, without the flags it came in with
+  pkt->port = hdr->port;
+  pkt->ol_flags = hdr->ol_flags;
+  pkt->packet_type = hdr->packet_type;
+  pkt->tx_offload = 0;
+  if (unlikely(lat_enabled()))
+    *lat_get_stamp(pkt) = *lat_get_stamp(hdr);
+  rte_pktmbuf_free(hdr);
+
+  return pkt;
+}
+
+unsigned split_rejoin(rte_mbuf **pkts, unsigned nb_pkts, uint16_t port_id, uint8_t tid) {
+  rte_mbuf *pkt;
+  unsigned i, nb = 0;
+
+  for (i = 0; i < nb_pkts; i++) {
+    pkt = split_rejoin_one(pkts[i]);
+    if (likely(pkt != nullptr))
+      pkts[nb++] = pkt;
+  }
+
+  if (unlikely(nb < nb_pkts))
+    get_kni_stats()[port_id].split_lost[tid] += nb_pkts - nb;
+  return nb;
+}
@@ -0,0 +1,47 @@
+#ifndef FESTOON_SPLIT_H
+#define FESTOON_SPLIT_H
+
+#include <rte_mbuf.h>
+
+#include "params.h"
+
+// Header split. Only the first split_len bytes of a packet go through the
+// model, followed by a trailer with a tag. The rest waits in the original
+// mbuf, parked in a table under that tag, and is put back behind whatever
+// the model sends out in front of the trailer. Packets too short to split get
+// a trailer too, marking them as whole, so every packet sent into the model
+// ends in one and it's always taken off again. The model has to pass the
+// trailer through untouched, right after the header, and designs that check
+// frame lengths against their headers will see short frames.
+struct split_trailer {
+  uint32_t magic;  // SPLIT_MAGIC, or SPLIT_MAGIC_WHOLE for a packet that wasn't split
+  uint32_t tag;    // Slot the rest of the packet is parked in
+} __attribute__((packed));
+
+#define SPLIT_MAGIC 0x46535054
+#define SPLIT_MAGIC_WHOLE 0x46535057
+
+// Bytes of each packet sent through the model, or 0 to send all of them
+extern uint32_t split_len;
+
+static inline bool split_enabled() {
+  return split_len != 0;
+}
+
+// Set up the table packets are parked in, and send only the first len bytes
+// of them through the model from now on
+int split_init(uint32_t len);
+
+// Cut the header off a packet on its way into the model, on side tid of a
+// port. Returns the header to encode instead, or pkt itself with a trailer
+// marking it whole if it's too short to split. Returns nullptr, having freed
+// pkt, if it's segmented or there's no room for either.
+rte_mbuf *split_header(rte_mbuf *pkt, uint16_t port_id, uint8_t tid);
+
+// Put decoded headers back together with the rest of their packets, in place.
+// Packets that weren't split just lose their trailer, packets without one are
+// left as they are, and headers whose packet is no longer parked are freed.
+// Returns how many packets are left.
+unsigned split_rejoin(rte_mbuf **pkts, unsigned nb_pkts, uint16_t port_id, uint8_t tid);
+
+#endif
@@ -0,0 +1,399 @@
+#include <ctype.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <rte_cycles.h>
+#include <rte_ethdev.h>
+#include <rte_spinlock.h>
+#include <rte_telemetry.h>
+#include <rte_version.h>
+
+#include "festoon_latency.h"
+#include "festoon_telemetry.h"
+#include "festoon_top.h"
+
+// Renamed in DPDK 23.03
+#if RTE_VERSION < RTE_VERSION_NUM(23, 3, 0, 0)
+#define rte_tel_data_add_dict_uint rte_tel_data_add_dict_u64
+#endif
+
+// Where a counter is read from
+enum telemetry_source {
+  TEL_SRC_STATS,  // kni_interface_stats of the port
+  TEL_SRC_ETH,    // rte_eth_stats of the NIC
+  TEL_SRC_HOST    // rte_eth_stats of the virtio-user or TAP host interface
+};
+
+// A counter in the replies, with its rate over the last period, times scale
+struct telemetry_counter {
+  const char *stage;
+  const char *name;
+  const char *rate_name;
+  telemetry_source source;
+  size_t off;
+  uint64_t scale;
+};
+
+#define TEL_STATS(f) TEL_SRC_STATS, offsetof(kni_interface_stats, f)
+#define TEL_ETH(f) TEL_SRC_ETH, offsetof(rte_eth_stats, f)
+#define TEL_HOST(f) TEL_SRC_HOST, offsetof(rte_eth_stats, f)
+
+// Stages in the same order as print_stats, each one's counters together. Host
+// rx is from the host and tx is to it. XGMII in is into the model and out is
+// out of it, and XGMII beats carry 64 bits each.
+static const telemetry_counter telemetry_counters[] = {
+  {"eth", "rx_packets", "rx_pps", TEL_STATS(eth_rx_packets), 1},
+  {"eth", "rx_dropped", "rx_dropped_pps", TEL_STATS(eth_rx_dropped), 1},
+  {"eth", "rx_bytes", "rx_bps", TEL_ETH(ibytes), 8},
+  {"eth", "tx_packets", "tx_pps", TEL_STATS(eth_tx_packets), 1},
+  {"eth", "tx_dropped", "tx_dropped_pps", TEL_STATS(eth_tx_dropped), 1},
+  {"eth", "tx_bytes", "tx_bps", TEL_ETH(obytes), 8},
+  {"eth", "bypass_packets", "bypass_pps", TEL_STATS(bypass_packets[0]), 1},
+  {"eth", "bypass_dropped", "bypass_dropped_pps", TEL_STATS(bypass_dropped[0]), 1},
+  {"host", "rx_packets", "rx_pps", TEL_STATS(kni_rx_packets), 1},
+  {"host", "rx_dropped", "rx_dropped_pps", TEL_STATS(kni_rx_dropped), 1},
+  {"host", "rx_bytes", "rx_bps", TEL_HOST(ibytes), 8},
+  {"host", "tx_packets", "tx_pps", TEL_STATS(kni_tx_packets), 1},
+  {"host", "tx_dropped", "tx_dropped_pps", TEL_STATS(kni_tx_dropped), 1},
+  {"host", "tx_bytes", "tx_bps", TEL_HOST(obytes), 8},
+  {"host", "bypass_packets", "bypass_pps", TEL_STATS(bypass_packets[1]), 1},
+  {"host", "bypass_dropped", "bypass_dropped_pps", TEL_STATS(bypass_dropped[1]), 1},
+  {"xgmii_eth", "in_beats", "in_bps", TEL_STATS(xgmii_rx_packets[0]), 64},
+  {"xgmii_eth", "in_dropped", "in_dropped_bps", TEL_STATS(xgmii_rx_dropped[0]), 64},
+  {"xgmii_eth", "in_rejected", "in_rejected_pps", TEL_STATS(xgmii_rx_rejected[0]), 1},
+  {"xgmii_eth", "out_beats", "out_bps", TEL_STATS(xgmii_dec_beats[0]), 64},
+  {"xgmii_eth", "out_packets", "out_pps", TEL_STATS(xgmii_tx_packets[0]), 1},
+  {"xgmii_eth", "out_dropped", "out_dropped_pps", TEL_STATS(xgmii_tx_dropped[0]), 1},
+  {"xgmii_eth", "out_beats_dropped", "out_dropped_bps", TEL_STATS(xgmii_out_dropped[0]), 64},
+  {"xgmii_eth", "dec_cycles", "dec_cycles_per_sec", TEL_STATS(xgmii_dec_cycles[0]), 1},
+  {"xgmii_eth", "split_packets", "split_pps", TEL_STATS(split_packets[0]), 1},
+  {"xgmii_eth", "split_expired", "split_expired_pps", TEL_STATS(split_expired[0]), 1},
+  {"xgmii_eth", "split_lost", "split_lost_pps", TEL_STATS(split_lost[0]), 1},
+  {"xgmii_pcie", "in_beats", "in_bps", TEL_STATS(xgmii_rx_packets[1]), 64},
+  {"xgmii_pcie", "in_dropped", "in_dropped_bps", TEL_STATS(xgmii_rx_dropped[1]), 64},
+  {"xgmii_pcie", "in_rejected", "in_rejected_pps", TEL_STATS(xgmii_rx_rejected[1]), 1},
+  {"xgmii_pcie", "out_beats", "out_bps", TEL_STATS(xgmii_dec_beats[1]), 64},
+  {"xgmii_pcie", "out_packets", "out_pps", TEL_STATS(xgmii_tx_packets[1]), 1},
+  {"xgmii_pcie", "out_dropped", "out_dropped_pps", TEL_STATS(xgmii_tx_dropped[1]), 1},
+  {"xgmii_pcie", "out_beats_dropped", "out_dropped_bps", TEL_STATS(xgmii_out_dropped[1]), 64},
+  {"xgmii_pcie", "dec_cycles", "dec_cycles_per_sec", TEL_STATS(xgmii_dec_cycles[1]), 1},
+  {"xgmii_pcie", "split_packets", "split_pps", TEL_STATS(split_packets[1]), 1},
+  {"xgmii_pcie", "split_expired", "split_expired_pps", TEL_STATS(split_expired[1]), 1},
+  {"xgmii_pcie", "split_lost", "split_lost_pps", TEL_STATS(split_lost[1]), 1},
+};
+
+#define TELEMETRY_NB_COUNTERS RTE_DIM(telemetry_counters)
+
+struct telemetry_port {
+  const kni_port_params *p;  // nullptr if the port isn't reported on
+  rte_ring *rings[TELEMETRY_MAX_RINGS];
+  unsigned nb_rings;
+  uint64_t values[TELEMETRY_NB_COUNTERS];  // Counters as of the last sample
+  uint64_t rates[TELEMETRY_NB_COUNTERS];   // Their rates over the period before it
+};
+
+struct telemetry_model {
+  uint64_t cycles, skipped;
+  uint64_t cycles_rate, skipped_rate;
+};
+
+static telemetry_port telemetry_ports[RTE_MAX_ETHPORTS];
+static telemetry_model telemetry_model_sample;
+static uint64_t telemetry_tsc;
+
+// Held by the sampler and the telemetry thread, never by the lcores
+static rte_spinlock_t telemetry_lock = RTE_SPINLOCK_INITIALIZER;
+static int telemetry_running;
+
+void telemetry_add_port(const kni_port_params *p) {
+  telemetry_ports[p->port_id].p = p;
+}
+
+void telemetry_add_ring(uint16_t port_id, rte_ring *ring) {
+  telemetry_port *tp = &telemetry_ports[port_id];
+
+  if (ring != NULL && tp->nb_rings < TELEMETRY_MAX_RINGS)
+    tp->rings[tp->nb_rings++] = ring;
+}
+
+// Per second rate of a counter that went up by delta over period timer cycles
+static inline uint64_t telemetry_rate(uint64_t delta, uint64_t period) {
+  return period ? (uint64_t)((double)delta * rte_get_timer_hz() / period) : 0;
+}
+
+void telemetry_sample(void) {
+  uint64_t values[TELEMETRY_NB_COUNTERS], tsc = rte_get_timer_cycles(), period, cycles, skipped;
+  const telemetry_counter *c;
+  const uint8_t *src;
+  kni_interface_stats st;
+  rte_eth_stats eth, host;
+  telemetry_port *tp;
+  uint16_t port_id;
+  unsigned i;
+
+  // There's nothing to work rates out from the first time
+  period = telemetry_tsc ? tsc - telemetry_tsc : 0;
+  telemetry_tsc = tsc;
+
+  for (port_id = 0; port_id < RTE_MAX_ETHPORTS; port_id++) {
+    tp = &telemetry_ports[port_id];
+    if (tp->p == nullptr)
+      continue;
+
+    kni_stats_read(port_id, &st);
+    memset(&eth, 0, sizeof(eth));
+    memset(&host, 0, sizeof(host));
+    rte_eth_stats_get(port_id, &eth);
+    if (tp->p->nb_host_queues)
+      rte_eth_stats_get(tp->p->host_port_id, &host);
+
+    for (i = 0; i < TELEMETRY_NB_COUNTERS; i++) {
+      c = &telemetry_counters[i];
+      if (c->source == TEL_SRC_STATS)
+        src = (const uint8_t *)&st;
+      else
+        src = (const uint8_t *)(c->source == TEL_SRC_ETH ? &eth : &host);
+      memcpy(&values[i], src + c->off, sizeof(values[i]));
+    }
+
+    // A counter that went back was reset, and has no rate this time
+    rte_spinlock_lock(&telemetry_lock);
+    for (i = 0; i < TELEMETRY_NB_COUNTERS; i++) {
+      tp->rates[i] = values[i] >= tp->values[i] ?
+          telemetry_rate(values[i] - tp->values[i], period) * telemetry_counters[i].scale : 0;
+      tp->values[i] = values[i];
+    }
+    rte_spinlock_unlock(&telemetry_lock);
+  }
+
+  vtop_get_cycles(&cycles, &skipped);
+  rte_spinlock_lock(&telemetry_lock);
+  telemetry_model_sample.cycles_rate = telemetry_rate(cycles - telemetry_model_sample.cycles, period);
+  telemetry_model_sample.skipped_rate = telemetry_rate(skipped - telemetry_model_sample.skipped, period);
+  telemetry_model_sample.cycles = cycles;
+  telemetry_model_sample.skipped = skipped;
+  rte_spinlock_unlock(&telemetry_lock);
+}
+
+// Dictionary keys can't have spaces or dots, which ring names do
+static void telemetry_key(char *key, size_t size, const char *name) {
+  size_t i;
+
+  for (i = 0; i + 1 < size && name[i] != '\0'; i++)
+    key[i] = isalnum((unsigned char)name[i]) ? name[i] : '_';
+  key[i] = '\0';
+}
+
+static int telemetry_parse_port(const char *params, uint16_t *port_id) {
+  unsigned long id;
+  char *end;
+
+  if (params == NULL || *params == '\0')
+    return -EINVAL;
+
+  errno = 0;
+  id = strtoul(params, &end, 10);
+  if (errno != 0 || *end != '\0' || id >= RTE_MAX_ETHPORTS)
+    return -EINVAL;
+
+  *port_id = id;
+  return 0;
+}
+
+// /festoon/ports
+static int telemetry_handle_ports(const char *, const char *, rte_tel_data *d) {
+  uint16_t port_id;
+
+  rte_tel_data_start_array(d, RTE_TEL_INT_VAL);
+  rte_spinlock_lock(&telemetry_lock);
+  for (port_id = 0; telemetry_running && port_id < RTE_MAX_ETHPORTS; port_id++) {
+    if (telemetry_ports[port_id].p != nullptr)
+      rte_tel_data_add_array_int(d, port_id);
+  }
+  rte_spinlock_unlock(&telemetry_lock);
+
+  return 0;
+}
+
+// Rings of a port with how many entries they hold, and how many they can
+static int telemetry_add_rings(rte_tel_data *d, const telemetry_port *tp) {
+  char key[RTE_TEL_MAX_STRING_LEN];
+  rte_tel_data *used, *size;
+  unsigned i;
+
+  used = rte_tel_data_alloc();
+  size = rte_tel_data_alloc();
+  if (used == NULL || size == NULL) {
+    rte_tel_data_free(used);
+    rte_tel_data_free(size);
+    return -ENOMEM;
+  }
+
+  rte_tel_data_start_dict(used);
+  rte_tel_data_start_dict(size);
+  for (i = 0; i < tp->nb_rings; i++) {
+    telemetry_key(key, sizeof(key), tp->rings[i]->name);
+    rte_tel_data_add_dict_uint(used, key, rte_ring_count(tp->rings[i]));
+    rte_tel_data_add_dict_uint(size, key, rte_ring_get_capacity(tp->rings[i]));
+  }
+  rte_tel_data_add_dict_container(d, "ring_used", used, 0);
+  rte_tel_data_add_dict_container(d, "ring_size", size, 0);
+
+  return 0;
+}
+
+// /festoon/stats,<port>
+static int telemetry_handle_stats(const char *, const char *params, rte_tel_data *d) {
+  uint64_t values[TELEMETRY_NB_COUNTERS], rates[TELEMETRY_NB_COUNTERS];
+  const telemetry_counter *c;
+  rte_tel_data *stage = NULL;
+  const char *stage_name = NULL;
+  telemetry_port *tp;
+  uint16_t port_id;
+  unsigned i;
+  int ret;
+
+  if (telemetry_parse_port(params, &port_id) < 0)
+    return -EINVAL;
+  tp = &telemetry_ports[port_id];
+
+  rte_tel_data_start_dict(d);
+
+  // Rings are read here rather than sampled, so this holds the lock until
+  // they're done, and they can't be freed from under it
+  rte_spinlock_lock(&telemetry_lock);
+  if (!telemetry_running || tp->p == nullptr) {
+    rte_spinlock_unlock(&telemetry_lock);
+    return -EINVAL;
+  }
+  memcpy(values, tp->values, sizeof(values));
+  memcpy(rates, tp->rates, sizeof(rates));
+  ret = telemetry_add_rings(d, tp);
+  rte_spinlock_unlock(&telemetry_lock);
+  if (ret < 0)
+    return ret;
+
+  for (i = 0; i < TELEMETRY_NB_COUNTERS; i++) {
+    c = &telemetry_counters[i];
+    if (stage_name == NULL || strcmp(stage_name, c->stage) != 0) {
+      if (stage != NULL)
+        rte_tel_data_add_dict_container(d, stage_name, stage, 0);
+      stage = rte_tel_data_alloc();
+      if (stage == NULL)
+        return -ENOMEM;
+      rte_tel_data_start_dict(stage);
+      stage_name = c->stage;
+    }
+
+    rte_tel_data_add_dict_uint(stage, c->name, values[i]);
+    rte_tel_data_add_dict_uint(stage, c->rate_name, rates[i]);
+  }
+  rte_tel_data_add_dict_container(d, stage_name, stage, 0);
+
+  return 0;
+}
+
+// /festoon/model
+static int telemetry_handle_model(const char *, const char *, rte_tel_data *d) {
+  telemetry_model model;
+
+  rte_spinlock_lock(&telemetry_lock);
+  model = telemetry_model_sample;
+  rte_spinlock_unlock(&telemetry_lock);
+
+  rte_tel_data_start_dict(d);
+  rte_tel_data_add_dict_uint(d, "cycles", model.cycles);
+  rte_tel_data_add_dict_uint(d, "cycles_per_sec", model.cycles_rate);
+  rte_tel_data_add_dict_uint(d, "skipped", model.skipped);
+  rte_tel_data_add_dict_uint(d, "skipped_per_sec", model.skipped_rate);
+
+  return 0;
+}
+
+// /festoon/latency,<port>
+static int telemetry_handle_latency(const char *, const char *params, rte_tel_data *d) {
+  char key[RTE_TEL_MAX_STRING_LEN];
+  rte_tel_data *stage;
+  lat_port_hists *h;
+  lat_summary sum;
+  unsigned side, i;
+  uint16_t port_id;
+  int registered;
+
+  if (telemetry_parse_port(params, &port_id) < 0)
+    return -EINVAL;
+
+  rte_spinlock_lock(&telemetry_lock);
+  registered = telemetry_running && telemetry_ports[port_id].p != nullptr;
+  rte_spinlock_unlock(&telemetry_lock);
+  if (!registered)
+    return -EINVAL;
+
+  h = (lat_port_hists *)malloc(sizeof(*h));
+  if (h == NULL)
+    return -ENOMEM;
+  lat_read(port_id, h);
+
+  rte_tel_data_start_dict(d);
+  for (side = 0; side < LAT_NB_SIDES; side++) {
+    snprintf(key, sizeof(key), "%s_unmatched", lat_side_names[side]);
+    rte_tel_data_add_dict_uint(d, key, h->unmatched[side]);
+
+    for (i = 0; i < LAT_NB_STAGES; i++) {
+      stage = rte_tel_data_alloc();
+      if (stage == NULL) {
+        free(h);
+        return -ENOMEM;
+      }
+
+      lat_summarize(&h->hist[side][i], i, &sum);
+      rte_tel_data_start_dict(stage);
+      rte_tel_data_add_dict_uint(stage, "count", sum.count);
+      rte_tel_data_add_dict_uint(stage, "mean", sum.mean);
+      rte_tel_data_add_dict_uint(stage, "p50", sum.p50);
+      rte_tel_data_add_dict_uint(stage, "p90", sum.p90);
+      rte_tel_data_add_dict_uint(stage, "p99", sum.p99);
+      rte_tel_data_add_dict_uint(stage, "p999", sum.p999);
+      rte_tel_data_add_dict_uint(stage, "max", sum.max);
+
+      snprintf(key, sizeof(key), "%s_%s", lat_side_names[side], lat_stage_names[i]);
+      rte_tel_data_add_dict_container(d, key, stage, 0);
+    }
+  }
+
+  free(h);
+  return 0;
+}
+
+int telemetry_init(void) {
+  int ret;
+
+  rte_spinlock_lock(&telemetry_lock);
+  telemetry_running = 1;
+  rte_spinlock_unlock(&telemetry_lock);
+
+  ret = rte_telemetry_register_cmd("/festoon/ports", telemetry_handle_ports,
+                                   "Returns the IDs of the ports in use. Takes no parameters");
+  if (ret == 0)
+    ret = rte_telemetry_register_cmd("/festoon/stats", telemetry_handle_stats,
+                                     "Returns counters, rates and ring use of each stage of a "
+                                     "port. Parameters: int port_id");
+  if (ret == 0)
+    ret = rte_telemetry_register_cmd("/festoon/model", telemetry_handle_model,
+                                     "Returns cycles the model ran and skipped, and their "
+                                     "rates. Takes no parameters");
+  if (ret == 0 && lat_enabled())
+    ret = rte_telemetry_register_cmd("/festoon/latency", telemetry_handle_latency,
+                                     "Returns latency percentiles of each stage of a port, in "
+                                     "ns, or model cycles for cycles. Parameters: int port_id");
+
+  return ret;
+}
+
+void telemetry_stop(void) {
+  rte_spinlock_lock(&telemetry_lock);
+  telemetry_running = 0;
+  rte_spinlock_unlock(&telemetry_lock);
+}
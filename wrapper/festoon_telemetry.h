@@ -0,0 +1,24 @@
+#ifndef FESTOON_TELEMETRY_H
+#define FESTOON_TELEMETRY_H
+
+#include <rte_ring.h>
+
+#include "festoon_common.h"
+
+// Report on a port, and on how full one of its rings is. Called before
+// telemetry_init().
+void telemetry_add_port(const kni_port_params *p);
+void telemetry_add_ring(uint16_t port_id, rte_ring *ring);
+
+// Register the /festoon/ commands with rte_telemetry. The rates in their
+// replies are the ones worked out by the last telemetry_sample().
+int telemetry_init(void);
+
+// Forget the ports and rings, before they are freed
+void telemetry_stop(void);
+
+// Read every counter, and work out rates from the ones read last time. Called
+// about once every TELEMETRY_PERIOD_MS from a control thread.
+void telemetry_sample(void);
+
+#endif
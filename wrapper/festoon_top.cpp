@@ -1,164 +1,804 @@
 #include "festoon_top.h"
 
+#include <rte_cycles.h>
+#include <rte_eal.h>
 #include <rte_errno.h>
 #include <rte_malloc.h>
 #include <rte_mbuf.h>
 #include <rte_ring.h>
 
+#include <dirent.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <set>
 #include <stdexcept>
+#include <string>
 
 #include "festoon_common.h"
+#include "festoon_latency.h"
+#include "festoon_split.h"
+#include "festoon_xgmii.h"
 #include "Vtop.h"
 #include "params.h"
 
+#ifdef FESTOON_AXIS_WIDTH
+#include "festoon_axis.h"
+
+// Beats on the AXI-Stream ports of the model
+typedef axis_beat<FESTOON_AXIS_WIDTH> vtop_axis_beat;
+
+static_assert(FESTOON_NUM_PORTS == 1, "The AXI-Stream top has a single port");
+#endif
+
 using namespace std;
 
-Vtop *top;
+// One XGMII port of the model. Beats come from and go to the XGMII rings, or
+// in packet mode are made straight from and into packet mbufs.
+struct vtop_port {
+  uint16_t port_id;                  // DPDK port whose stats it counts in
+  uint8_t tid;                       // Direction for stats, 0 for Ethernet and 1 for PCIe
+  rte_ring *xgm_rx_ring;             // Beats into the model
+  rte_ring *xgm_tx_ring;             // Beats out of the model
+  rte_ring *pkt_rx_ring;             // Packets into the model, in packet mode
+  rte_ring *const *pkt_tx_rings;     // Packets out of the model, in packet mode
+  unsigned nb_pkt_tx_rings;          // Rings in pkt_tx_rings, which flows are spread over
+  xgmii_encoder *enc;                // Packet currently going into the model
+  xgmii_decoder *dec;                // Reassembles packets coming out of the model
+  rte_mbuf *rx_burst[PKT_BURST_SZ];  // Packets waiting to go into the model
+  uint16_t rx_nb, rx_idx;            // Packets in rx_burst, and the next one to send
+  uint16_t nb_out;                   // Beats in out
+  uint64_t nb_beats_in;              // Beats encoded since stats were last updated
+  uint32_t idle_run;                 // Idle beats out not yet sent on, in RLE mode
+  xgmii_beat out[XGMII_DEC_BURST_SZ];  // Beats waiting for the decoder
+#ifdef FESTOON_AXIS_WIDTH
+  axis_encoder axis_enc;             // Packet currently going into the model
+  vtop_axis_beat axis_in;            // Beat being offered to the model
+  bool axis_in_ready;                // tready just before the last rising edge
+#endif
+} __rte_cache_aligned;
+
+// One instance of the model, with its own ports, clock and worker lcore
+struct vtop_shard {
+  VerilatedContext *contextp;
+  Vtop *top;
+  vtop_port eth[FESTOON_NUM_PORTS], pci[FESTOON_NUM_PORTS];
+  vluint64_t main_time;     // Simulation time, skipped cycles included
+  uint64_t cycles;          // Clock cycles run through the model
+  uint64_t cycles_skipped;  // Cycles skipped while idle
+  uint64_t clock;           // Cycles run or skipped, which latency through the model is counted in
+  uint32_t idle_run;        // Idle cycles in a row so far
+  bool idle;                // Whether the model is stopped
+  uint64_t idle_tsc;        // When it was stopped
+  uint64_t wake_tsc;        // When it was last started
+  uint64_t run_tsc;         // TSC cycles spent clocking it, up to when it was last stopped
+  uint64_t run_cycles;      // Clock cycles run in that time
+  bool active;              // Whether anything went in or out this cycle
+} __rte_cache_aligned;
+
+vtop_shard *vtop_shards[VTOP_MAX_SHARDS];
+unsigned vtop_nb_shards;
+
+// Whether the worker converts between packets and XGMII itself
+bool vtop_pkt_mode = false;
+
+// How the worker steps the model through each clock cycle
+vtop_clocking_mode vtop_clocking = VTOP_CLOCK_EDGE;
+
+// What happens to idle beats coming out of the model
+vtop_idle_out_mode vtop_idle_out = VTOP_IDLE_OUT_DROP;
+
+// Stop clocking the model after this many idle cycles, 0 to never stop
+uint32_t vtop_idle_limit = 0;
+
+// Let $time in the design follow the shard's simulation time
+static inline void vtop_advance(vtop_shard *s, vluint64_t steps) {
+  s->main_time += steps;
+  s->contextp->time(s->main_time);
+}
 
-rte_ring *xgm_eth_rx_ring, *xgm_eth_tx_ring, *xgm_pci_rx_ring, *xgm_pci_tx_ring;
-rte_mempool *vtop_mempool;
+// Evaluate the model, counting the TSC cycles it takes when built with
+// FESTOON_CYCLE_STATS
+static inline void vtop_eval(Vtop *top) {
+#ifdef FESTOON_CYCLE_STATS
+  lcore_cycle_stats *cs = get_cycle_stats();
+  uint64_t start = rte_rdtsc();
+
+  top->eval();
+  cs->evals++;
+  cs->eval_cycles += rte_rdtsc() - start;
+#else
+  top->eval();
+#endif
+}
 
-// Simulation time
-vluint64_t main_time = 0;
+// Create one of the XGMII rings of a shard's port
+static rte_ring *vtop_ring_create(const char *name, unsigned shard, unsigned port) {
+  char ring_name[RTE_RING_NAMESIZE];
+  rte_ring *ring;
 
-void init_verilated_top(rte_mempool *mp) {
-  // Generate TX and RX queues for XGMII Ethernet
-  xgm_eth_rx_ring = rte_ring_create("XGMII eth tx", XGMII_RING_SZ, rte_socket_id(), RING_F_SP_ENQ);
-  if (xgm_eth_rx_ring == nullptr) throw runtime_error(rte_strerror(rte_errno));
+  snprintf(ring_name, sizeof(ring_name), "XGMII %s %u.%u", name, shard, port);
+  ring = rte_ring_create_elem(ring_name, sizeof(xgmii_beat), XGMII_RING_SZ,
+                              rte_socket_id(), RING_F_SP_ENQ | RING_F_SC_DEQ);
+  if (ring == nullptr) throw runtime_error(rte_strerror(rte_errno));
 
-  xgm_eth_tx_ring = rte_ring_create("XGMII eth rx", XGMII_RING_SZ, rte_socket_id(), RING_F_SP_ENQ);
-  if (xgm_eth_tx_ring == nullptr) throw runtime_error(rte_strerror(rte_errno));
+  return ring;
+}
 
-  // Generate TX and RX queues for XGMII PCIe
-  xgm_pci_tx_ring = rte_ring_create("XGMII pci tx", XGMII_RING_SZ, rte_socket_id(), RING_F_SP_ENQ);
-  if (xgm_pci_tx_ring == nullptr) throw runtime_error(rte_strerror(rte_errno));
+// Name of one of the threads of this process, or an empty string
+static string vtop_thread_name(const char *tid) {
+  char path[64], name[32] = "";
+  FILE *f;
+
+  snprintf(path, sizeof(path), "/proc/self/task/%s/comm", tid);
+  f = fopen(path, "r");
+  if (f == nullptr)
+    return "";
+  if (fgets(name, sizeof(name), f) == nullptr)
+    name[0] = '\0';
+  fclose(f);
+  return name;
+}
 
-  xgm_pci_rx_ring = rte_ring_create("XGMII pci rx", XGMII_RING_SZ, rte_socket_id(), RING_F_SP_ENQ);
-  if (xgm_pci_rx_ring == nullptr) throw runtime_error(rte_strerror(rte_errno));
+// IDs of the threads of this process that have the same name as the calling
+// thread. Verilator's worker threads keep the name they're started with,
+// while DPDK names each of its own threads, so those are left out.
+static set<pid_t> vtop_list_threads() {
+  char self[16];
+  set<pid_t> tids;
+  string name;
+  dirent *ent;
+  DIR *dir;
+
+  snprintf(self, sizeof(self), "%d", (int)rte_gettid());
+  name = vtop_thread_name(self);
+  dir = opendir("/proc/self/task");
+  if (dir == nullptr)
+    throw runtime_error("Could not list Verilator threads");
+  while ((ent = readdir(dir)) != nullptr) {
+    if (ent->d_name[0] != '.' && vtop_thread_name(ent->d_name) == name)
+      tids.insert(atoi(ent->d_name));
+  }
+  closedir(dir);
+  return tids;
+}
 
-  vtop_mempool = mp;
+// Pin each of the threads Verilator started, the ones that weren't there
+// before, to a set of CPUs of its own
+static void vtop_pin_threads(const set<pid_t> &before, unsigned nb_threads,
+                             const rte_cpuset_t *thread_cpus) {
+  set<pid_t> after = vtop_list_threads();
+  unsigned i = 0;
+
+  for (pid_t tid : before)
+    after.erase(tid);
+  if (after.size() != nb_threads)
+    throw runtime_error("Found " + to_string(after.size()) + " Verilator threads instead of " +
+                        to_string(nb_threads) + " to pin");
+
+  for (pid_t tid : after) {
+    if (sched_setaffinity(tid, sizeof(rte_cpuset_t), &thread_cpus[i++]) < 0)
+      throw runtime_error("Could not pin Verilator threads");
+  }
+}
+
+// Start one instance of the model and take it through reset
+static vtop_shard *vtop_shard_create(unsigned shard, unsigned nb_threads,
+                                     const rte_cpuset_t *thread_cpus) {
+  rte_cpuset_t saved_cpus, model_cpus;
+  set<pid_t> tids;
+  vtop_shard *s;
+  Vtop *top;
+  unsigned i;
+
+  s = (vtop_shard *)rte_zmalloc("vtop_shard", sizeof(vtop_shard), RTE_CACHE_LINE_SIZE);
+  if (s == nullptr) throw runtime_error("Could not allocate Verilator shard");
+
+  for (i = 0; i < FESTOON_NUM_PORTS; i++) {
+    // Generate TX and RX queues for XGMII Ethernet
+    s->eth[i].tid = 0;
+    s->eth[i].xgm_rx_ring = vtop_ring_create("eth tx", shard, i);
+    s->eth[i].xgm_tx_ring = vtop_ring_create("eth rx", shard, i);
+
+    // Generate TX and RX queues for XGMII PCIe
+    s->pci[i].tid = 1;
+    s->pci[i].xgm_rx_ring = vtop_ring_create("pci rx", shard, i);
+    s->pci[i].xgm_tx_ring = vtop_ring_create("pci tx", shard, i);
+  }
+
+  // Start Verilator model. Its worker threads are started along with it and
+  // take on the affinity of this thread, so move over to their lcores for it,
+  // then give each thread its own.
+  if (nb_threads) {
+    CPU_ZERO(&model_cpus);
+    for (i = 0; i < nb_threads; i++)
+      RTE_CPU_OR(&model_cpus, &model_cpus, &thread_cpus[i]);
+    tids = vtop_list_threads();
+    rte_thread_get_affinity(&saved_cpus);
+    if (rte_thread_set_affinity(&model_cpus) < 0)
+      throw runtime_error("Could not pin Verilator threads");
+  }
+
+  s->contextp = new VerilatedContext;
+  s->contextp->threads(nb_threads + 1);
+  top = s->top = new Vtop(s->contextp);
+
+  if (nb_threads) {
+    rte_thread_set_affinity(&saved_cpus);
+    vtop_pin_threads(tids, nb_threads, thread_cpus);
+  }
 
-  // Start Verilator model
-  top = new Vtop;
+#ifdef FESTOON_AXIS_WIDTH
+  // Packets coming out of the model are always taken
+  top->eth_out_axis_tready = 1;
+  top->pcie_out_axis_tready = 1;
+#endif
 
   // Pull down reset for a few clocks
   top->clk = 0;
-  while (main_time < 51) {
-    if (main_time > 10 * 3) {
+  while (s->main_time < 51) {
+    if (s->main_time > 10 * 3) {
       top->reset = 1;
     } else {
       top->reset = 0;
     }
 
     // Toggle clock
-    if ((main_time % 10) == 1) {
+    if ((s->main_time % 10) == 1) {
       top->clk = 1;
     }
-    if ((main_time % 10) == 6) {
+    if ((s->main_time % 10) == 6) {
       top->clk = 0;
     }
 
-    top->eval();  // Evaluate model
-    main_time++;  // Time passes
+    top->eval();         // Evaluate model
+    vtop_advance(s, 1);  // Time passes
   }
+
+  return s;
 }
 
-// Run the Verilator module as a worker thread
-void verilator_top_worker() {
-  rte_mbuf *eth_fr[1] __rte_cache_aligned,
-           *pci_fr[1] __rte_cache_aligned;
-  int i, eth_nb_rx, pci_nb_rx, eth_nb_tx = 0, pci_nb_tx = 0;
+void init_verilated_top(unsigned nb_shards, unsigned nb_threads,
+                        const rte_cpuset_t *thread_cpus) {
+  unsigned i;
 
-  // Loop for a clock cycle and deque + queue XGMII frames
-  for (i = 0; i < 10; i++) {
-    if (Verilated::gotFinish()) {
-      RTE_LOG(INFO, APP, "Verilator simulation finished\n");
+  for (i = 0; i < nb_shards; i++)
+    vtop_shards[i] = vtop_shard_create(i, nb_threads, thread_cpus);
+  vtop_nb_shards = nb_shards;
+}
+
+void vtop_set_pkt_mode(unsigned shard, unsigned port, rte_ring *eth_rx_ring, rte_ring *const *eth_tx_rings,
+                       unsigned nb_eth_tx_rings, xgmii_encoder *eth_enc, xgmii_decoder *eth_dec,
+                       rte_ring *pci_rx_ring, rte_ring *const *pci_tx_rings,
+                       unsigned nb_pci_tx_rings, xgmii_encoder *pci_enc, xgmii_decoder *pci_dec) {
+  vtop_port *eth = &vtop_shards[shard]->eth[port], *pci = &vtop_shards[shard]->pci[port];
+
+  eth->pkt_rx_ring = eth_rx_ring;
+  eth->pkt_tx_rings = eth_tx_rings;
+  eth->nb_pkt_tx_rings = nb_eth_tx_rings;
+  eth->enc = eth_enc;
+  eth->dec = eth_dec;
+
+  pci->pkt_rx_ring = pci_rx_ring;
+  pci->pkt_tx_rings = pci_tx_rings;
+  pci->nb_pkt_tx_rings = nb_pci_tx_rings;
+  pci->enc = pci_enc;
+  pci->dec = pci_dec;
+
+  vtop_pkt_mode = true;
+}
+
+void vtop_set_port_id(unsigned port, uint16_t port_id) {
+  unsigned i;
+
+  for (i = 0; i < vtop_nb_shards; i++) {
+    vtop_shards[i]->eth[port].port_id = port_id;
+    vtop_shards[i]->pci[port].port_id = port_id;
+  }
+}
+
+void vtop_set_clocking(vtop_clocking_mode clocking) {
+  vtop_clocking = clocking;
+}
+
+void vtop_set_idle_out(vtop_idle_out_mode idle_out) {
+  vtop_idle_out = idle_out;
+}
+
+void vtop_set_idle_skip(uint32_t idle_cycles) {
+  vtop_idle_limit = idle_cycles;
+}
+
+const uint64_t *vtop_get_clock(unsigned shard) {
+  return &vtop_shards[shard]->clock;
+}
+
+void vtop_get_cycles(uint64_t *cycles, uint64_t *skipped) {
+  unsigned i;
+
+  *cycles = 0;
+  *skipped = 0;
+  for (i = 0; i < vtop_nb_shards; i++) {
+    *cycles += vtop_shards[i]->cycles;
+    *skipped += vtop_shards[i]->cycles_skipped;
+  }
+}
+
+// Next packet to send into a port in packet mode, or nullptr if none is waiting
+static inline rte_mbuf *vtop_next_pkt(vtop_port *port) {
+  rte_mbuf *pkt;
+
+  while (true) {
+    if (port->rx_idx == port->rx_nb) {
+      port->rx_nb = rte_ring_dequeue_burst(port->pkt_rx_ring, (void **)port->rx_burst,
+                                           PKT_BURST_SZ, nullptr);
+      port->rx_idx = 0;
+      if (port->rx_nb == 0)
+        return nullptr;
+      cycle_stats_packets(port->rx_nb);
+      if (unlikely(lat_enabled()))
+        lat_dequeued(port->rx_burst, port->rx_nb, port->port_id, port->tid);
+    }
+
+    pkt = port->rx_burst[port->rx_idx++];
+    if (unlikely(rte_pktmbuf_pkt_len(pkt) == 0)) {
+      rte_pktmbuf_free(pkt);
+      continue;
+    }
+    if (split_enabled())
+      pkt = split_header(pkt, port->port_id, port->tid);
+    if (likely(pkt != nullptr && xgmii_encodable(pkt)))
+      return pkt;
+    rte_pktmbuf_free(pkt);
+    get_kni_stats()[port->port_id].xgmii_rx_rejected[port->tid]++;
+  }
+}
+
+// Get the next beat to drive into a port
+static inline void vtop_get_beat(vtop_shard *s, vtop_port *port, xgmii_beat *beat) {
+  rte_mbuf *pkt;
+
+  if (!vtop_pkt_mode) {
+    if (likely(rte_ring_dequeue_elem(port->xgm_rx_ring, beat, sizeof(xgmii_beat)) == 0)) {
+      cycle_stats_beats(1);
+      s->active = true;
+      return;
+    }
+  } else {
+    // Move on to the next packet once the last one is out
+    if (port->enc->pkt == nullptr && (pkt = vtop_next_pkt(port)) != nullptr)
+      xgmii_encoder_load(port->enc, pkt);
+
+    if (likely(port->enc->pkt != nullptr)) {
+      xgmii_encode_beat(port->enc, beat);
+      port->nb_beats_in++;
+      s->active = true;
+      return;
+    }
+
+    // The idle beat counts towards the gap before the next packet
+    xgmii_encoder_idle(port->enc);
+  }
+
+  // Send in an idle frame
+  beat->ctrl = 0b11111111;
+  beat->data = 0x0707070707070707;
+}
+
+// Pass on a run of idle beats as a single one
+static inline void vtop_put_idle_run(vtop_port *port) {
+  xgmii_beat beat;
+
+  beat.ctrl = 0b11111111;
+  beat.data = 0x0707070707070707;
+  beat.repeat = port->idle_run - 1;
+  if (unlikely(rte_ring_enqueue_elem(port->xgm_tx_ring, &beat, sizeof(xgmii_beat)) != 0))
+    get_kni_stats()[port->port_id].xgmii_out_dropped[port->tid] += port->idle_run;
+  port->idle_run = 0;
+}
+
+// Pass on a beat coming out of a port
+static inline void vtop_put_beat(vtop_shard *s, vtop_port *port, const xgmii_beat *beat) {
+  bool idle = beat->ctrl == 0b11111111 && beat->data == 0x0707070707070707;
+
+  s->active |= !idle;
+
+  if (!vtop_pkt_mode) {
+    if (idle && vtop_idle_out != VTOP_IDLE_OUT_KEEP) {
+      // Count the idle beat towards the run, or leave it out. Long runs are
+      // sent on in pieces, so the decoder sees time pass while nothing comes out.
+      if (vtop_idle_out == VTOP_IDLE_OUT_RLE && ++port->idle_run == VTOP_IDLE_RUN_MAX)
+        vtop_put_idle_run(port);
       return;
     }
 
-    if ((main_time % 10) == 1) {
-      // Read Eth frame each rising clock
-      eth_nb_rx = rte_ring_dequeue_bulk(xgm_eth_rx_ring, (void **)&eth_fr, 1, nullptr);
-
-      if (likely(eth_nb_rx == 1)) {
-        // If good, update input wires
-        top->eth_in_xgmii_ctrl = *rte_pktmbuf_mtod(eth_fr[0], CData *);
-        top->eth_in_xgmii_data = *rte_pktmbuf_mtod_offset(eth_fr[0], QData *, sizeof(CData));
-      } else {
-        // Send in a blank frame
-        top->eth_in_xgmii_ctrl = 0b00000000;
-        top->eth_in_xgmii_data = 0x0707070707070707;
-
-        // Alloc new rte_mbufs
-        eth_fr[0] = rte_pktmbuf_alloc(vtop_mempool);
-      }
-
-      // Read PCI frame each rising clock
-      pci_nb_rx = rte_ring_dequeue_bulk(xgm_pci_rx_ring, (void **)&pci_fr, 1, nullptr);
-
-      if (likely(pci_nb_rx == 1)) {
-        // If good, update input wires
-        top->pcie_in_xgmii_ctrl = *rte_pktmbuf_mtod(pci_fr[0], CData *);
-        top->pcie_in_xgmii_data = *rte_pktmbuf_mtod_offset(pci_fr[0], QData *, sizeof(CData));
-      } else {
-        // Send in a blank frame
-        top->pcie_in_xgmii_ctrl = 0b00000000;
-        top->pcie_in_xgmii_data = 0x0707070707070707;
-
-        // Alloc new rte_mbufs
-        pci_fr[0] = rte_pktmbuf_alloc(vtop_mempool);
-      }
+    if (port->idle_run)
+      vtop_put_idle_run(port);
+
+    // Beats that don't fit in the XGMII ring are dropped
+    cycle_stats_beats(1);
+    if (unlikely(rte_ring_enqueue_elem(port->xgm_tx_ring, (void *)beat, sizeof(xgmii_beat)) != 0))
+      get_kni_stats()[port->port_id].xgmii_out_dropped[port->tid]++;
+    return;
+  }
+
+  // Idle beats carry nothing for the decoder
+  if (idle)
+    return;
+
+  port->out[port->nb_out++] = *beat;
+
+  // Decode once the buffer is full, or straight away on /S/ or /T/ so that
+  // packets don't wait on the next one
+  if (port->nb_out == XGMII_DEC_BURST_SZ || beat->ctrl) {
+    xgmii_decoder_feed(port->dec, port->out, port->nb_out);
+    xgmii_decoder_flush(port->dec, port->pkt_tx_rings, port->nb_pkt_tx_rings);
+    port->nb_out = 0;
+  }
+}
+
+#ifdef FESTOON_AXIS_WIDTH
+// Offer the next beat to an AXI-Stream input of the model, once it has taken
+// the last one. Beats change right after the rising edge, and are taken on the
+// next one if tready was high just before it.
+template <typename Data, typename Keep>
+static inline void vtop_axis_drive(vtop_shard *s, vtop_port *port, Data &tdata, Keep &tkeep,
+                                   CData &tlast, CData &tvalid) {
+  // Hold the beat until the model takes it
+  if (tvalid && !port->axis_in_ready) {
+    s->active = true;
+    return;
+  }
+
+  if (port->axis_enc.pkt == nullptr) {
+    port->axis_enc.pkt = vtop_next_pkt(port);
+    port->axis_enc.off = 0;
+  }
+
+  if (port->axis_enc.pkt == nullptr) {
+    tvalid = 0;
+    return;
+  }
+
+  // The encoder frees the packet with its last beat
+  if (unlikely(lat_enabled()) &&
+      rte_pktmbuf_pkt_len(port->axis_enc.pkt) - port->axis_enc.off <= vtop_axis_beat::bytes)
+    lat_encoded(port->axis_enc.pkt, port->port_id, port->tid, &s->clock);
+  axis_encode_beat(&port->axis_enc, &port->axis_in);
+  port->nb_beats_in++;
+  s->active = true;
+
+  vl_store(tdata, port->axis_in.data, vtop_axis_beat::bytes);
+  vl_store(tkeep, &port->axis_in.keep, vtop_axis_beat::bytes / 8);
+  tlast = port->axis_in.last;
+  tvalid = 1;
+}
+
+// Sample an AXI-Stream port pair of the model just before the rising edge.
+// Output tready is tied high, so any valid beat is taken on that edge.
+template <typename Data, typename Keep>
+static inline void vtop_axis_sample(vtop_shard *s, vtop_port *port, CData in_tready,
+                                    const Data &tdata, const Keep &tkeep, CData tlast,
+                                    CData tvalid) {
+  vtop_axis_beat beat;
+
+  port->axis_in_ready = in_tready;
+  if (!tvalid)
+    return;
+  s->active = true;
+
+  vl_load(beat.data, tdata, vtop_axis_beat::bytes);
+  beat.keep = 0;
+  vl_load(&beat.keep, tkeep, vtop_axis_beat::bytes / 8);
+  beat.last = tlast;
+
+  axis_decode_beat(port->dec, &beat);
+  if (beat.last)
+    xgmii_decoder_flush(port->dec, port->pkt_tx_rings, port->nb_pkt_tx_rings);
+}
+
+// Offer the next beats to the model's inputs
+static inline void vtop_drive(vtop_shard *s) {
+  Vtop *top = s->top;
+
+  vtop_axis_drive(s, &s->eth[0], top->eth_in_axis_tdata, top->eth_in_axis_tkeep,
+                  top->eth_in_axis_tlast, top->eth_in_axis_tvalid);
+  vtop_axis_drive(s, &s->pci[0], top->pcie_in_axis_tdata, top->pcie_in_axis_tkeep,
+                  top->pcie_in_axis_tlast, top->pcie_in_axis_tvalid);
+}
+
+// Collect beats the model is sending, and see whether it takes ours
+static inline void vtop_sample(vtop_shard *s) {
+  Vtop *top = s->top;
+
+  vtop_axis_sample(s, &s->eth[0], top->eth_in_axis_tready, top->eth_out_axis_tdata,
+                   top->eth_out_axis_tkeep, top->eth_out_axis_tlast,
+                   top->eth_out_axis_tvalid);
+  vtop_axis_sample(s, &s->pci[0], top->pcie_in_axis_tready, top->pcie_out_axis_tdata,
+                   top->pcie_out_axis_tkeep, top->pcie_out_axis_tlast,
+                   top->pcie_out_axis_tvalid);
+}
+
+// AXI-Stream beats are held for a whole cycle, so they change after the edge
+static const bool vtop_drive_after_edge = true;
+#else
+// Port i of a signal carrying a T for each port side by side. Verilator keeps
+// signals little-endian, in 32 bit words once they're wider than 64 bits.
+template <typename T, typename Sig>
+static inline void vl_set_port(Sig &sig, unsigned i, T val) {
+  memcpy((uint8_t *)&sig + i * sizeof(T), &val, sizeof(T));
+}
+
+template <typename T, typename Sig>
+static inline T vl_get_port(const Sig &sig, unsigned i) {
+  T val;
+
+  memcpy(&val, (const uint8_t *)&sig + i * sizeof(T), sizeof(T));
+  return val;
+}
+
+// Read a frame for each port and update the input wires
+static inline void vtop_drive(vtop_shard *s) {
+  Vtop *top = s->top;
+  xgmii_beat eth_fr, pci_fr;
+  unsigned i;
+
+  for (i = 0; i < FESTOON_NUM_PORTS; i++) {
+    vtop_get_beat(s, &s->eth[i], &eth_fr);
+    vl_set_port<uint8_t>(top->eth_in_xgmii_ctrl, i, eth_fr.ctrl);
+    vl_set_port<uint64_t>(top->eth_in_xgmii_data, i, eth_fr.data);
+
+    // Same for the PCI frame
+    vtop_get_beat(s, &s->pci[i], &pci_fr);
+    vl_set_port<uint8_t>(top->pcie_in_xgmii_ctrl, i, pci_fr.ctrl);
+    vl_set_port<uint64_t>(top->pcie_in_xgmii_data, i, pci_fr.data);
+  }
+}
+
+// Convert Verilator outputs into frames and transmit them
+static inline void vtop_sample(vtop_shard *s) {
+  Vtop *top = s->top;
+  xgmii_beat eth_fr, pci_fr;
+  unsigned i;
+
+  eth_fr.repeat = 0;
+  pci_fr.repeat = 0;
+
+  for (i = 0; i < FESTOON_NUM_PORTS; i++) {
+    eth_fr.ctrl = vl_get_port<uint8_t>(top->eth_out_xgmii_ctrl, i);
+    eth_fr.data = vl_get_port<uint64_t>(top->eth_out_xgmii_data, i);
+    vtop_put_beat(s, &s->eth[i], &eth_fr);
+
+    // Same for the PCI frame
+    pci_fr.ctrl = vl_get_port<uint8_t>(top->pcie_out_xgmii_ctrl, i);
+    pci_fr.data = vl_get_port<uint64_t>(top->pcie_out_xgmii_data, i);
+    vtop_put_beat(s, &s->pci[i], &pci_fr);
+  }
+}
+
+// XGMII frames enter with the rising edge
+static const bool vtop_drive_after_edge = false;
+#endif
+
+// Run one clock cycle in ten time steps, evaluating the model on each
+static inline void vtop_cycle_legacy(vtop_shard *s) {
+  Vtop *top = s->top;
+  int i;
+
+  for (i = 0; i < 10; i++) {
+    if ((s->main_time % 10) == 1) {
+      if (!vtop_drive_after_edge)
+        vtop_drive(s);
 
       // Toggle clock
       top->clk = 1;
-    } else if ((main_time % 10) == 6) {
+    } else if ((s->main_time % 10) == 2) {
+      if (vtop_drive_after_edge)
+        vtop_drive(s);
+    } else if ((s->main_time % 10) == 6) {
       // Toggle clock
       top->clk = 0;
-    } else if ((main_time % 10) == 9) {
-      // Convert Verilator outputs into frame
-      *rte_pktmbuf_mtod(eth_fr[0], CData *) = top->eth_out_xgmii_ctrl;
-      *rte_pktmbuf_mtod_offset(eth_fr[0], QData *, sizeof(CData)) = top->eth_out_xgmii_data;
+    } else if ((s->main_time % 10) == 9) {
+      vtop_sample(s);
+    }
+
+    vtop_eval(top);      // Evaluate model
+    vtop_advance(s, 1);  // Time passes...
+  }
+}
+
+// Run one clock cycle, evaluating the model only on its two edges. Nothing
+// changes in between, so outputs read after the falling edge are the same as
+// just before the next rising one.
+static inline void vtop_cycle_edge(vtop_shard *s) {
+  Vtop *top = s->top;
+
+  if (!vtop_drive_after_edge)
+    vtop_drive(s);
+
+  top->clk = 1;
+  vtop_eval(top);
+
+  if (vtop_drive_after_edge)
+    vtop_drive(s);
+
+  top->clk = 0;
+  vtop_eval(top);
+
+  vtop_sample(s);
+  vtop_advance(s, 10);
+}
+
+// Whether there's traffic waiting to go into a port
+static inline bool vtop_port_waiting(vtop_port *port) {
+  if (!vtop_pkt_mode)
+    return !rte_ring_empty(port->xgm_rx_ring);
+
+  return port->rx_idx < port->rx_nb || !rte_ring_empty(port->pkt_rx_ring);
+}
+
+// Whether there's traffic waiting to go into the model
+static inline bool vtop_inputs_waiting(vtop_shard *s) {
+  unsigned i;
+
+  for (i = 0; i < FESTOON_NUM_PORTS; i++) {
+    if (vtop_port_waiting(&s->eth[i]) || vtop_port_waiting(&s->pci[i]))
+      return true;
+  }
+
+  return false;
+}
+
+// Pass on partial packet bursts once they time out
+static inline void vtop_flush(vtop_shard *s) {
+  unsigned i;
+
+  for (i = 0; i < FESTOON_NUM_PORTS; i++) {
+    xgmii_decoder_flush(s->eth[i].dec, s->eth[i].pkt_tx_rings, s->eth[i].nb_pkt_tx_rings);
+    xgmii_decoder_flush(s->pci[i].dec, s->pci[i].pkt_tx_rings, s->pci[i].nb_pkt_tx_rings);
+  }
+}
+
+// Stop clocking the model, once it's been idle long enough
+static void vtop_sleep(vtop_shard *s) {
+  s->idle = true;
+  s->idle_tsc = rte_rdtsc();
+  s->run_tsc += s->idle_tsc - s->wake_tsc;
+  s->run_cycles = s->cycles;
+}
+
+// Start clocking the model again after an idle stretch. The cycles it would
+// have run in the meantime, at the rate it's been simulated so far, are added
+// to the simulation time. The rate is capped at VTOP_CLOCK_HZ.
+static void vtop_wake(vtop_shard *s) {
+  uint64_t now = rte_rdtsc();
+  double rate = RTE_MIN((double)s->run_cycles / s->run_tsc, (double)VTOP_CLOCK_HZ / rte_get_tsc_hz());
+  uint64_t skipped = (now - s->idle_tsc) * rate;
+
+  s->cycles_skipped += skipped;
+  s->clock += skipped;
+  vtop_advance(s, 10 * skipped);
+  s->idle_run = 0;
+  s->idle = false;
+  s->wake_tsc = now;
+}
+
+// Add the beats sent into a port to the stats
+static inline void vtop_port_stats(vtop_port *port) {
+  if (port->nb_beats_in) {
+    cycle_stats_beats(port->nb_beats_in);
+    get_kni_stats()[port->port_id].xgmii_rx_packets[port->tid] += port->nb_beats_in;
+    port->nb_beats_in = 0;
+  }
+}
+
+// Run one instance of the Verilator module as a worker thread
+unsigned verilator_top_worker(unsigned shard) {
+  vtop_shard *s = vtop_shards[shard];
+  unsigned i;
 
-      // Transmit Eth frame
-      eth_nb_tx = rte_ring_enqueue_bulk(xgm_eth_tx_ring, (void **) eth_fr, 1, nullptr);
+  if (s->contextp->gotFinish()) {
+    RTE_LOG(INFO, APP, "Verilator simulation finished\n");
+    return 0;
+  }
 
-      // Convert Verilator outputs into frame
-      *rte_pktmbuf_mtod(pci_fr[0], CData *) = top->pcie_out_xgmii_ctrl;
-      *rte_pktmbuf_mtod_offset(pci_fr[0], QData *, sizeof(CData)) = top->pcie_out_xgmii_data;
+  // The simulation rate is measured from the first cycle
+  if (unlikely(s->wake_tsc == 0))
+    s->wake_tsc = rte_rdtsc();
+
+  // While idle, wait for traffic instead of clocking the model. The lcore
+  // backs off like any other with nothing to do.
+  if (unlikely(s->idle)) {
+    if (!vtop_inputs_waiting(s)) {
+      if (vtop_pkt_mode)
+        vtop_flush(s);
+      return 0;
+    }
+    vtop_wake(s);
+  }
 
-      // Transmit PCI frame
-      pci_nb_tx = rte_ring_enqueue_bulk(xgm_pci_tx_ring, (void **) pci_fr, 1, nullptr);
+  // Loop for a clock cycle and deque + queue frames
+  s->active = false;
+  if (vtop_clocking == VTOP_CLOCK_LEGACY)
+    vtop_cycle_legacy(s);
+  else
+    vtop_cycle_edge(s);
+  s->cycles++;
+  s->clock++;
+
+  // Stop once nothing has gone in or come out for long enough
+  if (vtop_idle_limit) {
+    if (s->active) {
+      s->idle_run = 0;
+    } else if (++s->idle_run >= vtop_idle_limit) {
+      vtop_sleep(s);
+    }
+  }
 
-      // Free mbufs not tx to xgm_eth_tx_ring
-      if (unlikely(eth_nb_tx < 1))
-        kni_burst_free_mbufs(&eth_fr[0], 1);
+  if (vtop_pkt_mode) {
+    vtop_flush(s);
 
-      // Free mbufs not tx to xgm_pci_tx_ring
-      if (unlikely(pci_nb_tx < 1))
-        kni_burst_free_mbufs(&pci_fr[0], 1);
+    for (i = 0; i < FESTOON_NUM_PORTS; i++) {
+      vtop_port_stats(&s->eth[i]);
+      vtop_port_stats(&s->pci[i]);
     }
+  }
+
+  return 1;
+}
 
-    top->eval();  // Evaluate model
-    main_time++;  // Time passes...
+// Drop packets still waiting to go into a port, and free its rings
+static void vtop_port_free(vtop_port *port) {
+  if (vtop_pkt_mode) {
+    rte_pktmbuf_free(port->enc->pkt);
+    port->enc->pkt = nullptr;
   }
+#ifdef FESTOON_AXIS_WIDTH
+  rte_pktmbuf_free(port->axis_enc.pkt);
+#endif
+  kni_burst_free_mbufs(&port->rx_burst[port->rx_idx], port->rx_nb - port->rx_idx);
+
+  rte_ring_free(port->xgm_rx_ring);
+  rte_ring_free(port->xgm_tx_ring);
 }
 
-// Free Verilator model and buffers
+// Free Verilator models and buffers
 void stop_verilated_top() {
-  top->final();
-  delete top;
+  vtop_shard *s;
+  unsigned i, j;
+
+  for (i = 0; i < vtop_nb_shards; i++) {
+    s = vtop_shards[i];
 
-  rte_ring_free(xgm_eth_rx_ring);
-  rte_ring_free(xgm_eth_tx_ring);
+    s->top->final();
+    delete s->top;
+    delete s->contextp;
 
-  rte_ring_free(xgm_pci_rx_ring);
-  rte_ring_free(xgm_pci_tx_ring);
+    for (j = 0; j < FESTOON_NUM_PORTS; j++) {
+      vtop_port_free(&s->eth[j]);
+      vtop_port_free(&s->pci[j]);
+    }
+
+    rte_free(s);
+    vtop_shards[i] = nullptr;
+  }
+  vtop_nb_shards = 0;
 }
 
-rte_ring *get_vtop_eth_rx_ring() { return xgm_eth_rx_ring; }
+rte_ring *get_vtop_eth_rx_ring(unsigned shard, unsigned port) {
+  return vtop_shards[shard]->eth[port].xgm_rx_ring;
+}
 
-rte_ring *get_vtop_eth_tx_ring() { return xgm_eth_tx_ring; }
+rte_ring *get_vtop_eth_tx_ring(unsigned shard, unsigned port) {
+  return vtop_shards[shard]->eth[port].xgm_tx_ring;
+}
 
-rte_ring *get_vtop_pci_rx_ring() { return xgm_pci_rx_ring; }
+rte_ring *get_vtop_pci_rx_ring(unsigned shard, unsigned port) {
+  return vtop_shards[shard]->pci[port].xgm_rx_ring;
+}
 
-rte_ring *get_vtop_pci_tx_ring() { return xgm_pci_tx_ring; }
+rte_ring *get_vtop_pci_tx_ring(unsigned shard, unsigned port) {
+  return vtop_shards[shard]->pci[port].xgm_tx_ring;
+}
@@ -1,22 +1,81 @@
 #ifndef FESTOON_TOP_H
 #define FESTOON_TOP_H
 
+#include <rte_lcore.h>
 #include <rte_ring.h>
-#include <rte_mempool.h>
 
-// Initialize Verilator model and buffers
-void init_verilated_top(rte_mempool *mp);
+#include "festoon_xgmii.h"
 
-// Free Verilator model and buffers
+// Threads the model was verilated with, passed in by CMake
+#ifndef FESTOON_VTOP_THREADS
+#define FESTOON_VTOP_THREADS 1
+#endif
+
+// Ethernet and PCIe port pairs on the model, passed in by CMake
+#ifndef FESTOON_NUM_PORTS
+#define FESTOON_NUM_PORTS 1
+#endif
+
+// Initialize nb_shards independent instances of the Verilator model, each with
+// its own XGMII rings and buffers. Each model's nb_threads worker threads, on
+// top of the thread calling eval(), are pinned one each to the nb_threads
+// sets of CPUs in thread_cpus.
+void init_verilated_top(unsigned nb_shards, unsigned nb_threads,
+                        const rte_cpuset_t *thread_cpus);
+
+// Free Verilator models and buffers
 void stop_verilated_top();
 
-// Run the Verilator module as a worker thread
-void verilator_top_worker();
+// Count the traffic through one of the models' ports in the stats of a DPDK port
+void vtop_set_port_id(unsigned port, uint16_t port_id);
+
+// Have the worker of a shard take packets from and give packets to the mbuf
+// rings of one of the model's ports itself, instead of going through the XGMII
+// rings and conversion lcores. Packets out of the model are spread over the TX
+// rings by flow.
+void vtop_set_pkt_mode(unsigned shard, unsigned port, rte_ring *eth_rx_ring, rte_ring *const *eth_tx_rings,
+                       unsigned nb_eth_tx_rings, xgmii_encoder *eth_enc, xgmii_decoder *eth_dec,
+                       rte_ring *pci_rx_ring, rte_ring *const *pci_tx_rings,
+                       unsigned nb_pci_tx_rings, xgmii_encoder *pci_enc, xgmii_decoder *pci_dec);
+
+// How the worker steps the model through a clock cycle
+enum vtop_clocking_mode {
+  VTOP_CLOCK_EDGE,   // Evaluate on the rising and falling edges only
+  VTOP_CLOCK_LEGACY  // Evaluate on all ten time steps of the cycle
+};
+
+void vtop_set_clocking(vtop_clocking_mode clocking);
+
+// What happens to idle beats coming out of the model, when they go to the
+// XGMII rings
+enum vtop_idle_out_mode {
+  VTOP_IDLE_OUT_DROP,  // Leave them out
+  VTOP_IDLE_OUT_RLE,   // Send one idle beat per run ahead of the next beat, with its length in repeat
+  VTOP_IDLE_OUT_KEEP   // Send every one of them
+};
+
+void vtop_set_idle_out(vtop_idle_out_mode idle_out);
+
+// Stop clocking the model once nothing has gone in or come out of it for
+// idle_cycles cycles, until more traffic arrives. 0 keeps it always running.
+void vtop_set_idle_skip(uint32_t idle_cycles);
+
+// Clock cycles the models have run, and cycles skipped while they were idle,
+// summed over all shards
+void vtop_get_cycles(uint64_t *cycles, uint64_t *skipped);
+
+// Cycles a shard's model has run or skipped, for encoders and decoders to time
+// packets through it by
+const uint64_t *vtop_get_clock(unsigned shard);
+
+// Run one clock cycle of a shard of the Verilator module. Returns the number
+// of cycles run, which is 0 while the model is stopped for being idle.
+unsigned verilator_top_worker(unsigned shard);
 
-rte_ring *get_vtop_eth_rx_ring();
-rte_ring *get_vtop_eth_tx_ring();
+rte_ring *get_vtop_eth_rx_ring(unsigned shard, unsigned port);
+rte_ring *get_vtop_eth_tx_ring(unsigned shard, unsigned port);
 
-rte_ring *get_vtop_pci_rx_ring();
-rte_ring *get_vtop_pci_tx_ring();
+rte_ring *get_vtop_pci_rx_ring(unsigned shard, unsigned port);
+rte_ring *get_vtop_pci_tx_ring(unsigned shard, unsigned port);
 
 #endif
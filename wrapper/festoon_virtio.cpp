@@ -0,0 +1,457 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <stddef.h>
+
+#include <rte_bus_vdev.h>
+#include <rte_ethdev.h>
+#include <rte_ether.h>
+#include <rte_gro.h>
+#include <rte_ip.h>
+#include <rte_mbuf.h>
+#include <rte_net.h>
+#include <rte_tcp.h>
+#include <rte_udp.h>
+
+#include "festoon_bypass.h"
+#include "festoon_common.h"
+#include "festoon_latency.h"
+#include "festoon_virtio.h"
+
+// Fill in an L4 checksum that the kernel left to us. All it put in the
+// checksum field is the pseudo-header sum, so summing the L4 header and payload
+// over it gives the real one.
+static void virtio_finish_cksum(rte_mbuf *pkt) {
+  rte_net_hdr_lens hdr_lens;
+  const rte_ipv4_hdr *ip4;
+  const rte_ipv6_hdr *ip6;
+  uint32_t ptype, off, len, cksum_off;
+  uint16_t cksum;
+
+  if ((pkt->ol_flags & RTE_MBUF_F_RX_L4_CKSUM_MASK) != RTE_MBUF_F_RX_L4_CKSUM_NONE)
+    return;
+
+  ptype = rte_net_get_ptype(pkt, &hdr_lens, RTE_PTYPE_L2_MASK | RTE_PTYPE_L3_MASK | RTE_PTYPE_L4_MASK);
+  off = hdr_lens.l2_len + hdr_lens.l3_len;
+  if ((ptype & RTE_PTYPE_L4_MASK) == RTE_PTYPE_L4_TCP)
+    cksum_off = off + offsetof(rte_tcp_hdr, cksum);
+  else if ((ptype & RTE_PTYPE_L4_MASK) == RTE_PTYPE_L4_UDP)
+    cksum_off = off + offsetof(rte_udp_hdr, dgram_cksum);
+  else
+    return;
+  if (unlikely(cksum_off + sizeof(cksum) > rte_pktmbuf_data_len(pkt)))
+    return;
+
+  // Take the L4 length from the IP header, in case anything was added past it
+  if (RTE_ETH_IS_IPV4_HDR(ptype)) {
+    ip4 = rte_pktmbuf_mtod_offset(pkt, const rte_ipv4_hdr *, hdr_lens.l2_len);
+    len = rte_be_to_cpu_16(ip4->total_length) - hdr_lens.l3_len;
+  } else {
+    ip6 = rte_pktmbuf_mtod_offset(pkt, const rte_ipv6_hdr *, hdr_lens.l2_len);
+    len = rte_be_to_cpu_16(ip6->payload_len) + sizeof(*ip6) - hdr_lens.l3_len;
+  }
+  if (unlikely(off + len > rte_pktmbuf_pkt_len(pkt)) ||
+      rte_raw_cksum_mbuf(pkt, off, len, &cksum) != 0)
+    return;
+
+  // 0xffff rather than 0, which means no checksum for UDP
+  if (likely(cksum != 0xffff))
+    cksum = ~cksum;
+  *rte_pktmbuf_mtod_offset(pkt, uint16_t *, cksum_off) = cksum;
+  pkt->ol_flags = (pkt->ol_flags & ~RTE_MBUF_F_RX_L4_CKSUM_MASK) | RTE_MBUF_F_RX_L4_CKSUM_GOOD;
+}
+
+// Cut a TCP super-frame from the kernel back into segments of its MSS, each in
+// one mbuf with whole checksums, like the design would see on the wire. Makes up
+// to max_segs segments from the payload at *off on (0 for the start), and moves
+// *off past them. Returns how many were made, or 0 if it can't be cut up.
+static unsigned virtio_segment(rte_mbuf *pkt, uint32_t *off, rte_mbuf **segs, unsigned max_segs) {
+  rte_net_hdr_lens hdr_lens;
+  const rte_tcp_hdr *tcp;
+  rte_ipv4_hdr *ip4;
+  rte_ipv6_hdr *ip6;
+  rte_tcp_hdr *th;
+  uint32_t ptype, hdr_len, mss, seg_len, seq, pkt_len = rte_pktmbuf_pkt_len(pkt);
+  unsigned i, nb_segs;
+  const void *data;
+  char *dst;
+
+  ptype = rte_net_get_ptype(pkt, &hdr_lens, RTE_PTYPE_L2_MASK | RTE_PTYPE_L3_MASK | RTE_PTYPE_L4_MASK);
+  hdr_len = hdr_lens.l2_len + hdr_lens.l3_len + hdr_lens.l4_len;
+  mss = pkt->tso_segsz;
+
+  // Only TCP with all its headers in the first mbuf, and no IPv6 extension
+  // headers to go through
+  if ((ptype & RTE_PTYPE_L4_MASK) != RTE_PTYPE_L4_TCP || hdr_len > rte_pktmbuf_data_len(pkt) ||
+      (!RTE_ETH_IS_IPV4_HDR(ptype) && hdr_lens.l3_len != sizeof(rte_ipv6_hdr)))
+    return 0;
+  if (mss == 0 || hdr_len + mss + RTE_PKTMBUF_HEADROOM > (uint32_t)rte_pktmbuf_data_room_size(pkt->pool))
+    return 0;
+
+  if (*off == 0)
+    *off = hdr_len;
+  nb_segs = RTE_MIN(max_segs, (pkt_len - *off + mss - 1) / mss);
+  if (nb_segs == 0 || rte_pktmbuf_alloc_bulk(pkt->pool, segs, nb_segs) != 0)
+    return 0;
+
+  tcp = rte_pktmbuf_mtod_offset(pkt, const rte_tcp_hdr *, hdr_lens.l2_len + hdr_lens.l3_len);
+  seq = rte_be_to_cpu_32(tcp->sent_seq) + *off - hdr_len;
+  for (i = 0; i < nb_segs; i++) {
+    seg_len = RTE_MIN(mss, pkt_len - *off);
+    dst = rte_pktmbuf_append(segs[i], hdr_len + seg_len);
+    rte_memcpy(dst, rte_pktmbuf_mtod(pkt, const void *), hdr_len);
+    data = rte_pktmbuf_read(pkt, *off, seg_len, dst + hdr_len);
+    if (data != dst + hdr_len)
+      rte_memcpy(dst + hdr_len, data, seg_len);
+
+    // FIN and PSH go on the last segment, CWR on the first, as the kernel would
+    th = (rte_tcp_hdr *)(dst + hdr_lens.l2_len + hdr_lens.l3_len);
+    th->sent_seq = rte_cpu_to_be_32(seq);
+    if (*off + seg_len < pkt_len)
+      th->tcp_flags &= ~(RTE_TCP_FIN_FLAG | RTE_TCP_PSH_FLAG);
+    if (*off != hdr_len)
+      th->tcp_flags &= ~RTE_TCP_CWR_FLAG;
+    th->cksum = 0;
+
+    if (RTE_ETH_IS_IPV4_HDR(ptype)) {
+      ip4 = (rte_ipv4_hdr *)(dst + hdr_lens.l2_len);
+      ip4->total_length = rte_cpu_to_be_16(hdr_lens.l3_len + hdr_lens.l4_len + seg_len);
+      ip4->packet_id = rte_cpu_to_be_16(rte_be_to_cpu_16(ip4->packet_id) + (*off - hdr_len) / mss);
+      ip4->hdr_checksum = 0;
+      ip4->hdr_checksum = rte_ipv4_cksum(ip4);
+      th->cksum = rte_ipv4_udptcp_cksum(ip4, th);
+    } else {
+      ip6 = (rte_ipv6_hdr *)(dst + hdr_lens.l2_len);
+      ip6->payload_len = rte_cpu_to_be_16(hdr_lens.l4_len + seg_len);
+      th->cksum = rte_ipv6_udptcp_cksum(ip6, th);
+    }
+
+    segs[i]->port = pkt->port;
+    seq += seg_len;
+    *off += seg_len;
+  }
+
+  return nb_segs;
+}
+
+// Burst tx to rings, keeping flows together
+static void virtio_steer(kni_port_params *p, rte_ring *const *rx_rings, unsigned nb_rings,
+                         rte_mbuf **pkts, unsigned nb_pkts) {
+  unsigned nb_tx;
+
+  if (nb_pkts == 0)
+    return;
+
+  // Segments are new mbufs, so packets are stamped on their way out of here
+  if (unlikely(lat_enabled()))
+    lat_ingress(pkts, nb_pkts);
+
+  // Send what the model isn't to see straight to the NIC
+  if (bypass_enabled() && (nb_pkts = bypass_burst(pkts, nb_pkts, p->port_id, 1)) == 0)
+    return;
+
+  nb_tx = flow_steer_burst(rx_rings, nb_rings, pkts, nb_pkts);
+  if (nb_tx) get_kni_stats()[p->port_id].kni_tx_packets += nb_tx;
+
+  if (unlikely(nb_tx < nb_pkts)) {
+    // Free mbufs not tx to rings
+    kni_burst_free_mbufs(&pkts[nb_tx], nb_pkts - nb_tx);
+    get_kni_stats()[p->port_id].kni_tx_dropped += nb_pkts - nb_tx;
+  }
+}
+
+// Merge TCP segments out of the design back into super-frames for the kernel,
+// within the burst. Returns how many packets are left.
+static unsigned virtio_merge(rte_mbuf **pkts, unsigned nb_pkts) {
+  static const rte_gro_param param = {
+#ifdef RTE_GRO_TCP_IPV6
+    RTE_GRO_TCP_IPV4 | RTE_GRO_TCP_IPV6,
+#else
+    RTE_GRO_TCP_IPV4,
+#endif
+    PKT_BURST_SZ, PKT_BURST_SZ, 0};
+  rte_net_hdr_lens hdr_lens;
+  rte_ipv4_hdr *ip4;
+  rte_mbuf *pkt;
+  unsigned i;
+
+  for (i = 0; i < nb_pkts; i++) {
+    pkt = pkts[i];
+    pkt->packet_type = rte_net_get_ptype(pkt, &hdr_lens, RTE_PTYPE_ALL_MASK);
+    pkt->l2_len = hdr_lens.l2_len;
+    pkt->l3_len = hdr_lens.l3_len;
+    pkt->l4_len = hdr_lens.l4_len;
+  }
+
+  nb_pkts = rte_gro_reassemble_burst(pkts, nb_pkts, &param);
+
+  // The first segment of a merged packet keeps its headers and payload, so its
+  // payload is the MSS to cut it back up at
+  for (i = 0; i < nb_pkts; i++) {
+    pkt = pkts[i];
+    if (pkt->nb_segs == 1)
+      continue;
+
+    pkt->tso_segsz = rte_pktmbuf_data_len(pkt) - pkt->l2_len - pkt->l3_len - pkt->l4_len;
+    pkt->ol_flags |= RTE_MBUF_F_TX_TCP_SEG;
+    if (RTE_ETH_IS_IPV4_HDR(pkt->packet_type)) {
+      // GRO leaves the header checksum alone, and the kernel still checks it
+      ip4 = rte_pktmbuf_mtod_offset(pkt, rte_ipv4_hdr *, pkt->l2_len);
+      ip4->hdr_checksum = 0;
+      ip4->hdr_checksum = rte_ipv4_cksum(ip4);
+      pkt->ol_flags |= RTE_MBUF_F_TX_IPV4;
+    } else {
+      pkt->ol_flags |= RTE_MBUF_F_TX_IPV6;
+    }
+  }
+
+  return nb_pkts;
+}
+
+static uint16_t virtio_tx_burst(kni_port_params *p, uint16_t q, rte_mbuf **pkts, uint16_t nb_pkts) {
+  // Super-frames need the pseudo-header sum in their TCP checksum
+  if (p->host_tx_offloads & RTE_ETH_TX_OFFLOAD_TCP_TSO)
+    nb_pkts = rte_eth_tx_prepare(p->host_port_id, q, pkts, nb_pkts);
+
+  return rte_eth_tx_burst(p->host_port_id, q, pkts, nb_pkts);
+}
+
+int virtio_host_create(kni_port_params *p, host_backend backend, uint16_t nb_queues,
+                       uint64_t rx_offloads, uint64_t tx_offloads, rte_mempool *mp) {
+  char name[RTE_ETH_NAME_MAX_LEN], args[256], mac[RTE_ETHER_ADDR_FMT_SIZE];
+  uint16_t q, host_port, nb_rxd = HOST_RING_SZ, nb_txd = HOST_RING_SZ;
+  rte_eth_dev_info dev_info;
+  rte_eth_rxconf rxq_conf;
+  rte_eth_txconf txq_conf;
+  rte_eth_conf conf;
+  rte_ether_addr addr;
+  int ret = -1;
+
+  // The kernel sees the NIC's address, like it did with KNI
+  if (rte_eth_macaddr_get(p->port_id, &addr) != 0)
+    return -1;
+  rte_ether_format_addr(mac, sizeof(mac), &addr);
+
+  if (backend == HOST_BACKEND_VIRTIO) {
+    snprintf(name, sizeof(name), "virtio_user%u", p->port_id);
+    snprintf(args, sizeof(args), "path=/dev/vhost-net,queues=%u,queue_size=%u,iface=vEth%u,mac=%s",
+             nb_queues, HOST_RING_SZ, p->port_id, mac);
+    ret = rte_vdev_init(name, args);
+    if (ret != 0)
+      RTE_LOG(WARNING, APP, "Could not create %s (%d), falling back to TAP\n", name, ret);
+  }
+  if (ret != 0) {
+    // TAP would only check checksums and cut up super-frames in software
+    rx_offloads &= ~(RTE_ETH_RX_OFFLOAD_TCP_CKSUM | RTE_ETH_RX_OFFLOAD_UDP_CKSUM |
+                     RTE_ETH_RX_OFFLOAD_TCP_LRO);
+    tx_offloads &= ~(RTE_ETH_TX_OFFLOAD_TCP_TSO | RTE_ETH_TX_OFFLOAD_TCP_CKSUM);
+    snprintf(name, sizeof(name), "net_tap%u", p->port_id);
+    snprintf(args, sizeof(args), "iface=vEth%u,mac=%s", p->port_id, mac);
+    ret = rte_vdev_init(name, args);
+    if (ret != 0) {
+      RTE_LOG(ERR, APP, "Could not create %s (%d)\n", name, ret);
+      return ret;
+    }
+  }
+
+  ret = rte_eth_dev_get_port_by_name(name, &host_port);
+  if (ret != 0)
+    goto fail;
+
+  ret = rte_eth_dev_info_get(host_port, &dev_info);
+  if (ret != 0)
+    goto fail;
+  if (nb_queues > dev_info.max_rx_queues || nb_queues > dev_info.max_tx_queues) {
+    RTE_LOG(ERR, APP, "%s has at most %u RX and %u TX queues\n", name,
+            dev_info.max_rx_queues, dev_info.max_tx_queues);
+    ret = -EINVAL;
+    goto fail;
+  }
+
+  // Only ask for the offloads it can do. For virtio-user these become the
+  // features negotiated with vhost-net.
+  memset(&conf, 0, sizeof(conf));
+  conf.rxmode.offloads = rx_offloads & dev_info.rx_offload_capa;
+  conf.txmode.offloads = tx_offloads & dev_info.tx_offload_capa;
+  ret = rte_eth_dev_configure(host_port, nb_queues, nb_queues, &conf);
+  if (ret < 0)
+    goto fail;
+
+  ret = rte_eth_dev_adjust_nb_rx_tx_desc(host_port, &nb_rxd, &nb_txd);
+  if (ret < 0)
+    goto fail;
+
+  rxq_conf = dev_info.default_rxconf;
+  rxq_conf.offloads = conf.rxmode.offloads;
+  txq_conf = dev_info.default_txconf;
+  txq_conf.offloads = conf.txmode.offloads;
+  for (q = 0; q < nb_queues; q++) {
+    ret = rte_eth_rx_queue_setup(host_port, q, nb_rxd, rte_eth_dev_socket_id(host_port), &rxq_conf, mp);
+    if (ret < 0)
+      goto fail;
+    ret = rte_eth_tx_queue_setup(host_port, q, nb_txd, rte_eth_dev_socket_id(host_port), &txq_conf);
+    if (ret < 0)
+      goto fail;
+  }
+
+  ret = rte_eth_dev_start(host_port);
+  if (ret < 0)
+    goto fail;
+
+  p->host_port_id = host_port;
+  p->nb_host_queues = nb_queues;
+  p->host_rx_offloads = conf.rxmode.offloads;
+  p->host_tx_offloads = conf.txmode.offloads;
+  p->host_link_up = 1;
+  // eth_ingress and eth_egress go around once for each host interface
+  p->nb_kni = 1;
+
+  RTE_LOG(INFO, APP, "Port %u goes to the host through %s as vEth%u, %u queues, "
+          "RX offloads 0x%" PRIx64 ", TX offloads 0x%" PRIx64 "\n", p->port_id, name,
+          p->port_id, nb_queues, p->host_rx_offloads, p->host_tx_offloads);
+
+  return 0;
+
+fail:
+  RTE_LOG(ERR, APP, "Could not set up %s (%d)\n", name, ret);
+  rte_vdev_uninit(name);
+
+  return ret;
+}
+
+void virtio_host_free(kni_port_params *p) {
+  char name[RTE_ETH_NAME_MAX_LEN];
+
+  if (p == NULL || p->nb_host_queues == 0)
+    return;
+
+  if (rte_eth_dev_get_name_by_port(p->host_port_id, name) != 0)
+    return;
+  rte_eth_dev_stop(p->host_port_id);
+  rte_eth_dev_close(p->host_port_id);
+  rte_vdev_uninit(name);
+  p->nb_host_queues = 0;
+}
+
+void virtio_host_update_link(kni_port_params *p, int link_up) {
+  int ret;
+
+  if (p == NULL || p->nb_host_queues == 0 || link_up == p->host_link_up)
+    return;
+
+  ret = link_up ? rte_eth_dev_set_link_up(p->host_port_id) : rte_eth_dev_set_link_down(p->host_port_id);
+  if (ret == 0)
+    RTE_LOG(INFO, APP, "vEth%u NIC Link is %s\n", p->port_id, link_up ? "Up" : "Down");
+  p->host_link_up = link_up;
+}
+
+// Push mbufs from the host queues into rings
+unsigned virtio_ingress(kni_port_params *p, rte_ring *const *rx_rings, unsigned nb_rings) {
+  uint16_t q;
+  uint32_t off;
+  unsigned i, nb_rx, nb_out, nb_segs, nb_pkts = 0;
+  rte_mbuf *pkts_burst[PKT_BURST_SZ], *out[FLOW_STEER_MAX_BURST], *pkt;
+
+  if (p == NULL)
+    return 0;
+
+  for (q = 0; q < p->nb_host_queues; q++) {
+    // Burst rx from the host
+    nb_rx = rte_eth_rx_burst(p->host_port_id, q, pkts_burst, PKT_BURST_SZ);
+    if (nb_rx == 0)
+      continue;
+    cycle_stats_packets(nb_rx);
+    nb_pkts += nb_rx;
+
+    nb_out = 0;
+    for (i = 0; i < nb_rx; i++) {
+      pkt = pkts_burst[i];
+      if (nb_out == FLOW_STEER_MAX_BURST) {
+        virtio_steer(p, rx_rings, nb_rings, out, nb_out);
+        nb_out = 0;
+      }
+
+      if (likely(!(pkt->ol_flags & RTE_MBUF_F_RX_LRO))) {
+        // The design has to see whole checksums
+        if (p->host_rx_offloads & (RTE_ETH_RX_OFFLOAD_TCP_CKSUM | RTE_ETH_RX_OFFLOAD_UDP_CKSUM))
+          virtio_finish_cksum(pkt);
+        out[nb_out++] = pkt;
+        continue;
+      }
+
+      // Segments go out in order, a burst's worth at a time
+      off = 0;
+      while (off < rte_pktmbuf_pkt_len(pkt)) {
+        if (nb_out == FLOW_STEER_MAX_BURST) {
+          virtio_steer(p, rx_rings, nb_rings, out, nb_out);
+          nb_out = 0;
+        }
+
+        nb_segs = virtio_segment(pkt, &off, &out[nb_out], FLOW_STEER_MAX_BURST - nb_out);
+        if (unlikely(nb_segs == 0)) {
+          get_kni_stats()[p->port_id].kni_tx_dropped++;
+          break;
+        }
+        nb_out += nb_segs;
+      }
+      rte_pktmbuf_free(pkt);
+    }
+
+    virtio_steer(p, rx_rings, nb_rings, out, nb_out);
+  }
+
+  return nb_pkts;
+}
+
+// Push mbufs from ring into the host queues
+unsigned virtio_egress(kni_port_params *p, rte_ring *tx_ring) {
+  rte_mbuf *bins[HOST_MAX_QUEUES][PKT_BURST_SZ];
+  unsigned nb_bin[HOST_MAX_QUEUES] = {0};
+  uint16_t q, port_id;
+  unsigned i, nb_rx, nb_tx = 0, sent;
+  rte_mbuf *pkts_burst[PKT_BURST_SZ];
+
+  if (p == NULL)
+    return 0;
+
+  port_id = p->port_id;
+  // Burst rx from tx_ring
+  nb_rx = rte_ring_dequeue_burst(tx_ring, (void **)pkts_burst, PKT_BURST_SZ, nullptr);
+  if (nb_rx == 0)
+    return 0;
+  cycle_stats_packets(nb_rx);
+
+  // Before merging, while each packet out of the model is on its own
+  if (unlikely(lat_enabled()))
+    lat_egress(pkts_burst, nb_rx, port_id, 1);
+
+  if (p->host_tx_offloads & RTE_ETH_TX_OFFLOAD_TCP_TSO)
+    nb_rx = virtio_merge(pkts_burst, nb_rx);
+
+  if (p->nb_host_queues == 1) {
+    nb_tx = virtio_tx_burst(p, 0, pkts_burst, nb_rx);
+    if (unlikely(nb_tx < nb_rx))
+      kni_burst_free_mbufs(&pkts_burst[nb_tx], nb_rx - nb_tx);
+  } else {
+    // Keep each flow on one queue, so the kernel sees it in order
+    for (i = 0; i < nb_rx; i++) {
+      q = flow_hash(pkts_burst[i]) % p->nb_host_queues;
+      bins[q][nb_bin[q]++] = pkts_burst[i];
+    }
+
+    for (q = 0; q < p->nb_host_queues; q++) {
+      if (nb_bin[q] == 0)
+        continue;
+
+      sent = virtio_tx_burst(p, q, bins[q], nb_bin[q]);
+      nb_tx += sent;
+      if (unlikely(sent < nb_bin[q]))
+        kni_burst_free_mbufs(&bins[q][sent], nb_bin[q] - sent);
+    }
+  }
+
+  if (nb_tx) get_kni_stats()[port_id].kni_rx_packets += nb_tx;
+  if (unlikely(nb_tx < nb_rx))
+    get_kni_stats()[port_id].kni_rx_dropped += nb_rx - nb_tx;
+
+  return nb_rx;
+}
@@ -0,0 +1,36 @@
+#ifndef FESTOON_VIRTIO_H
+#define FESTOON_VIRTIO_H
+
+#include <rte_mempool.h>
+#include <rte_ring.h>
+
+#include "festoon_common.h"
+
+// What the host side of each port goes through
+enum host_backend {
+  HOST_BACKEND_KNI,     // rte_kni, needs the out-of-tree rte_kni module
+  HOST_BACKEND_VIRTIO,  // virtio-user over vhost-net, or TAP if that's not there
+  HOST_BACKEND_TAP      // net_tap
+};
+
+// Create the host interface of a port with nb_queues queue pairs, and start
+// it. Offloads it can't do are left out of rx_offloads and tx_offloads.
+int virtio_host_create(kni_port_params *p, host_backend backend, uint16_t nb_queues,
+                       uint64_t rx_offloads, uint64_t tx_offloads, rte_mempool *mp);
+
+void virtio_host_free(kni_port_params *p);
+
+// Bring the host interface up or down with the NIC's link
+void virtio_host_update_link(kni_port_params *p, int link_up);
+
+// Rings are picked by flow_hash when there is more than one. TCP super-frames
+// from the kernel are cut back into segments of its MSS first. Returns the
+// number of packets read from the host.
+unsigned virtio_ingress(kni_port_params *p, rte_ring *const *rx_rings, unsigned nb_rings);
+
+// Queues are picked by flow_hash when there is more than one. With TSO, TCP
+// segments in the same burst are merged into super-frames first. Returns the
+// number of packets sent on, after merging.
+unsigned virtio_egress(kni_port_params *p, rte_ring *tx_ring);
+
+#endif
@@ -1,163 +1,782 @@
 #include <cstdint>
 #include <rte_byteorder.h>
+#include <rte_cpuflags.h>
+#include <rte_cycles.h>
 #include <rte_errno.h>
 #include <rte_malloc.h>
 #include <rte_mbuf.h>
+#include <rte_pause.h>
+#include <rte_vect.h>
 
 #include "festoon_common.h"
+#include "festoon_split.h"
 #include "festoon_xgmii.h"
 
 using namespace std;
 
+// Idle bytes to send after a /T/ that leaves the beat at lane pos, so that the
+// next /S/ lands on lane 0 or 4. The deficit idle count lets the gap shrink by
+// up to 3 bytes as long as it's made up for later, keeping a 12 byte average.
+static inline uint8_t xgmii_enc_ifg(xgmii_encoder *enc, unsigned pos) {
+  unsigned next = pos + XGMII_IPG - 1, extra = next % 4;
+
+  if (extra != 0) {
+    if (enc->dic + extra <= 3) {
+      next -= extra;
+      enc->dic += extra;
+    } else {
+      next += 4 - extra;
+      enc->dic = enc->dic > 4 - extra ? enc->dic - (4 - extra) : 0;
+    }
+  }
+
+  return next - pos;
+}
+
+void xgmii_encode_beat_dense(xgmii_encoder *enc, xgmii_beat *beat) {
+  uint8_t *lanes = (uint8_t *)&beat->data;
+  unsigned lane = 0, n;
+
+  beat->ctrl = 0b00000000;
+
+  while (lane < sizeof(QData)) {
+    switch (enc->state) {
+    case XGMII_ENC_IFG:
+      // Finish the inter-packet gap, or idle out the beat if there's no packet
+      n = enc->pkt == nullptr ? sizeof(QData) - lane : RTE_MIN(enc->ifg, sizeof(QData) - lane);
+      memset(&lanes[lane], XGMII_IDLE, n);
+      beat->ctrl |= ((1 << n) - 1) << lane;
+      enc->ifg -= RTE_MIN(n, (unsigned)enc->ifg);
+      lane += n;
+      if (enc->ifg == 0 && enc->pkt != nullptr)
+        enc->state = XGMII_ENC_START;
+      break;
+
+    case XGMII_ENC_START:
+      lanes[lane] = XGMII_START;
+      beat->ctrl |= 1 << lane;
+      lane++;
+      enc->pre = 1;
+      enc->state = XGMII_ENC_PREAMBLE;
+      break;
+
+    case XGMII_ENC_PREAMBLE:
+      // Six preamble bytes and the SFD, possibly split over two beats
+      for (; lane < sizeof(QData) && enc->pre < 8; lane++, enc->pre++)
+        lanes[lane] = enc->pre == 7 ? 0xd5 : 0x55;
+      if (enc->pre == 8)
+        enc->state = XGMII_ENC_DATA;
+      break;
+
+    case XGMII_ENC_DATA:
+      n = RTE_MIN(sizeof(QData) - lane, rte_pktmbuf_pkt_len(enc->pkt) - enc->off);
+      rte_memcpy(&lanes[lane], rte_pktmbuf_mtod_offset(enc->pkt, void *, enc->off), n);
+      enc->off += n;
+      lane += n;
+      if (enc->off == rte_pktmbuf_pkt_len(enc->pkt))
+        enc->state = XGMII_ENC_TERM;
+      break;
+
+    default:
+      // /T/ goes right after the last data byte, and the gap starts after it
+      lanes[lane] = XGMII_TERM;
+      beat->ctrl |= 1 << lane;
+      lane++;
+      enc->ifg = xgmii_enc_ifg(enc, lane);
+      enc->state = XGMII_ENC_IFG;
+      if (unlikely(lat_enabled()))
+        lat_encoded(enc->pkt, enc->port_id, enc->tid, enc->clock);
+      rte_pktmbuf_free(enc->pkt);
+      enc->pkt = nullptr;
+      break;
+    }
+  }
+}
+
 // Convert mbuf to xgmii
-void mbuf_to_xgmii(rte_ring *mbuf_rx_ring, rte_ring *xgmii_tx_ring, rte_mempool *tx_mempool, uint8_t tid) {
-  rte_mbuf *pkts_burst[PKT_BURST_SZ] __rte_cache_aligned,
-           *xgm_buf[XGMII_BURST_SZ] __rte_cache_aligned;
-  uint8_t i, data_size;
-  uint16_t it, port_id = 0;
-  uint64_t nb_tx = 0, nb_rx = 0, xgm_buf_counter = 0, frames_per_pkt;
+unsigned mbuf_to_xgmii(xgmii_encoder *enc, rte_ring *mbuf_rx_ring, rte_ring *xgmii_tx_ring) {
+  rte_mbuf *pkts_burst[PKT_BURST_SZ] __rte_cache_aligned;
+  xgmii_beat xgm_buf[XGMII_PKT_BEATS] __rte_cache_aligned;
+  xgmii_encoder saved;
+  uint8_t i;
+  uint16_t port_id = enc->port_id;
+  uint64_t nb_rx = 0, nb_beats, beats_tx = 0, beats_dropped = 0, nb_rejected = 0;
+  unsigned nb_room;
+
+  // Packets are freed as they're encoded, so only take as many as are sure to
+  // fit in xgmii_tx_ring. The rest wait on mbuf_rx_ring for the next call.
+  nb_room = RTE_MIN(rte_ring_free_count(xgmii_tx_ring) / XGMII_PKT_BEATS, (unsigned)PKT_BURST_SZ);
+  if (nb_room == 0)
+    return 0;
 
   // Burst RX from ring
-  nb_rx = rte_ring_dequeue_burst(mbuf_rx_ring, (void **)pkts_burst, PKT_BURST_SZ, nullptr);
+  nb_rx = rte_ring_dequeue_burst(mbuf_rx_ring, (void **)pkts_burst, nb_room, nullptr);
   if (unlikely(nb_rx > PKT_BURST_SZ)) {
     RTE_LOG(ERR, APP, "Error receiving from mbuf\n");
-    return;
+    return 0;
   }
 
   if(unlikely(nb_rx <= 0))
-    return;
+    return 0;
 
-  // Alloc mbufs for packets
-  if (rte_pktmbuf_alloc_bulk(tx_mempool, xgm_buf, XGMII_BURST_SZ) != 0) {
-    RTE_LOG(ERR, APP, "Error allocing xgmii mbufs\n");
-    return;
-  }
+  if (unlikely(lat_enabled()))
+    lat_dequeued(pkts_burst, nb_rx, port_id, enc->tid);
 
-  // Create rte_mbuf packets from XGMII packets
+  // Create XGMII beats from rte_mbuf packets
   for (i = 0; i < nb_rx; i++) {
     if (unlikely(pkts_burst[i] == nullptr))
       continue;
-    if (unlikely(rte_pktmbuf_pkt_len(pkts_burst[i]) == 0))
+    if (unlikely(rte_pktmbuf_pkt_len(pkts_burst[i]) == 0)) {
+      rte_pktmbuf_free(pkts_burst[i]);
+      continue;
+    }
+    if (split_enabled())
+      pkts_burst[i] = split_header(pkts_burst[i], port_id, enc->tid);
+    if (unlikely(pkts_burst[i] == nullptr || !xgmii_encodable(pkts_burst[i]))) {
+      rte_pktmbuf_free(pkts_burst[i]);
+      nb_rejected++;
       continue;
+    }
+
+    // Encode the packet, which also frees it. With a 12 byte gap, a packet's
+    // /T/ never shares a beat with the next /S/, so each packet's beats stand
+    // on their own.
+    saved = *enc;
+    xgmii_encoder_load(enc, pkts_burst[i]);
+    for (nb_beats = 0; enc->pkt != nullptr; nb_beats++)
+      xgmii_encode_beat(enc, &xgm_buf[nb_beats]);
 
-    frames_per_pkt = (rte_pktmbuf_pkt_len(pkts_burst[i]) - 1) / sizeof(QData) + 1;
-
-    // Send packet begin control bits
-    *rte_pktmbuf_mtod(xgm_buf[xgm_buf_counter], CData *) = 0b00000001;
-    *rte_pktmbuf_mtod_offset(xgm_buf[xgm_buf_counter], QData *, sizeof(CData)) = 0xd5555555555555fb;
-    xgm_buf_counter++;
-
-    // Go through packet and move every 64 bits to XGM data buffer
-    for (it = 0; it < frames_per_pkt; it += 1) {
-      // Check for remaining packet size < 64 bits
-      if (unlikely(rte_pktmbuf_pkt_len(pkts_burst[i]) < (frames_per_pkt * sizeof(QData)))) {
-        int frame_size = rte_pktmbuf_pkt_len(pkts_burst[i]) % sizeof(QData);
-        rte_memcpy(rte_pktmbuf_mtod_offset(xgm_buf[xgm_buf_counter], void *, 1),
-                   rte_pktmbuf_mtod_offset(pkts_burst[i], void *, it * sizeof(QData)),
-                   frame_size);
-        *rte_pktmbuf_mtod(xgm_buf[xgm_buf_counter], CData *) = ~((1 << frame_size) - 1);
-      } else {
-        rte_mov64(rte_pktmbuf_mtod_offset(xgm_buf[xgm_buf_counter], uint8_t *, 1),
-                  rte_pktmbuf_mtod_offset(pkts_burst[i], uint8_t *, it * sizeof(QData)));
-        *rte_pktmbuf_mtod(xgm_buf[xgm_buf_counter], CData *) = 0b00000000;
-      }
-
-      xgm_buf_counter++;
+    // Pass the whole packet to xgmii_tx_ring, or none of it
+    if (likely(rte_ring_enqueue_bulk_elem(xgmii_tx_ring, xgm_buf, sizeof(xgmii_beat),
+                                          nb_beats, nullptr) == nb_beats)) {
+      beats_tx += nb_beats;
+    } else {
+      beats_dropped += nb_beats;
+      *enc = saved;
     }
+  }
+
+  cycle_stats_packets(nb_rx);
+  cycle_stats_beats(beats_tx + beats_dropped);
+  if (beats_tx) get_kni_stats()[port_id].xgmii_rx_packets[enc->tid] += beats_tx;
+  if (unlikely(beats_dropped)) get_kni_stats()[port_id].xgmii_rx_dropped[enc->tid] += beats_dropped;
+  if (unlikely(nb_rejected)) get_kni_stats()[port_id].xgmii_rx_rejected[enc->tid] += nb_rejected;
+
+  return nb_rx;
+}
+
+xgmii_block_encoder *xgmii_block_encoder_create(xgmii_group *grp, uint16_t port_id, uint8_t tid,
+                                                xgmii_encoder_mode mode) {
+  xgmii_block_encoder *benc;
+
+  benc = (xgmii_block_encoder *)rte_zmalloc("xgmii_block_encoder", sizeof(*benc),
+                                            RTE_CACHE_LINE_SIZE);
+  if (benc == nullptr)
+    return nullptr;
+
+  xgmii_encoder_init(&benc->enc, port_id, tid, mode);
+  benc->group = grp;
+  return benc;
+}
+
+void xgmii_block_encoder_free(xgmii_block_encoder *benc) {
+  rte_free(benc);
+}
+
+unsigned mbuf_to_xgmii_ordered(xgmii_block_encoder *benc, rte_ring *mbuf_rx_ring,
+                               rte_ring *xgmii_tx_ring) {
+  rte_mbuf *pkts_burst[PKT_BURST_SZ] __rte_cache_aligned;
+  xgmii_group *grp = benc->group;
+  xgmii_encoder *enc = &benc->enc;
+  uint16_t port_id = enc->port_id;
+  unsigned i, nb_rx, nb_room, nb_pkts = 0, nb_beats = 0, start = 0, nb_rejected = 0;
+  uint64_t beats_tx;
+  uint32_t ticket, reserved;
+
+  if (rte_ring_empty(mbuf_rx_ring))
+    return 0;
 
-    // Packet end control bits
-    *rte_pktmbuf_mtod(xgm_buf[xgm_buf_counter], CData *) = 0b11111111;
-    *rte_pktmbuf_mtod_offset(xgm_buf[xgm_buf_counter], QData *, sizeof(CData)) = 0x07070707070707fd;
-    xgm_buf_counter++;
+  // Take the burst and its ticket together, so tickets follow the ring. Like
+  // mbuf_to_xgmii, only take as many packets as are sure to fit in
+  // xgmii_tx_ring, less the room held for blocks not yet queued.
+  rte_spinlock_lock(&grp->lock);
+  reserved = __atomic_load_n(&grp->reserved, __ATOMIC_ACQUIRE);
+  nb_room = rte_ring_free_count(xgmii_tx_ring);
+  nb_room = nb_room > reserved ? (nb_room - reserved) / XGMII_PKT_BEATS : 0;
+  nb_rx = rte_ring_dequeue_burst(mbuf_rx_ring, (void **)pkts_burst,
+                                 RTE_MIN(nb_room, (unsigned)PKT_BURST_SZ), nullptr);
+  ticket = grp->next_ticket;
+  if (nb_rx) {
+    grp->next_ticket++;
+    __atomic_fetch_add(&grp->reserved, nb_rx * XGMII_PKT_BEATS, __ATOMIC_RELAXED);
   }
+  rte_spinlock_unlock(&grp->lock);
 
-  // Pass DPDK packets to xgmii_rx_queue
-  nb_tx = rte_ring_enqueue_burst(xgmii_tx_ring, (void **)xgm_buf, xgm_buf_counter, nullptr);
+  if (nb_rx == 0)
+    return 0;
 
-  // Free input pkts
-  kni_burst_free_mbufs(&pkts_burst[0], nb_rx);
+  if (unlikely(lat_enabled()))
+    lat_dequeued(pkts_burst, nb_rx, port_id, enc->tid);
 
-  if (nb_tx) get_kni_stats()[port_id].xgmii_rx_packets[tid] += nb_tx;
+  // Encode the whole burst into the block, which frees the packets
+  xgmii_encoder_restart(enc);
+  for (i = 0; i < nb_rx; i++) {
+    if (unlikely(pkts_burst[i] == nullptr))
+      continue;
+    if (unlikely(rte_pktmbuf_pkt_len(pkts_burst[i]) == 0)) {
+      rte_pktmbuf_free(pkts_burst[i]);
+      continue;
+    }
+    if (split_enabled())
+      pkts_burst[i] = split_header(pkts_burst[i], port_id, enc->tid);
+    if (unlikely(pkts_burst[i] == nullptr || !xgmii_encodable(pkts_burst[i]))) {
+      rte_pktmbuf_free(pkts_burst[i]);
+      nb_rejected++;
+      continue;
+    }
+
+    xgmii_encoder_load(enc, pkts_burst[i]);
+    while (enc->pkt != nullptr)
+      xgmii_encode_beat(enc, &benc->beats[nb_beats++]);
+    benc->ends[nb_pkts++] = nb_beats;
+  }
 
-  // Free mbufs not tx to xgmii_rx_queue
-  if (unlikely(nb_tx < XGMII_BURST_SZ)) {
-    kni_burst_free_mbufs(&xgm_buf[nb_tx], XGMII_BURST_SZ - nb_tx);
-    get_kni_stats()[port_id].xgmii_rx_dropped[tid] += xgm_buf_counter - nb_tx;
+  // Wait for the blocks taken before this one
+  while (__atomic_load_n(&grp->next_commit, __ATOMIC_ACQUIRE) != ticket)
+    rte_pause();
+
+  // Pass whole packets to xgmii_tx_ring. The gap before each packet was
+  // worked out from the one before it, so the rest of the block goes with the
+  // first one that doesn't fit.
+  for (i = 0; i < nb_pkts; start = benc->ends[i++]) {
+    if (rte_ring_enqueue_bulk_elem(xgmii_tx_ring, &benc->beats[start], sizeof(xgmii_beat),
+                                   benc->ends[i] - start, nullptr) == 0)
+      break;
   }
+  __atomic_fetch_sub(&grp->reserved, nb_rx * XGMII_PKT_BEATS, __ATOMIC_RELEASE);
+  __atomic_store_n(&grp->next_commit, ticket + 1, __ATOMIC_RELEASE);
+  beats_tx = start;
+
+  cycle_stats_packets(nb_rx);
+  cycle_stats_beats(nb_beats);
+  if (beats_tx) get_kni_stats()[port_id].xgmii_rx_packets[enc->tid] += beats_tx;
+  if (unlikely(beats_tx < nb_beats))
+    get_kni_stats()[port_id].xgmii_rx_dropped[enc->tid] += nb_beats - beats_tx;
+  if (unlikely(nb_rejected)) get_kni_stats()[port_id].xgmii_rx_rejected[enc->tid] += nb_rejected;
+
+  return nb_rx;
 }
 
-void xgmii_to_mbuf(rte_ring *xgmii_rx_ring, rte_ring *mbuf_tx_ring, rte_mempool *tx_mempool, uint8_t tid) {
-  bool pkt_start_entered = false;
-  uint8_t i, it;
-  uint16_t port_id = 0;
-  uint32_t nb_kni;
-  uint64_t nb_tx = 0, pkt_buf_counter = 0, rte_pkt_index = 0;
-  rte_mbuf *pkts_burst[PKT_BURST_SZ] __rte_cache_aligned,
-           *xgm_buf[1] __rte_cache_aligned;
+// Decoder kernel, picked by xgmii_init()
+typedef void (*xgmii_decode_fn)(xgmii_decoder *dec, const xgmii_beat *beats, unsigned nb_beats);
 
-  // Alloc mbufs for packets
-  if (rte_pktmbuf_alloc_bulk(tx_mempool, pkts_burst, PKT_BURST_SZ) != 0) {
-    RTE_LOG(ERR, APP, "Error allocing pkt mbufs\n");
+// Handle a /S/ character
+static inline void xgmii_dec_start(xgmii_decoder *dec) {
+  if (unlikely(dec->in_pkt)) {
+    RTE_LOG(ERR, APP, "Multiple packet start signals detected\n");
     return;
   }
 
-  while (pkt_buf_counter < PKT_BURST_SZ) {
-    // Burst rx from kni
-    if (unlikely(rte_ring_dequeue(xgmii_rx_ring, (void **) xgm_buf) < 0))
-      continue;
+  dec->in_pkt = true;
+  dec->preamble = 7;
+  dec->pkt_len = 0;
+  dec->pkt = rte_pktmbuf_alloc(dec->mp);
+  if (likely(dec->pkt != nullptr))
+    dec->pkt_data = rte_pktmbuf_mtod(dec->pkt, uint8_t *);
+  else
+    dec->nb_dropped++;
+}
+
+// Handle a /T/ character
+static inline void xgmii_dec_term(xgmii_decoder *dec) {
+  if (unlikely(!dec->in_pkt)) {
+    RTE_LOG(ERR, APP, "Multiple end of packet signals detected\n");
+    return;
+  }
+
+  dec->in_pkt = false;
+  if (unlikely(dec->pkt == nullptr))
+    return;
+
+  // A design under test can end any number of packets in a beat, so runts
+  // and packets past the end of done are dropped
+  if (unlikely(dec->pkt_len < KNI_ENET_HEADER_SIZE || dec->nb_done == RTE_DIM(dec->done))) {
+    rte_pktmbuf_free(dec->pkt);
+    dec->pkt = nullptr;
+    dec->nb_dropped++;
+    return;
+  }
+
+  dec->pkt->data_len = dec->pkt_len;
+  dec->pkt->pkt_len = dec->pkt_len;
+  if (unlikely(lat_enabled()))
+    lat_decoded(dec->pkt, dec->port_id, dec->tid, dec->clock);
+  dec->done[dec->nb_done++] = dec->pkt;
+  dec->pkt = nullptr;
+}
+
+// Append a run of data lanes to the current packet
+static inline void xgmii_dec_data(xgmii_decoder *dec, const uint8_t *src, unsigned len) {
+  unsigned skip;
+
+  if (dec->pkt == nullptr)
+    return;
+
+  // The first data lanes after /S/ are preamble and SFD
+  if (unlikely(dec->preamble)) {
+    skip = RTE_MIN(len, (unsigned)dec->preamble);
+    dec->preamble -= skip;
+    src += skip;
+    len -= skip;
+  }
+
+  if (unlikely(dec->pkt_len + len > MAX_PACKET_SZ)) {
+    RTE_LOG(ERR, APP, "XGMII frame longer than %u bytes\n", MAX_PACKET_SZ);
+    rte_pktmbuf_free(dec->pkt);
+    dec->pkt = nullptr;
+    dec->nb_dropped++;
+    return;
+  }
+
+  rte_memcpy(dec->pkt_data + dec->pkt_len, src, len);
+  dec->pkt_len += len;
+}
+
+// Whether a run of len data bytes can be stored straight into the packet
+static inline bool xgmii_dec_fast(const xgmii_decoder *dec, unsigned len) {
+  return dec->pkt != nullptr && dec->preamble == 0 && dec->pkt_len + len <= MAX_PACKET_SZ;
+}
 
-    // Loop through each byte of data
-    for (it = 1; it <= sizeof(QData); it++) {
-      // Check control bit for data
-      if (likely((*rte_pktmbuf_mtod(xgm_buf[0], CData *) & (1 << (it - 1))) == 0)) {
-        // Is data, just move over
-        if (pkt_start_entered) {
-          rte_memcpy(rte_pktmbuf_mtod_offset(pkts_burst[pkt_buf_counter], void *, rte_pkt_index),
-                     rte_pktmbuf_mtod_offset(xgm_buf[0], void *, it),
-                     sizeof(CData));
-          rte_pkt_index += 1;
-        }
-      } else {
-        // Control bit, check which one it is
-        if (*rte_pktmbuf_mtod_offset(xgm_buf[0], CData *, it) == 0xfb) {
-          // packet start, switch to next packet buffer
-          if (unlikely(pkt_start_entered)) {
-            RTE_LOG(ERR, APP, "Multiple packet start signals detected\n");
-          } else {
-            pkt_start_entered = true;
-            rte_pkt_index = 0;
-          }
-        } else if (*rte_pktmbuf_mtod_offset(xgm_buf[0], CData *, it) == 0xfd) {
-          // end of packet, reset indexing
-          if (unlikely(!pkt_start_entered)) {
-            RTE_LOG(ERR, APP, "Multiple end of packet signals detected\n");
-          } else {
-            pkt_start_entered = false;
-            pkt_buf_counter++;
-          }
-        } else if (*rte_pktmbuf_mtod_offset(xgm_buf[0], CData *, it) == 0x07) {
-          // Idle bit, just ignore
-          continue;
-        } else {
-          // Some other operation, ignore
-          continue;
-        }
-      }
+// Decode a beat containing control lanes. start and term hold one bit per lane
+// that carries /S/ or /T/; everything between them is copied as whole runs.
+static inline void xgmii_dec_ctrl_beat(xgmii_decoder *dec, const xgmii_beat *beat,
+                                       uint8_t start, uint8_t term) {
+  const uint8_t *lanes = (const uint8_t *)&beat->data;
+  unsigned lane = 0, next, run;
+  uint8_t events = start | term, seg;
+
+  while (1) {
+    next = events ? __builtin_ctz(events) : sizeof(QData);
+
+    // Data lanes between the last event and the next one
+    seg = (uint8_t)(((1u << next) - 1) & ~((1u << lane) - 1) & ~beat->ctrl);
+    while (seg) {
+      lane = __builtin_ctz(seg);
+      run = __builtin_ctz((uint8_t)~(seg >> lane) | 0x100);
+      xgmii_dec_data(dec, &lanes[lane], run);
+      seg &= ~(((1u << run) - 1) << lane);
     }
 
-    // Free input frames
-    kni_burst_free_mbufs(&xgm_buf[0], 1);
+    if (next == sizeof(QData))
+      return;
+
+    if (start & (1 << next))
+      xgmii_dec_start(dec);
+    else
+      xgmii_dec_term(dec);
+
+    events &= events - 1;
+    lane = next + 1;
+  }
+}
+
+// Decode one beat, comparing lanes one at a time
+static inline void xgmii_dec_beat_scalar(xgmii_decoder *dec, const xgmii_beat *beat) {
+  const uint8_t *lanes = (const uint8_t *)&beat->data;
+  uint8_t start = 0, term = 0;
+  unsigned it;
+
+  if (likely(beat->ctrl == 0)) {
+    xgmii_dec_data(dec, lanes, sizeof(QData));
+    return;
+  }
+
+  for (it = 0; it < sizeof(QData); it++) {
+    if (!(beat->ctrl & (1 << it)))
+      continue;
+    if (lanes[it] == XGMII_START)
+      start |= 1 << it;
+    else if (lanes[it] == XGMII_TERM)
+      term |= 1 << it;
+  }
+
+  xgmii_dec_ctrl_beat(dec, beat, start, term);
+}
+
+static void xgmii_decode_scalar(xgmii_decoder *dec, const xgmii_beat *beats, unsigned nb_beats) {
+  unsigned i;
+
+  for (i = 0; i < nb_beats; i++)
+    xgmii_dec_beat_scalar(dec, &beats[i]);
+}
+
+#ifdef RTE_ARCH_X86
+// Decode two beats, finding control characters with compare + movemask
+static inline void xgmii_dec_2beats_sse(xgmii_decoder *dec, const xgmii_beat *beats) {
+  __m128i b0 = _mm_loadu_si128((const __m128i *)&beats[0]);
+  __m128i b1 = _mm_loadu_si128((const __m128i *)&beats[1]);
+  __m128i data = _mm_unpacklo_epi64(b0, b1);
+  unsigned start, term;
+
+  // Both beats are all data, copy 16 bytes at once
+  if (likely((beats[0].ctrl | beats[1].ctrl) == 0) && xgmii_dec_fast(dec, 2 * sizeof(QData))) {
+    _mm_storeu_si128((__m128i *)(dec->pkt_data + dec->pkt_len), data);
+    dec->pkt_len += 2 * sizeof(QData);
+    return;
   }
 
-  // Burst tx to ring with replies
-  if (pkt_buf_counter != 0)
-    nb_tx = rte_ring_enqueue_burst(mbuf_tx_ring, (void **)pkts_burst, pkt_buf_counter, nullptr);
+  start = _mm_movemask_epi8(_mm_cmpeq_epi8(data, _mm_set1_epi8((char)XGMII_START)));
+  term = _mm_movemask_epi8(_mm_cmpeq_epi8(data, _mm_set1_epi8((char)XGMII_TERM)));
+
+  if (beats[0].ctrl == 0)
+    xgmii_dec_data(dec, (const uint8_t *)&beats[0].data, sizeof(QData));
+  else
+    xgmii_dec_ctrl_beat(dec, &beats[0], start & beats[0].ctrl, term & beats[0].ctrl);
+
+  if (beats[1].ctrl == 0)
+    xgmii_dec_data(dec, (const uint8_t *)&beats[1].data, sizeof(QData));
+  else
+    xgmii_dec_ctrl_beat(dec, &beats[1], (start >> 8) & beats[1].ctrl, (term >> 8) & beats[1].ctrl);
+}
 
-  if (nb_tx) get_kni_stats()[port_id].xgmii_tx_packets[tid] += nb_tx;
+static void xgmii_decode_sse(xgmii_decoder *dec, const xgmii_beat *beats, unsigned nb_beats) {
+  unsigned i;
 
-  if (unlikely(nb_tx < PKT_BURST_SZ)) {
+  for (i = 0; i + 2 <= nb_beats; i += 2)
+    xgmii_dec_2beats_sse(dec, &beats[i]);
+
+  if (i < nb_beats)
+    xgmii_dec_beat_scalar(dec, &beats[i]);
+}
+
+// Decode four beats, storing 32 data bytes at once when none of them has control lanes
+static inline __attribute__((target("avx2")))
+void xgmii_dec_4beats_avx2(xgmii_decoder *dec, const xgmii_beat *beats) {
+  __m256i x = _mm256_loadu_si256((const __m256i *)&beats[0]);
+  __m256i y = _mm256_loadu_si256((const __m256i *)&beats[2]);
+  __m256i ctrl = _mm256_unpackhi_epi64(x, y);
+  __m256i data;
+
+  if (likely(_mm256_testz_si256(ctrl, _mm256_set1_epi64x(0xff))) &&
+      xgmii_dec_fast(dec, 4 * sizeof(QData))) {
+    data = _mm256_permute4x64_epi64(_mm256_unpacklo_epi64(x, y), 0xd8);
+    _mm256_storeu_si256((__m256i *)(dec->pkt_data + dec->pkt_len), data);
+    dec->pkt_len += 4 * sizeof(QData);
+    return;
+  }
+
+  xgmii_dec_2beats_sse(dec, &beats[0]);
+  xgmii_dec_2beats_sse(dec, &beats[2]);
+}
+
+static __attribute__((target("avx2")))
+void xgmii_decode_avx2(xgmii_decoder *dec, const xgmii_beat *beats, unsigned nb_beats) {
+  unsigned i;
+
+  for (i = 0; i + 4 <= nb_beats; i += 4)
+    xgmii_dec_4beats_avx2(dec, &beats[i]);
+
+  for (; i < nb_beats; i++)
+    xgmii_dec_beat_scalar(dec, &beats[i]);
+}
+
+// Decode eight beats, storing 64 data bytes at once when none of them has control lanes
+static inline __attribute__((target("avx512f")))
+void xgmii_dec_8beats_avx512(xgmii_decoder *dec, const xgmii_beat *beats) {
+  __m512i x = _mm512_loadu_si512((const void *)&beats[0]);
+  __m512i y = _mm512_loadu_si512((const void *)&beats[4]);
+  __m512i ctrl = _mm512_permutex2var_epi64(x, _mm512_set_epi64(15, 13, 11, 9, 7, 5, 3, 1), y);
+  __m512i data;
+
+  if (likely(_mm512_test_epi64_mask(ctrl, _mm512_set1_epi64(0xff)) == 0) &&
+      xgmii_dec_fast(dec, 8 * sizeof(QData))) {
+    data = _mm512_permutex2var_epi64(x, _mm512_set_epi64(14, 12, 10, 8, 6, 4, 2, 0), y);
+    _mm512_storeu_si512((void *)(dec->pkt_data + dec->pkt_len), data);
+    dec->pkt_len += 8 * sizeof(QData);
+    return;
+  }
+
+  xgmii_dec_4beats_avx2(dec, &beats[0]);
+  xgmii_dec_4beats_avx2(dec, &beats[4]);
+}
+
+static __attribute__((target("avx512f")))
+void xgmii_decode_avx512(xgmii_decoder *dec, const xgmii_beat *beats, unsigned nb_beats) {
+  unsigned i;
+
+  for (i = 0; i + 8 <= nb_beats; i += 8)
+    xgmii_dec_8beats_avx512(dec, &beats[i]);
+
+  for (; i < nb_beats; i++)
+    xgmii_dec_beat_scalar(dec, &beats[i]);
+}
+#endif
+
+xgmii_decode_fn xgmii_decode = xgmii_decode_scalar;
+
+// Pick the widest decoder allowed by the CPU and --force-max-simd-bitwidth
+void xgmii_init() {
+  const char *name = "scalar";
+
+#ifdef RTE_ARCH_X86
+  uint16_t simd_width = rte_vect_get_max_simd_bitwidth();
+
+  if (simd_width >= RTE_VECT_SIMD_512 && rte_cpu_get_flag_enabled(RTE_CPUFLAG_AVX512F)) {
+    xgmii_decode = xgmii_decode_avx512;
+    name = "AVX-512";
+  } else if (simd_width >= RTE_VECT_SIMD_256 && rte_cpu_get_flag_enabled(RTE_CPUFLAG_AVX2)) {
+    xgmii_decode = xgmii_decode_avx2;
+    name = "AVX2";
+  } else if (simd_width >= RTE_VECT_SIMD_128) {
+    xgmii_decode = xgmii_decode_sse;
+    name = "SSSE3";
+  }
+#endif
+
+  RTE_LOG(INFO, APP, "Using %s XGMII decoder\n", name);
+}
+
+xgmii_decoder *xgmii_decoder_create(rte_mempool *mp, uint16_t port_id, uint8_t tid,
+                                    uint32_t flush_beats, uint32_t flush_us) {
+  xgmii_decoder *dec;
+
+  dec = (xgmii_decoder *)rte_zmalloc("xgmii_decoder", sizeof(xgmii_decoder), RTE_CACHE_LINE_SIZE);
+  if (dec == nullptr)
+    return nullptr;
+
+  dec->mp = mp;
+  dec->port_id = port_id;
+  dec->tid = tid;
+  dec->flush_beats = flush_beats;
+  dec->flush_tsc = flush_us * rte_get_tsc_hz() / KNI_US_PER_SECOND;
+
+  return dec;
+}
+
+void xgmii_decoder_free(xgmii_decoder *dec) {
+  if (dec == nullptr)
+    return;
+
+  rte_pktmbuf_free(dec->pkt);
+  kni_burst_free_mbufs(dec->done, dec->nb_done);
+  rte_free(dec);
+}
+
+void xgmii_decoder_feed(xgmii_decoder *dec, const xgmii_beat *beats, unsigned nb_beats) {
+  uint16_t port_id = dec->port_id, nb_pending = dec->nb_done;
+  uint64_t start_tsc = rte_rdtsc(), nb_idle = 0;
+  unsigned i;
+
+  xgmii_decode(dec, beats, nb_beats);
+
+  // Idle beats sent on as runs stand for the rest of the run too
+  for (i = 0; i < nb_beats; i++)
+    nb_idle += beats[i].repeat;
+
+  get_kni_stats()[port_id].xgmii_dec_cycles[dec->tid] += rte_rdtsc() - start_tsc;
+  get_kni_stats()[port_id].xgmii_dec_beats[dec->tid] += nb_beats;
+  cycle_stats_beats(nb_beats);
+
+  // Start the flush timeout when the first packet of a burst is done
+  if (nb_pending == 0 && dec->nb_done) {
+    dec->pending_tsc = start_tsc;
+    dec->pending_beats = 0;
+  } else {
+    dec->pending_beats += nb_beats + nb_idle;
+  }
+}
+
+// Finish off decoded packets before they're passed on. Returns how many are left.
+static unsigned xgmii_dec_finish(xgmii_decoder *dec, rte_mbuf **pkts, unsigned nb_pkts) {
+  if (split_enabled())
+    nb_pkts = split_rejoin(pkts, nb_pkts, dec->port_id, dec->tid);
+
+  if (unlikely(lat_enabled()))
+    lat_flushed(pkts, nb_pkts, dec->port_id, dec->tid);
+
+  cycle_stats_packets(nb_pkts);
+  return nb_pkts;
+}
+
+// Pass finished packets to mbuf_tx_rings, dropping the ones that don't fit
+static void xgmii_dec_send(xgmii_decoder *dec, rte_mbuf **pkts, unsigned nb_pkts,
+                           rte_ring *const *mbuf_tx_rings, unsigned nb_rings) {
+  uint16_t port_id = dec->port_id;
+  unsigned i, n, nb;
+  uint64_t nb_tx = 0;
+
+  // Burst tx to rings with replies
+  for (i = 0; i < nb_pkts; i += n) {
+    n = RTE_MIN(nb_pkts - i, (unsigned)FLOW_STEER_MAX_BURST);
+    nb = flow_steer_burst(mbuf_tx_rings, nb_rings, &pkts[i], n);
     // Free mbufs not tx to NIC
-    kni_burst_free_mbufs(&pkts_burst[nb_tx], PKT_BURST_SZ - nb_tx);
-    get_kni_stats()[port_id].xgmii_tx_dropped[tid] += pkt_buf_counter - nb_tx;
+    if (unlikely(nb < n))
+      kni_burst_free_mbufs(&pkts[i + nb], n - nb);
+    nb_tx += nb;
+  }
+
+  if (nb_tx) get_kni_stats()[port_id].xgmii_tx_packets[dec->tid] += nb_tx;
+
+  if (unlikely(nb_tx < nb_pkts || dec->nb_dropped)) {
+    get_kni_stats()[port_id].xgmii_tx_dropped[dec->tid] += nb_pkts - nb_tx + dec->nb_dropped;
+    dec->nb_dropped = 0;
+  }
+}
+
+void xgmii_decoder_flush(xgmii_decoder *dec, rte_ring *const *mbuf_tx_rings, unsigned nb_rings) {
+  // Send full bursts straight away, and partial ones once they're too old
+  if (dec->nb_done == 0)
+    return;
+  if (dec->nb_done < PKT_BURST_SZ && dec->pending_beats < dec->flush_beats &&
+      rte_rdtsc() - dec->pending_tsc < dec->flush_tsc)
+    return;
+
+  dec->nb_done = xgmii_dec_finish(dec, dec->done, dec->nb_done);
+  xgmii_dec_send(dec, dec->done, dec->nb_done, mbuf_tx_rings, nb_rings);
+  dec->nb_done = 0;
+}
+
+// Convert xgmii to mbuf
+unsigned xgmii_to_mbuf(xgmii_decoder *dec, rte_ring *xgmii_rx_ring, rte_ring *const *mbuf_tx_rings,
+                       unsigned nb_rings) {
+  xgmii_beat xgm_buf[XGMII_DEC_BURST_SZ] __rte_cache_aligned;
+  unsigned nb_rx;
+
+  // Read the next burst of XGMII beats, if there is one
+  nb_rx = rte_ring_dequeue_burst_elem(xgmii_rx_ring, xgm_buf, sizeof(xgmii_beat),
+                                      XGMII_DEC_BURST_SZ, nullptr);
+  if (nb_rx)
+    xgmii_decoder_feed(dec, xgm_buf, nb_rx);
+
+  xgmii_decoder_flush(dec, mbuf_tx_rings, nb_rings);
+  return nb_rx;
+}
+
+// Last /S/ or /T/ in a beat, or an idle if it has neither
+static inline uint8_t xgmii_beat_last_event(const xgmii_beat *beat) {
+  const uint8_t *lanes = (const uint8_t *)&beat->data;
+  unsigned lane;
+
+  for (lane = sizeof(QData); beat->ctrl && lane-- > 0;) {
+    if ((beat->ctrl & (1 << lane)) && (lanes[lane] == XGMII_START || lanes[lane] == XGMII_TERM))
+      return lanes[lane];
+  }
+  return XGMII_IDLE;
+}
+
+// How many beats of a chunk to decode so it ends between packets, which is up
+// to the last beat that ends a packet without starting another. A chunk with
+// no /S/ or /T/ in it is only idles, and is taken whole. 0 if the chunk has
+// nowhere to cut yet.
+static unsigned xgmii_split_point(const xgmii_beat *beats, unsigned nb_beats) {
+  bool started = false;
+  unsigned i;
+  uint8_t ev;
+
+  for (i = nb_beats; i > 0; i--) {
+    ev = xgmii_beat_last_event(&beats[i - 1]);
+    if (ev == XGMII_TERM)
+      return i;
+    started |= ev == XGMII_START;
+  }
+  return started ? 0 : nb_beats;
+}
+
+xgmii_block_decoder *xgmii_block_decoder_create(xgmii_dec_group *grp, rte_mempool *mp,
+                                                uint16_t port_id, uint8_t tid) {
+  xgmii_block_decoder *bdec;
+
+  bdec = (xgmii_block_decoder *)rte_zmalloc("xgmii_block_decoder", sizeof(*bdec),
+                                            RTE_CACHE_LINE_SIZE);
+  if (bdec == nullptr)
+    return nullptr;
+
+  // Chunks are passed on whole, so the flush thresholds are never used
+  bdec->dec = xgmii_decoder_create(mp, port_id, tid, 0, 0);
+  if (bdec->dec == nullptr) {
+    rte_free(bdec);
+    return nullptr;
+  }
+  bdec->group = grp;
+  return bdec;
+}
+
+void xgmii_block_decoder_free(xgmii_block_decoder *bdec) {
+  if (bdec == nullptr)
+    return;
+
+  xgmii_decoder_free(bdec->dec);
+  rte_free(bdec);
+}
+
+unsigned xgmii_to_mbuf_ordered(xgmii_block_decoder *bdec, rte_ring *xgmii_rx_ring,
+                               rte_ring *const *mbuf_tx_rings, unsigned nb_rings) {
+  xgmii_dec_group *grp = bdec->group;
+  xgmii_decoder *dec = bdec->dec;
+  unsigned i, n, nb_rx, nb_beats, nb_split, nb_done, nb_pkts = 0;
+  uint32_t ticket;
+
+  if (rte_ring_empty(xgmii_rx_ring))
+    return 0;
+
+  // Take a chunk and its ticket together, so tickets follow the ring. The
+  // chunk starts with the beats the last one held back.
+  rte_spinlock_lock(&grp->order.lock);
+  nb_beats = grp->nb_carry;
+  rte_memcpy(bdec->beats, grp->carry, nb_beats * sizeof(xgmii_beat));
+  nb_rx = rte_ring_dequeue_burst_elem(xgmii_rx_ring, &bdec->beats[nb_beats], sizeof(xgmii_beat),
+                                      XGMII_SPLIT_BEATS - nb_beats, nullptr);
+  nb_beats += nb_rx;
+
+  // Cut it between packets. A full chunk with nowhere to cut is taken whole
+  // so the ring keeps moving, and the packet it ends in is dropped below.
+  nb_split = xgmii_split_point(bdec->beats, nb_beats);
+  if (unlikely(nb_split == 0 && nb_beats == XGMII_SPLIT_BEATS))
+    nb_split = nb_beats;
+  grp->nb_carry = nb_beats - nb_split;
+  rte_memcpy(grp->carry, &bdec->beats[nb_split], grp->nb_carry * sizeof(xgmii_beat));
+
+  ticket = grp->order.next_ticket;
+  if (nb_split)
+    grp->order.next_ticket++;
+  rte_spinlock_unlock(&grp->order.lock);
+
+  if (nb_split == 0)
+    return nb_rx;
+
+  // Packets past the end of pkts, which a design under test can send by
+  // ending several in one beat, are dropped
+  for (i = 0; i < nb_split; i += n) {
+    n = RTE_MIN(nb_split - i, (unsigned)XGMII_DEC_BURST_SZ);
+    xgmii_decoder_feed(dec, &bdec->beats[i], n);
+    nb_done = RTE_MIN((unsigned)dec->nb_done, (unsigned)RTE_DIM(bdec->pkts) - nb_pkts);
+    rte_memcpy(&bdec->pkts[nb_pkts], dec->done, nb_done * sizeof(rte_mbuf *));
+    if (unlikely(nb_done < dec->nb_done)) {
+      kni_burst_free_mbufs(&dec->done[nb_done], dec->nb_done - nb_done);
+      dec->nb_dropped += dec->nb_done - nb_done;
+    }
+    nb_pkts += nb_done;
+    dec->nb_done = 0;
   }
+
+  // A chunk taken whole ends partway into a packet, whose rest goes to
+  // another decoder that skips it. It's dropped and counted here, once.
+  if (unlikely(dec->in_pkt)) {
+    if (dec->pkt != nullptr) {
+      rte_pktmbuf_free(dec->pkt);
+      dec->pkt = nullptr;
+      dec->nb_dropped++;
+    }
+    dec->in_pkt = false;
+  }
+  nb_pkts = xgmii_dec_finish(dec, bdec->pkts, nb_pkts);
+
+  // Wait for the chunks taken before this one
+  while (__atomic_load_n(&grp->order.next_commit, __ATOMIC_ACQUIRE) != ticket)
+    rte_pause();
+
+  xgmii_dec_send(dec, bdec->pkts, nb_pkts, mbuf_tx_rings, nb_rings);
+  __atomic_store_n(&grp->order.next_commit, ticket + 1, __ATOMIC_RELEASE);
+
+  return nb_rx;
 }
@@ -1,14 +1,251 @@
 #ifndef FESTOON_XGMII_H
 #define FESTOON_XGMII_H
 
+#include <rte_mbuf.h>
 #include <rte_mempool.h>
 #include <rte_ring.h>
+#include <rte_spinlock.h>
 
 #include "festoon_common.h"
+#include "festoon_latency.h"
 #include "verilated.h"
 
-void mbuf_to_xgmii(rte_ring *mbuf_rx_ring, rte_ring *xgmii_tx_ring, rte_mempool *tx_mempool, uint8_t tid);
+// How packets are laid out on XGMII
+enum xgmii_encoder_mode {
+  XGMII_ENC_SPARSE,  // /S/, data and /T/ each start a new beat
+  XGMII_ENC_DENSE    // 10G rules: /S/ on lane 0 or 4, /T/ after the last data, deficit idle count
+};
 
-void xgmii_to_mbuf(rte_ring *xgmii_rx_ring, rte_ring *mbuf_tx_ring, rte_mempool *tx_mempool, uint8_t tid);
+// Cursor over a packet being turned into XGMII beats
+struct xgmii_encoder {
+  rte_mbuf *pkt;  // Packet being encoded, nullptr when there is none
+  uint32_t off;   // Next byte of pkt to encode
+  uint8_t state;  // Which part of the packet comes next
+  uint8_t mode;   // An xgmii_encoder_mode
+  uint8_t tid;    // Direction for stats, 0 for Ethernet and 1 for PCIe
+  uint16_t port_id;  // DPDK port for stats
+  uint8_t pre;    // Preamble bytes sent so far, in dense mode
+  uint8_t ifg;    // Idle bytes still owed before the next /S/, in dense mode
+  uint8_t dic;    // Deficit idle count, in dense mode
+  const uint64_t *clock;  // Cycle count of the model the beats go to, for latency
+};
+
+enum xgmii_encoder_state {
+  XGMII_ENC_START,
+  XGMII_ENC_DATA,
+  XGMII_ENC_TERM,
+  XGMII_ENC_PREAMBLE,
+  XGMII_ENC_IFG
+};
+
+static inline void xgmii_encoder_init(xgmii_encoder *enc, uint16_t port_id, uint8_t tid,
+                                      xgmii_encoder_mode mode) {
+  memset(enc, 0, sizeof(*enc));
+  enc->port_id = port_id;
+  enc->tid = tid;
+  enc->mode = mode;
+  enc->state = mode == XGMII_ENC_DENSE ? XGMII_ENC_IFG : XGMII_ENC_START;
+}
+
+// Whether a packet fits in the beats set aside for one, and can be read
+// straight out of its first segment. Packets that can't are dropped.
+static inline bool xgmii_encodable(const rte_mbuf *pkt) {
+  return rte_pktmbuf_pkt_len(pkt) <= MAX_PACKET_SZ && rte_pktmbuf_is_contiguous(pkt);
+}
+
+// Start encoding pkt. The encoder frees it once its last beat is out.
+static inline void xgmii_encoder_load(xgmii_encoder *enc, rte_mbuf *pkt) {
+  enc->pkt = pkt;
+  enc->off = 0;
+  if (enc->mode == XGMII_ENC_SPARSE)
+    enc->state = XGMII_ENC_START;
+}
+
+// Start again between packets without knowing where the last beat sent left
+// off, which in dense mode takes a full gap before the next /S/
+static inline void xgmii_encoder_restart(xgmii_encoder *enc) {
+  enc->ifg = XGMII_IPG;
+  enc->dic = 0;
+  enc->state = enc->mode == XGMII_ENC_DENSE ? XGMII_ENC_IFG : XGMII_ENC_START;
+}
+
+// Account for an idle beat sent while no packet was loaded
+static inline void xgmii_encoder_idle(xgmii_encoder *enc) {
+  enc->ifg = enc->ifg > sizeof(QData) ? enc->ifg - sizeof(QData) : 0;
+}
+
+// Produce the next beat of the loaded packet in dense mode
+void xgmii_encode_beat_dense(xgmii_encoder *enc, xgmii_beat *beat);
+
+// Produce the next beat of the loaded packet
+static inline void xgmii_encode_beat(xgmii_encoder *enc, xgmii_beat *beat) {
+  uint32_t left;
+
+  beat->repeat = 0;
+  if (enc->mode == XGMII_ENC_DENSE) {
+    xgmii_encode_beat_dense(enc, beat);
+    return;
+  }
+
+  switch (enc->state) {
+  case XGMII_ENC_START:
+    // Send packet begin control bits
+    beat->ctrl = 0b00000001;
+    beat->data = 0xd5555555555555fb;
+    enc->state = XGMII_ENC_DATA;
+    break;
+
+  case XGMII_ENC_DATA:
+    // Move the next 64 bits of the packet over
+    left = rte_pktmbuf_pkt_len(enc->pkt) - enc->off;
+    if (likely(left >= sizeof(QData))) {
+      rte_memcpy(&beat->data, rte_pktmbuf_mtod_offset(enc->pkt, void *, enc->off), sizeof(QData));
+      beat->ctrl = 0b00000000;
+    } else {
+      // Pad unused lanes with idles
+      beat->data = 0x0707070707070707;
+      rte_memcpy(&beat->data, rte_pktmbuf_mtod_offset(enc->pkt, void *, enc->off), left);
+      beat->ctrl = 0b11111111 << left;
+    }
+
+    enc->off += sizeof(QData);
+    if (enc->off >= rte_pktmbuf_pkt_len(enc->pkt))
+      enc->state = XGMII_ENC_TERM;
+    break;
+
+  default:
+    // Packet end control bits
+    beat->ctrl = 0b11111111;
+    beat->data = 0x07070707070707fd;
+    if (unlikely(lat_enabled()))
+      lat_encoded(enc->pkt, enc->port_id, enc->tid, enc->clock);
+    rte_pktmbuf_free(enc->pkt);
+    enc->pkt = nullptr;
+    break;
+  }
+}
+
+// Reassembly state for one direction of XGMII to mbuf conversion. It lives
+// across xgmii_to_mbuf calls, so packets may span any number of them.
+struct xgmii_decoder {
+  rte_mempool *mp;         // Mempool for reassembled packets
+  rte_mbuf *pkt;           // Packet being reassembled, nullptr if it's being dropped
+  uint8_t *pkt_data;       // Start of pkt's data buffer
+  uint16_t pkt_len;        // Bytes written into pkt so far
+  uint8_t preamble;        // Preamble bytes left to skip after /S/
+  bool in_pkt;             // Whether a /S/ has been seen without its /T/
+  uint8_t tid;             // Direction for stats, 0 for Ethernet and 1 for PCIe
+  uint16_t port_id;        // DPDK port for stats
+  uint16_t nb_done;        // Number of finished packets in done
+  uint64_t nb_dropped;     // Packets lost to mempool exhaustion, runts or overlong frames
+  uint64_t pending_tsc;    // When the oldest packet in done was finished
+  uint64_t pending_beats;  // Beats decoded since then
+  uint64_t flush_tsc;      // Flush a partial burst after this many TSC cycles...
+  uint64_t flush_beats;    // ...or after this many beats
+  const uint64_t *clock;   // Cycle count of the model the beats come from, for latency
+  // Finished packets. A well-formed stream finishes at most one packet per
+  // beat, so this holds one full decode burst on top of a packet burst. Any
+  // more are dropped.
+  rte_mbuf *done[PKT_BURST_SZ + XGMII_DEC_BURST_SZ];
+} __rte_cache_aligned;
+
+// Pick the XGMII decoder kernel for this CPU
+void xgmii_init();
+
+// Encode packets from mbuf_rx_ring into beats on xgmii_tx_ring. Returns the
+// number of packets taken off mbuf_rx_ring.
+unsigned mbuf_to_xgmii(xgmii_encoder *enc, rte_ring *mbuf_rx_ring, rte_ring *xgmii_tx_ring);
+
+// Encoders or decoders of one direction of a port that run in parallel. Each
+// takes its input off the ring along with a ticket, converts it on its own,
+// and queues the result once the ones with earlier tickets are in, so packets
+// come out in the order they were taken off the ring.
+struct xgmii_group {
+  rte_spinlock_t lock;   // Held while taking input and its ticket
+  uint32_t next_ticket;  // Ticket of the next input taken
+  uint32_t next_commit;  // Ticket of the next result to be queued
+  uint32_t reserved;     // Ring room held for results taken but not yet queued, by encoders
+} __rte_cache_aligned;
+
+// Encoders take a burst of packets and encode it into a block of beats
+
+// One of the encoders in a group, with room for a whole burst
+struct xgmii_block_encoder {
+  xgmii_encoder enc;
+  xgmii_group *group;
+  uint16_t ends[PKT_BURST_SZ];  // Beat each packet of the block ends before
+  xgmii_beat beats[PKT_BURST_SZ * XGMII_PKT_BEATS];
+} __rte_cache_aligned;
+
+static inline void xgmii_group_init(xgmii_group *grp) {
+  rte_spinlock_init(&grp->lock);
+  grp->next_ticket = 0;
+  grp->next_commit = 0;
+  grp->reserved = 0;
+}
+
+xgmii_block_encoder *xgmii_block_encoder_create(xgmii_group *grp, uint16_t port_id, uint8_t tid,
+                                                xgmii_encoder_mode mode);
+
+void xgmii_block_encoder_free(xgmii_block_encoder *benc);
+
+// mbuf_to_xgmii for an encoder in a group. Blocks start with a full gap in
+// dense mode, since the one before may have come from another encoder.
+unsigned mbuf_to_xgmii_ordered(xgmii_block_encoder *benc, rte_ring *mbuf_rx_ring,
+                               rte_ring *xgmii_tx_ring);
+
+// Create a decoder for one direction of a port. Partial packet bursts are passed
+// on after flush_beats beats or flush_us microseconds, whichever comes first.
+xgmii_decoder *xgmii_decoder_create(rte_mempool *mp, uint16_t port_id, uint8_t tid,
+                                    uint32_t flush_beats, uint32_t flush_us);
+
+void xgmii_decoder_free(xgmii_decoder *dec);
+
+// Decode up to XGMII_DEC_BURST_SZ beats. xgmii_decoder_flush must be called
+// before feeding the decoder again.
+void xgmii_decoder_feed(xgmii_decoder *dec, const xgmii_beat *beats, unsigned nb_beats);
+
+// Pass finished packets to mbuf_tx_rings if a burst is full or has timed out.
+// Rings are picked by flow_hash when there is more than one.
+void xgmii_decoder_flush(xgmii_decoder *dec, rte_ring *const *mbuf_tx_rings, unsigned nb_rings);
+
+// Decode whatever beats are waiting in xgmii_rx_ring, without blocking.
+// Returns the number of beats read.
+unsigned xgmii_to_mbuf(xgmii_decoder *dec, rte_ring *xgmii_rx_ring, rte_ring *const *mbuf_tx_rings,
+                       unsigned nb_rings);
+
+// Decoders take a chunk of up to XGMII_SPLIT_BEATS beats that starts and ends
+// between packets, cut after the last beat that ends a packet. Beats past it
+// are held back in the group for the next chunk, since the packet they start
+// isn't all there yet.
+struct xgmii_dec_group {
+  xgmii_group order;
+  uint16_t nb_carry;  // Beats held back for the next chunk
+  xgmii_beat carry[XGMII_SPLIT_BEATS];
+} __rte_cache_aligned;
+
+// One of the decoders in a group, with room for a whole chunk
+struct xgmii_block_decoder {
+  xgmii_decoder *dec;
+  xgmii_dec_group *group;
+  rte_mbuf *pkts[XGMII_SPLIT_BEATS];  // Packets of the chunk. Any past one per beat are dropped.
+  xgmii_beat beats[XGMII_SPLIT_BEATS];
+} __rte_cache_aligned;
+
+static inline void xgmii_dec_group_init(xgmii_dec_group *grp) {
+  xgmii_group_init(&grp->order);
+  grp->nb_carry = 0;
+}
+
+xgmii_block_decoder *xgmii_block_decoder_create(xgmii_dec_group *grp, rte_mempool *mp,
+                                                uint16_t port_id, uint8_t tid);
+
+void xgmii_block_decoder_free(xgmii_block_decoder *bdec);
+
+// xgmii_to_mbuf for a decoder in a group. Packets are passed on as soon as
+// their chunk is done, rather than held for a full burst. A packet that
+// doesn't end within XGMII_SPLIT_BEATS of the last one is dropped and counted.
+unsigned xgmii_to_mbuf_ordered(xgmii_block_decoder *bdec, rte_ring *xgmii_rx_ring,
+                               rte_ring *const *mbuf_tx_rings, unsigned nb_rings);
 
 #endif
\ No newline at end of file
@@ -18,7 +18,9 @@
 #include <rte_ethdev.h>
 #include <rte_ether.h>
 #include <rte_interrupts.h>
+#ifdef RTE_LIB_KNI
 #include <rte_kni.h>
+#endif
 #include <rte_launch.h>
 #include <rte_lcore.h>
 #include <rte_log.h>
@@ -39,9 +41,15 @@
 #include <sys/queue.h>
 #include <unistd.h>
 
+#include "festoon_bypass.h"
 #include "festoon_eth.h"
 #include "festoon_kni.h"
+#include "festoon_latency.h"
+#include "festoon_sched.h"
+#include "festoon_split.h"
+#include "festoon_telemetry.h"
 #include "festoon_top.h"
+#include "festoon_virtio.h"
 #include "festoon_xgmii.h"
 #include "params.h"
 
@@ -56,7 +64,7 @@ struct rte_eth_conf port_conf = {
 };
 
 /* Mempool for mbufs */
-rte_mempool *pktmbuf_pool = NULL, *xgmii_pool = NULL;
+rte_mempool *pktmbuf_pool = NULL;
 
 /* Mask of enabled ports */
 uint32_t ports_mask = 0;
@@ -65,17 +73,164 @@ int promiscuous_on = 0;
 /* Monitor link status continually. off by default. */
 int monitor_links;
 
+#ifdef RTE_LIB_KNI
 int kni_change_mtu(uint16_t port_id, unsigned int new_mtu);
 int kni_config_network_interface(uint16_t port_id, uint8_t if_up);
 int kni_config_mac_address(uint16_t port_id, uint8_t mac_addr[]);
+#endif
 
 uint32_t kni_stop, kni_pause;
+/* Set by the signal handler for the stats thread */
+uint32_t stats_print_req, stats_reset_req;
+
+/* Rings, XGMII encoders and decoders between a port and its port on the model */
+struct port_pipeline {
+  /* Packets out of the model go to each Ethernet TX queue, packets into it go to each shard */
+  rte_ring *eth_tx_rings[ETH_MAX_QUEUES], *kni_tx_ring;
+  rte_ring *eth_rx_rings[VTOP_MAX_SHARDS], *kni_rx_rings[VTOP_MAX_SHARDS];
+
+  /* Ethernet and PCIe directions of each shard */
+  xgmii_encoder eth_encoders[VTOP_MAX_SHARDS], kni_encoders[VTOP_MAX_SHARDS];
+  xgmii_decoder *eth_decoders[VTOP_MAX_SHARDS], *kni_decoders[VTOP_MAX_SHARDS];
+
+  /* Encoders of each direction taking turns on one model, with --xgmii-encoders */
+  xgmii_group eth_enc_group, kni_enc_group;
+  xgmii_block_encoder *eth_block_encoders[XGMII_MAX_ENCODERS];
+  xgmii_block_encoder *kni_block_encoders[XGMII_MAX_ENCODERS];
+
+  /* Decoders of each direction splitting one model's output, with --xgmii-decoders */
+  xgmii_dec_group eth_dec_group, kni_dec_group;
+  xgmii_block_decoder *eth_block_decoders[XGMII_MAX_DECODERS];
+  xgmii_block_decoder *kni_block_decoders[XGMII_MAX_DECODERS];
+};
+port_pipeline *port_pipelines[RTE_MAX_ETHPORTS];
+/* Pack XGMII beats the way a 10G MAC would. off by default. */
+int xgmii_dense = 0;
+/* Beats and microseconds before the decoders flush a partial burst */
+uint32_t xgmii_flush_beats = XGMII_FLUSH_BEATS;
+uint32_t xgmii_flush_us = XGMII_FLUSH_US;
+/* Have the Verilator worker do the XGMII conversion itself. off by default. */
+int vtop_pkt_mode = 0;
+/* Only evaluate the model on clock edges. Legacy clocking is off by default. */
+vtop_clocking_mode vtop_clocking = VTOP_CLOCK_EDGE;
+/* Lcores for the Verilated model's own worker threads. None by default. */
+unsigned vtop_thread_lcores[RTE_MAX_LCORE];
+uint32_t nb_vtop_threads = 0;
+/* Lcores for Ethernet queues past the first, which use the --config ones */
+unsigned eth_rxq_lcores[ETH_MAX_QUEUES], eth_txq_lcores[ETH_MAX_QUEUES];
+uint32_t nb_eth_rxq = 1, nb_eth_txq = 1;
+/* Lcores for model instances past the first, which runs on the --config one */
+unsigned vtop_shard_lcores[VTOP_MAX_SHARDS];
+uint32_t nb_vtop_shards = 1;
+/* Lcores for XGMII encoders past the first, which run on the --config ones */
+unsigned xgmii_enc_lcores[XGMII_MAX_ENCODERS];
+uint32_t nb_xgmii_encoders = 1;
+/* Lcores for XGMII decoders past the first, which run on the --config ones */
+unsigned xgmii_dec_lcores[XGMII_MAX_DECODERS];
+uint32_t nb_xgmii_decoders = 1;
+/* Idle beats out of the model are left off the XGMII rings by default */
+vtop_idle_out_mode vtop_idle_out = VTOP_IDLE_OUT_DROP;
+/* Idle cycles before the model stops being clocked. 0 (never) by default. */
+uint32_t vtop_idle_cycles = 0;
+/* Host interfaces are virtio-user, or TAP without vhost-net, by default */
+host_backend host_be = HOST_BACKEND_VIRTIO;
+/* Queue pairs on each virtio-user or TAP host interface */
+uint32_t nb_host_queues = 1;
+/* Exchange TCP super-frames with the host, cut up and merged on the host lcores */
+int host_gso = 0;
+/* Time packets through each stage into latency histograms. off by default. */
+int latency_on = 0;
+/* Keep polling flat out with nothing to do, instead of backing off. off by default. */
+int idle_poll = 0;
+/* Bytes of each packet sent through the model. 0 (all of them) by default. */
+uint32_t header_split = 0;
+
+/* What each stage, and each lcore, does in main_loop */
+enum lcore_rxtx {
+  LCORE_NONE,
+  LCORE_ETH_RX,
+  LCORE_ETH_TX,
+  LCORE_KNI_RX,
+  LCORE_KNI_TX,
+  LCORE_ETH_XGMII_TX,
+  LCORE_ETH_XGMII_RX,
+  LCORE_KNI_XGMII_TX,
+  LCORE_KNI_XGMII_RX,
+  LCORE_VTOP,
+  LCORE_NB_STAGES,
+  LCORE_SHARED = LCORE_NB_STAGES  /* More than one stage takes turns on it */
+};
+static const char *const lcore_role_names[] = {
+  "none", "eth-rx", "eth-tx", "host-rx", "host-tx", "eth-dec", "eth-enc", "pcie-dec",
+  "pcie-enc", "model", "shared"
+};
+static enum lcore_rxtx lcore_roles[RTE_MAX_LCORE];
+/* Times each stage is run in a row when it shares an lcore */
+uint16_t sched_weights[LCORE_NB_STAGES] = {
+  0, 1, 1, 1, 1, 1, 1, 1, 1, SCHED_MODEL_WEIGHT
+};
+
+/* Print out where each lcore's cycles went, when built with FESTOON_CYCLE_STATS */
+void print_cycle_stats(void) {
+  lcore_cycle_stats cs;
+  uint64_t polls;
+  unsigned i;
+
+  printf("\n**Lcore cycle statistics**\n"
+         " ======  ========  =======  ============  ============  ==========  ==========  ==========\n"
+         "  Lcore    Role      busy%%    busy_polls   empty_polls     cyc/pkt    cyc/beat    cyc/eval\n"
+         " ------  --------  -------  ------------  ------------  ----------  ----------  ----------\n");
+  for (i = 0; i < RTE_MAX_LCORE; i++) {
+    if (lcore_roles[i] == LCORE_NONE)
+      continue;
 
-rte_ring *eth_tx_ring, *eth_rx_ring, *kni_tx_ring, *kni_rx_ring;
+    cycle_stats_read(i, &cs);
+    polls = cs.busy_cycles + cs.empty_cycles;
+    printf("%7u %9s %8.2f %13" PRIu64 " %13" PRIu64 " %11.1f %11.1f %11.1f\n", i,
+           lcore_role_names[lcore_roles[i]],
+           polls ? 100.0 * cs.busy_cycles / polls : 0.0, cs.busy_polls, cs.empty_polls,
+           cs.packets ? (double)cs.busy_cycles / cs.packets : 0.0,
+           cs.beats ? (double)cs.busy_cycles / cs.beats : 0.0,
+           cs.evals ? (double)cs.eval_cycles / cs.evals : 0.0);
+  }
+  printf(" ======  ========  =======  ============  ============  ==========  ==========  ==========\n");
+}
+
+/* Print out latency through each stage, in ns or model cycles */
+void print_latency(void) {
+  static lat_port_hists h;
+  lat_summary sum;
+  unsigned side, stage;
+  uint16_t i;
+
+  printf("\n**Latency statistics** (ns, model cycles for cycles)\n"
+         " ======  ====  ======  ============  ==========  ==========  ==========  ==========  ==========\n"
+         "  Port   Side   Stage       packets        mean         p50         p99       p99.9         max\n"
+         " ------  ----  ------  ------------  ----------  ----------  ----------  ----------  ----------\n");
+  for (i = 0; i < RTE_MAX_ETHPORTS; i++) {
+    if (!kni_port_params_array[i])
+      continue;
+
+    lat_read(i, &h);
+    for (side = 0; side < LAT_NB_SIDES; side++) {
+      for (stage = 0; stage < LAT_NB_STAGES; stage++) {
+        lat_summarize(&h.hist[side][stage], stage, &sum);
+        printf("%7d %5s %7s %13" PRIu64 " %11.0f %11.0f %11.0f %11.0f %11.0f\n", i,
+               lat_side_names[side], lat_stage_names[stage], sum.count, sum.mean, sum.p50,
+               sum.p99, sum.p999, sum.max);
+      }
+    }
+    printf("  Packets out of the model with nothing to match: %" PRIu64 " eth, %" PRIu64
+           " host\n", h.unmatched[0], h.unmatched[1]);
+  }
+  printf(" ======  ====  ======  ============  ==========  ==========  ==========  ==========  ==========\n");
+}
 
 /* Print out statistics on packets handled */
 void print_stats(void) {
   uint16_t i;
+  uint64_t cycles, skipped;
+  kni_interface_stats st;
 
   printf("\n**ETH statistics**\n"
          " ======  ==============  ============  ============  ============  ============\n"
@@ -85,12 +240,12 @@ void print_stats(void) {
     if (!kni_port_params_array[i])
       continue;
 
+    kni_stats_read(i, &st);
     printf("%7d %10u/%2u %13" PRIu64 " %13" PRIu64 " %13" PRIu64 " "
            "%13" PRIu64 "\n",
            i, kni_port_params_array[i]->lcore_eth_rx,
-           kni_port_params_array[i]->lcore_eth_tx, get_kni_stats()[i].eth_rx_packets,
-           get_kni_stats()[i].eth_rx_dropped, get_kni_stats()[i].eth_tx_packets,
-           get_kni_stats()[i].eth_tx_dropped);
+           kni_port_params_array[i]->lcore_eth_tx, st.eth_rx_packets, st.eth_rx_dropped,
+           st.eth_tx_packets, st.eth_tx_dropped);
   }
   printf(" ======  ==============  ============  ============  ============  ============\n");
 
@@ -102,63 +257,158 @@ void print_stats(void) {
     if (!kni_port_params_array[i])
       continue;
 
+    kni_stats_read(i, &st);
     printf("%7d %10u/%2u %13" PRIu64 " %13" PRIu64 " %13" PRIu64 " "
            "%13" PRIu64 "\n",
            i, kni_port_params_array[i]->lcore_kni_rx,
-           kni_port_params_array[i]->lcore_kni_tx, get_kni_stats()[i].kni_rx_packets,
-           get_kni_stats()[i].kni_rx_dropped, get_kni_stats()[i].kni_tx_packets,
-           get_kni_stats()[i].kni_tx_dropped);
+           kni_port_params_array[i]->lcore_kni_tx, st.kni_rx_packets, st.kni_rx_dropped,
+           st.kni_tx_packets, st.kni_tx_dropped);
   }
   printf(" ======  ==============  ============  ============  ============  ============\n");
 
   printf("\n**Eth XGMII statistics**\n"
-         " ======  ==============  ============  ============  ============  ============\n"
-         "  Port    Lcore(RX/TX)   xgmii_frames  xmii_dropped  mbuf_packets  mbuf_dropped\n"
-         " ------  --------------  ------------  ------------  ------------  ------------\n");
+         " ======  ==============  ============  ============  ============  ============  ============\n"
+         "  Port    Lcore(RX/TX)   xgmii_frames  xmii_dropped   mbuf_reject  mbuf_packets  mbuf_dropped\n"
+         " ------  --------------  ------------  ------------  ------------  ------------  ------------\n");
   for (i = 0; i < RTE_MAX_ETHPORTS; i++) {
     if (!kni_port_params_array[i])
       continue;
 
-    printf("%7d %10u/%2u %13" PRIu64 " %13" PRIu64 " %13" PRIu64 " "
+    kni_stats_read(i, &st);
+    printf("%7d %10u/%2u %13" PRIu64 " %13" PRIu64 " %13" PRIu64 " %13" PRIu64 " "
            "%13" PRIu64 "\n",
            i, kni_port_params_array[i]->lcore_eth_mii_rx,
-           kni_port_params_array[i]->lcore_eth_mii_tx, get_kni_stats()[i].xgmii_rx_packets[0],
-           get_kni_stats()[i].xgmii_rx_dropped[0], get_kni_stats()[i].xgmii_tx_packets[0],
-           get_kni_stats()[i].xgmii_tx_dropped[0]);
+           kni_port_params_array[i]->lcore_eth_mii_tx, st.xgmii_rx_packets[0],
+           st.xgmii_rx_dropped[0], st.xgmii_rx_rejected[0], st.xgmii_tx_packets[0],
+           st.xgmii_tx_dropped[0]);
   }
-  printf(" ======  ==============  ============  ============  ============  ============\n");
+  printf(" ======  ==============  ============  ============  ============  ============  ============\n");
 
   printf("\n**PCIe XGMII statistics**\n"
-         " ======  ==============  ============  ============  ============  ============\n"
-         "  Port    Lcore(RX/TX)   xgmii_frames  xmii_dropped  mbuf_packets  mbuf_dropped\n"
-         " ------  --------------  ------------  ------------  ------------  ------------\n");
+         " ======  ==============  ============  ============  ============  ============  ============\n"
+         "  Port    Lcore(RX/TX)   xgmii_frames  xmii_dropped   mbuf_reject  mbuf_packets  mbuf_dropped\n"
+         " ------  --------------  ------------  ------------  ------------  ------------  ------------\n");
   for (i = 0; i < RTE_MAX_ETHPORTS; i++) {
     if (!kni_port_params_array[i])
       continue;
 
-    printf("%7d %10u/%2u %13" PRIu64 " %13" PRIu64 " %13" PRIu64 " "
+    kni_stats_read(i, &st);
+    printf("%7d %10u/%2u %13" PRIu64 " %13" PRIu64 " %13" PRIu64 " %13" PRIu64 " "
            "%13" PRIu64 "\n",
            i, kni_port_params_array[i]->lcore_kni_mii_rx,
-           kni_port_params_array[i]->lcore_kni_mii_tx, get_kni_stats()[i].xgmii_rx_packets[1],
-           get_kni_stats()[i].xgmii_rx_dropped[1], get_kni_stats()[i].xgmii_tx_packets[1],
-           get_kni_stats()[i].xgmii_tx_dropped[1]);
+           kni_port_params_array[i]->lcore_kni_mii_tx, st.xgmii_rx_packets[1],
+           st.xgmii_rx_dropped[1], st.xgmii_rx_rejected[1], st.xgmii_tx_packets[1],
+           st.xgmii_tx_dropped[1]);
   }
-  printf(" ======  ==============  ============  ============  ============  ============\n");
+  printf(" ======  ==============  ============  ============  ============  ============  ============\n");
+
+  printf("\n**XGMII decoder statistics**\n"
+         " ======  ============  ============  ============  ============  ============  ============\n"
+         "  Port     eth_beats    eth_cyc/bt   eth_dropped    pcie_beats   pcie_cyc/bt  pcie_dropped\n"
+         " ------  ------------  ------------  ------------  ------------  ------------  ------------\n");
+  for (i = 0; i < RTE_MAX_ETHPORTS; i++) {
+    if (!kni_port_params_array[i])
+      continue;
+
+    kni_stats_read(i, &st);
+    printf("%7d %13" PRIu64 " %13.2f %13" PRIu64 " %13" PRIu64 " %13.2f %13" PRIu64 "\n", i,
+           st.xgmii_dec_beats[0],
+           st.xgmii_dec_beats[0] ? (double)st.xgmii_dec_cycles[0] / st.xgmii_dec_beats[0] : 0.0,
+           st.xgmii_out_dropped[0], st.xgmii_dec_beats[1],
+           st.xgmii_dec_beats[1] ? (double)st.xgmii_dec_cycles[1] / st.xgmii_dec_beats[1] : 0.0,
+           st.xgmii_out_dropped[1]);
+  }
+  printf(" ======  ============  ============  ============  ============  ============  ============\n");
+
+  if (split_enabled()) {
+    printf("\n**Header split statistics**\n"
+           " ======  ============  ============  ============  ============  ============  ============\n"
+           "  Port     eth_split   eth_expired      eth_lost    pcie_split  pcie_expired     pcie_lost\n"
+           " ------  ------------  ------------  ------------  ------------  ------------  ------------\n");
+    for (i = 0; i < RTE_MAX_ETHPORTS; i++) {
+      if (!kni_port_params_array[i])
+        continue;
+
+      kni_stats_read(i, &st);
+      printf("%7d %13" PRIu64 " %13" PRIu64 " %13" PRIu64 " %13" PRIu64 " %13" PRIu64 " "
+             "%13" PRIu64 "\n", i,
+             st.split_packets[0], st.split_expired[0], st.split_lost[0],
+             st.split_packets[1], st.split_expired[1], st.split_lost[1]);
+    }
+    printf(" ======  ============  ============  ============  ============  ============  ============\n");
+  }
+
+  if (bypass_enabled()) {
+    printf("\n**Bypass statistics**\n"
+           " ======  ============  ============  ============  ============\n"
+           "  Port    eth_bypass   eth_dropped   host_bypass  host_dropped\n"
+           " ------  ------------  ------------  ------------  ------------\n");
+    for (i = 0; i < RTE_MAX_ETHPORTS; i++) {
+      if (!kni_port_params_array[i])
+        continue;
+
+      kni_stats_read(i, &st);
+      printf("%7d %13" PRIu64 " %13" PRIu64 " %13" PRIu64 " %13" PRIu64 "\n", i,
+             st.bypass_packets[0], st.bypass_dropped[0], st.bypass_packets[1],
+             st.bypass_dropped[1]);
+    }
+    printf(" ======  ============  ============  ============  ============\n");
+  }
+
+  vtop_get_cycles(&cycles, &skipped);
+  printf("\n**Verilator statistics**\n"
+         " Cycles run: %" PRIu64 ", skipped while idle: %" PRIu64 "\n",
+         cycles, skipped);
+
+#ifdef FESTOON_CYCLE_STATS
+  print_cycle_stats();
+#endif
+
+  if (lat_enabled())
+    print_latency();
 
   fflush(stdout);
 }
 
+/*
+ * Print and reset stats when signals ask for it, outside of the signal
+ * handler, and sample them for telemetry
+ */
+void *stats_thread(void *arg) {
+  uint64_t next_tsc = 0, period = rte_get_timer_hz() * TELEMETRY_PERIOD_MS / 1000;
+  (void)arg;
+
+  while (!__atomic_load_n(&kni_stop, __ATOMIC_RELAXED)) {
+    if (__atomic_exchange_n(&stats_reset_req, 0, __ATOMIC_RELAXED)) {
+      kni_stats_reset();
+      cycle_stats_reset();
+      if (lat_enabled())
+        lat_reset();
+      printf("\n** Statistics have been reset **\n");
+      fflush(stdout);
+    }
+    if (__atomic_exchange_n(&stats_print_req, 0, __ATOMIC_RELAXED))
+      print_stats();
+
+    if (rte_get_timer_cycles() >= next_tsc) {
+      telemetry_sample();
+      next_tsc = rte_get_timer_cycles() + period;
+    }
+    rte_delay_us_sleep(STATS_POLL_MS * 1000);
+  }
+  return NULL;
+}
+
 /* Custom handling of signals to handle stats and kni processing */
 void signal_handler(int signum) {
-  /* When we receive a USR1 signal, print stats */
+  /* When we receive a USR1 signal, have the stats thread print stats */
   if (signum == SIGUSR1) {
-    print_stats();
+    __atomic_store_n(&stats_print_req, 1, __ATOMIC_RELAXED);
   }
 
-  /* When we receive a USR2 signal, reset stats */
+  /* When we receive a USR2 signal, have it reset them */
   if (signum == SIGUSR2) {
-    memset(get_kni_stats(), 0, sizeof(*get_kni_stats()));
-    printf("\n** Statistics have been reset **\n");
+    __atomic_store_n(&stats_reset_req, 1, __ATOMIC_RELAXED);
     return;
   }
 
@@ -174,175 +424,327 @@ void signal_handler(int signum) {
   }
 }
 
+/* Stages of main_loop, each run with its port, and queue or shard */
+static unsigned stage_eth_rx(const sched_stage *st) {
+  return eth_ingress(kni_port_params_array[st->port_id], st->queue,
+                     port_pipelines[st->port_id]->eth_rx_rings, nb_vtop_shards);
+}
+
+static unsigned stage_eth_tx(const sched_stage *st) {
+  return eth_egress(kni_port_params_array[st->port_id], st->queue,
+                    port_pipelines[st->port_id]->eth_tx_rings[st->queue]);
+}
+
+static bool stage_eth_tx_ready(const sched_stage *st) {
+  return !rte_ring_empty(port_pipelines[st->port_id]->eth_tx_rings[st->queue]);
+}
+
+static unsigned stage_kni_rx(const sched_stage *st) {
+  port_pipeline *pl = port_pipelines[st->port_id];
+
+#ifdef RTE_LIB_KNI
+  if (host_be == HOST_BACKEND_KNI)
+    return kni_ingress(kni_port_params_array[st->port_id], pl->kni_rx_rings, nb_vtop_shards);
+#endif
+  return virtio_ingress(kni_port_params_array[st->port_id], pl->kni_rx_rings, nb_vtop_shards);
+}
+
+static unsigned stage_kni_tx(const sched_stage *st) {
+  port_pipeline *pl = port_pipelines[st->port_id];
+
+#ifdef RTE_LIB_KNI
+  if (host_be == HOST_BACKEND_KNI)
+    return kni_egress(kni_port_params_array[st->port_id], pl->kni_tx_ring);
+#endif
+  return virtio_egress(kni_port_params_array[st->port_id], pl->kni_tx_ring);
+}
+
+/* KNI has requests from the kernel to handle even when there's no traffic */
+static bool stage_kni_tx_ready(const sched_stage *st) {
+  return host_be == HOST_BACKEND_KNI || !rte_ring_empty(port_pipelines[st->port_id]->kni_tx_ring);
+}
+
+static unsigned stage_eth_xgmii_tx(const sched_stage *st) {
+  port_pipeline *pl = port_pipelines[st->port_id];
+
+  if (nb_xgmii_decoders > 1)
+    return xgmii_to_mbuf_ordered(pl->eth_block_decoders[st->queue],
+                                 get_vtop_eth_tx_ring(0, kni_port_params_array[st->port_id]->vtop_port),
+                                 pl->eth_tx_rings, nb_eth_txq);
+  return xgmii_to_mbuf(pl->eth_decoders[0],
+                       get_vtop_eth_tx_ring(0, kni_port_params_array[st->port_id]->vtop_port),
+                       pl->eth_tx_rings, nb_eth_txq);
+}
+
+/* Decoders also run to flush packets they are holding on to, unless they're in a group */
+static bool stage_eth_xgmii_tx_ready(const sched_stage *st) {
+  return (nb_xgmii_decoders == 1 && port_pipelines[st->port_id]->eth_decoders[0]->nb_done) ||
+         !rte_ring_empty(get_vtop_eth_tx_ring(0, kni_port_params_array[st->port_id]->vtop_port));
+}
+
+static unsigned stage_eth_xgmii_rx(const sched_stage *st) {
+  port_pipeline *pl = port_pipelines[st->port_id];
+
+  if (nb_xgmii_encoders > 1)
+    return mbuf_to_xgmii_ordered(pl->eth_block_encoders[st->queue], pl->eth_rx_rings[0],
+                                 get_vtop_eth_rx_ring(0, kni_port_params_array[st->port_id]->vtop_port));
+  return mbuf_to_xgmii(&pl->eth_encoders[0], pl->eth_rx_rings[0],
+                       get_vtop_eth_rx_ring(0, kni_port_params_array[st->port_id]->vtop_port));
+}
+
+static bool stage_eth_xgmii_rx_ready(const sched_stage *st) {
+  return !rte_ring_empty(port_pipelines[st->port_id]->eth_rx_rings[0]);
+}
+
+static unsigned stage_kni_xgmii_tx(const sched_stage *st) {
+  port_pipeline *pl = port_pipelines[st->port_id];
+
+  if (nb_xgmii_decoders > 1)
+    return xgmii_to_mbuf_ordered(pl->kni_block_decoders[st->queue],
+                                 get_vtop_pci_tx_ring(0, kni_port_params_array[st->port_id]->vtop_port),
+                                 &pl->kni_tx_ring, 1);
+  return xgmii_to_mbuf(pl->kni_decoders[0],
+                       get_vtop_pci_tx_ring(0, kni_port_params_array[st->port_id]->vtop_port),
+                       &pl->kni_tx_ring, 1);
+}
+
+static bool stage_kni_xgmii_tx_ready(const sched_stage *st) {
+  return (nb_xgmii_decoders == 1 && port_pipelines[st->port_id]->kni_decoders[0]->nb_done) ||
+         !rte_ring_empty(get_vtop_pci_tx_ring(0, kni_port_params_array[st->port_id]->vtop_port));
+}
+
+static unsigned stage_kni_xgmii_rx(const sched_stage *st) {
+  port_pipeline *pl = port_pipelines[st->port_id];
+
+  if (nb_xgmii_encoders > 1)
+    return mbuf_to_xgmii_ordered(pl->kni_block_encoders[st->queue], pl->kni_rx_rings[0],
+                                 get_vtop_pci_rx_ring(0, kni_port_params_array[st->port_id]->vtop_port));
+  return mbuf_to_xgmii(&pl->kni_encoders[0], pl->kni_rx_rings[0],
+                       get_vtop_pci_rx_ring(0, kni_port_params_array[st->port_id]->vtop_port));
+}
+
+static bool stage_kni_xgmii_rx_ready(const sched_stage *st) {
+  return !rte_ring_empty(port_pipelines[st->port_id]->kni_rx_rings[0]);
+}
+
+/* The model keeps being clocked while packets are inside it, so it is always ready */
+static unsigned stage_vtop(const sched_stage *st) {
+  return verilator_top_worker(st->queue);
+}
+
+/* What each stage waits on once its lcore is idle, for the ones that can be waited on */
+static unsigned stage_eth_rx_monitor(const sched_stage *st, rte_power_monitor_cond *pmc,
+                                     unsigned max) {
+  return max && rte_eth_get_monitor_addr(st->port_id, st->queue, pmc) == 0;
+}
+
+static unsigned stage_eth_tx_monitor(const sched_stage *st, rte_power_monitor_cond *pmc,
+                                     unsigned max) {
+  if (max)
+    sched_monitor_ring(port_pipelines[st->port_id]->eth_tx_rings[st->queue], pmc);
+  return max ? 1 : 0;
+}
+
+static unsigned stage_kni_rx_monitor(const sched_stage *st, rte_power_monitor_cond *pmc,
+                                     unsigned max) {
+  kni_port_params *p = kni_port_params_array[st->port_id];
+  unsigned n = 0;
+  uint16_t q;
+
+  if (host_be == HOST_BACKEND_KNI)
+    return 0;
+  for (q = 0; q < p->nb_host_queues && n < max; q++) {
+    if (rte_eth_get_monitor_addr(p->host_port_id, q, &pmc[n]) == 0)
+      n++;
+  }
+  return n;
+}
+
+static unsigned stage_kni_tx_monitor(const sched_stage *st, rte_power_monitor_cond *pmc,
+                                     unsigned max) {
+  if (host_be == HOST_BACKEND_KNI || max == 0)
+    return 0;
+  sched_monitor_ring(port_pipelines[st->port_id]->kni_tx_ring, pmc);
+  return 1;
+}
+
+static unsigned stage_eth_xgmii_tx_monitor(const sched_stage *st, rte_power_monitor_cond *pmc,
+                                           unsigned max) {
+  if (max)
+    sched_monitor_ring(get_vtop_eth_tx_ring(0, kni_port_params_array[st->port_id]->vtop_port), pmc);
+  return max ? 1 : 0;
+}
+
+static unsigned stage_eth_xgmii_rx_monitor(const sched_stage *st, rte_power_monitor_cond *pmc,
+                                           unsigned max) {
+  if (max)
+    sched_monitor_ring(port_pipelines[st->port_id]->eth_rx_rings[0], pmc);
+  return max ? 1 : 0;
+}
+
+static unsigned stage_kni_xgmii_tx_monitor(const sched_stage *st, rte_power_monitor_cond *pmc,
+                                           unsigned max) {
+  if (max)
+    sched_monitor_ring(get_vtop_pci_tx_ring(0, kni_port_params_array[st->port_id]->vtop_port), pmc);
+  return max ? 1 : 0;
+}
+
+static unsigned stage_kni_xgmii_rx_monitor(const sched_stage *st, rte_power_monitor_cond *pmc,
+                                           unsigned max) {
+  if (max)
+    sched_monitor_ring(port_pipelines[st->port_id]->kni_rx_rings[0], pmc);
+  return max ? 1 : 0;
+}
+
+/* Only a model stopped by --vtop-idle-cycles lets its lcore wait, for packets on any port */
+static unsigned stage_vtop_monitor(const sched_stage *st, rte_power_monitor_cond *pmc,
+                                   unsigned max) {
+  kni_port_params *p;
+  uint16_t port_id;
+  unsigned n = 0;
+
+  RTE_ETH_FOREACH_DEV(port_id) {
+    p = kni_port_params_array[port_id];
+    if (!p || n + 2 > max)
+      continue;
+
+    if (vtop_pkt_mode) {
+      sched_monitor_ring(port_pipelines[port_id]->eth_rx_rings[st->queue], &pmc[n++]);
+      sched_monitor_ring(port_pipelines[port_id]->kni_rx_rings[st->queue], &pmc[n++]);
+    } else {
+      sched_monitor_ring(get_vtop_eth_rx_ring(st->queue, p->vtop_port), &pmc[n++]);
+      sched_monitor_ring(get_vtop_pci_rx_ring(st->queue, p->vtop_port), &pmc[n++]);
+    }
+  }
+  return n;
+}
+
+static unsigned (*const stage_runs[LCORE_NB_STAGES])(const sched_stage *) = {
+  nullptr, stage_eth_rx, stage_eth_tx, stage_kni_rx, stage_kni_tx, stage_eth_xgmii_tx,
+  stage_eth_xgmii_rx, stage_kni_xgmii_tx, stage_kni_xgmii_rx, stage_vtop
+};
+static bool (*const stage_readies[LCORE_NB_STAGES])(const sched_stage *) = {
+  nullptr, nullptr, stage_eth_tx_ready, nullptr, stage_kni_tx_ready, stage_eth_xgmii_tx_ready,
+  stage_eth_xgmii_rx_ready, stage_kni_xgmii_tx_ready, stage_kni_xgmii_rx_ready, nullptr
+};
+static unsigned (*const stage_monitors[LCORE_NB_STAGES])(const sched_stage *,
+                                                         rte_power_monitor_cond *, unsigned) = {
+  nullptr, stage_eth_rx_monitor, stage_eth_tx_monitor, stage_kni_rx_monitor,
+  stage_kni_tx_monitor, stage_eth_xgmii_tx_monitor, stage_eth_xgmii_rx_monitor,
+  stage_kni_xgmii_tx_monitor, stage_kni_xgmii_rx_monitor, stage_vtop_monitor
+};
+
+/* Give a stage to the calling lcore */
+static void add_stage(sched_lcore *sched, enum lcore_rxtx role, uint16_t port_id, uint16_t queue) {
+  sched_stage st = {stage_runs[role], stage_readies[role], stage_monitors[role], port_id, queue,
+                    sched_weights[role], (uint8_t)role};
+
+  if (sched_add(sched, &st) < 0)
+    rte_exit(EXIT_FAILURE, "Lcore %u has more than %u stages\n", rte_lcore_id(),
+             SCHED_MAX_STAGES);
+
+  if (role == LCORE_VTOP)
+    RTE_LOG(INFO, APP, "Lcore %u is running Verilator sim %u\n", rte_lcore_id(), queue);
+  else if (role == LCORE_ETH_XGMII_TX || role == LCORE_ETH_XGMII_RX ||
+           role == LCORE_KNI_XGMII_TX || role == LCORE_KNI_XGMII_RX)
+    RTE_LOG(INFO, APP, "Lcore %u is running %s %u of port %u\n", rte_lcore_id(),
+            lcore_role_names[role], queue, port_id);
+  else if (role == LCORE_ETH_RX || role == LCORE_ETH_TX)
+    RTE_LOG(INFO, APP, "Lcore %u is running %s of port %u queue %u\n", rte_lcore_id(),
+            lcore_role_names[role], port_id, queue);
+  else
+    RTE_LOG(INFO, APP, "Lcore %u is running %s of port %u\n", rte_lcore_id(),
+            lcore_role_names[role], port_id);
+}
+
 int main_loop(__rte_unused void *arg) {
-  uint16_t i;
+  sched_lcore sched;
+  sched_idle idle;
+  kni_port_params *p;
+  uint16_t port_id, q;
+  unsigned shard;
   int32_t f_stop;
   int32_t f_pause;
   const unsigned lcore_id = rte_lcore_id();
-  enum lcore_rxtx {
-    LCORE_NONE,
-    LCORE_ETH_RX,
-    LCORE_ETH_TX,
-    LCORE_KNI_RX,
-    LCORE_KNI_TX,
-    LCORE_ETH_XGMII_TX,
-    LCORE_ETH_XGMII_RX,
-    LCORE_KNI_XGMII_TX,
-    LCORE_KNI_XGMII_RX,
-    LCORE_VTOP
-  };
-  enum lcore_rxtx flag = LCORE_NONE;
 
-  RTE_ETH_FOREACH_DEV(i) {
-    if (!kni_port_params_array[i])
+  /* Every stage given this lcore, which take turns if there's more than one */
+  sched.nb_stages = 0;
+  RTE_ETH_FOREACH_DEV(port_id) {
+    p = kni_port_params_array[port_id];
+    if (!p)
       continue;
-    if (kni_port_params_array[i]->lcore_eth_rx == (uint8_t)lcore_id) {
-      flag = LCORE_ETH_RX;
-      break;
-    } else if (kni_port_params_array[i]->lcore_eth_tx == (uint8_t)lcore_id) {
-      flag = LCORE_ETH_TX;
-      break;
-    } else if (kni_port_params_array[i]->lcore_kni_rx == (uint8_t)lcore_id) {
-      flag = LCORE_KNI_RX;
-      break;
-    } else if (kni_port_params_array[i]->lcore_kni_tx == (uint8_t)lcore_id) {
-      flag = LCORE_KNI_TX;
-      break;
-    } else if (kni_port_params_array[i]->lcore_eth_mii_tx ==
-               (uint8_t)lcore_id) {
-      flag = LCORE_ETH_XGMII_TX;
-      break;
-    } else if (kni_port_params_array[i]->lcore_eth_mii_rx ==
-               (uint8_t)lcore_id) {
-      flag = LCORE_ETH_XGMII_RX;
-      break;
-    } else if (kni_port_params_array[i]->lcore_kni_mii_tx ==
-               (uint8_t)lcore_id) {
-      flag = LCORE_KNI_XGMII_TX;
-      break;
-    } else if (kni_port_params_array[i]->lcore_kni_mii_rx ==
-               (uint8_t)lcore_id) {
-      flag = LCORE_KNI_XGMII_RX;
-      break;
-    } else if (kni_port_params_array[i]->lcore_worker_vtop ==
-               (uint8_t)lcore_id) {
-      flag = LCORE_VTOP;
-      break;
-    }
-  }
 
-  if (flag == LCORE_ETH_RX) {
-    RTE_LOG(INFO, APP, "Lcore %u is reading from port %d\n",
-            kni_port_params_array[i]->lcore_eth_rx,
-            kni_port_params_array[i]->port_id);
-    while (1) {
-      f_stop = __atomic_load_n(&kni_stop, __ATOMIC_RELAXED);
-      f_pause = __atomic_load_n(&kni_pause, __ATOMIC_RELAXED);
-      if (f_stop)
-        break;
-      if (f_pause)
-        continue;
-      eth_ingress(kni_port_params_array[i], eth_rx_ring);
+    for (q = 0; q < p->nb_eth_rxq; q++) {
+      if (p->lcore_eth_rxq[q] == lcore_id)
+        add_stage(&sched, LCORE_ETH_RX, port_id, q);
     }
-  } else if (flag == LCORE_ETH_TX) {
-    RTE_LOG(INFO, APP, "Lcore %u is writing to port %d\n",
-            kni_port_params_array[i]->lcore_eth_tx,
-            kni_port_params_array[i]->port_id);
-    while (1) {
-      f_stop = __atomic_load_n(&kni_stop, __ATOMIC_RELAXED);
-      f_pause = __atomic_load_n(&kni_pause, __ATOMIC_RELAXED);
-      if (f_stop)
-        break;
-      if (f_pause)
-        continue;
-      eth_egress(kni_port_params_array[i], eth_tx_ring);
-    }
-  } else if (flag == LCORE_KNI_RX) {
-    RTE_LOG(INFO, APP, "Lcore %u is reading from KNI\n",
-            kni_port_params_array[i]->lcore_kni_rx);
-    while (1) {
-      f_stop = __atomic_load_n(&kni_stop, __ATOMIC_RELAXED);
-      f_pause = __atomic_load_n(&kni_pause, __ATOMIC_RELAXED);
-      if (f_stop)
-        break;
-      if (f_pause)
-        continue;
-      kni_ingress(kni_port_params_array[i], kni_rx_ring);
+    for (q = 0; q < p->nb_eth_txq; q++) {
+      if (p->lcore_eth_txq[q] == lcore_id)
+        add_stage(&sched, LCORE_ETH_TX, port_id, q);
     }
-  } else if (flag == LCORE_KNI_TX) {
-    RTE_LOG(INFO, APP, "Lcore %u is writing to KNI\n",
-            kni_port_params_array[i]->lcore_kni_tx);
-    while (1) {
-      f_stop = __atomic_load_n(&kni_stop, __ATOMIC_RELAXED);
-      f_pause = __atomic_load_n(&kni_pause, __ATOMIC_RELAXED);
-      if (f_stop)
-        break;
-      if (f_pause)
-        continue;
-      kni_egress(kni_port_params_array[i], kni_tx_ring);
-    }
-  } else if (flag == LCORE_ETH_XGMII_TX) {
-    RTE_LOG(INFO, APP, "Lcore %u is converting Ethernet XGMII TX\n",
-            kni_port_params_array[i]->lcore_eth_mii_tx);
-    while (1) {
-      f_stop = __atomic_load_n(&kni_stop, __ATOMIC_RELAXED);
-      f_pause = __atomic_load_n(&kni_pause, __ATOMIC_RELAXED);
-      if (f_stop)
-        break;
-      if (f_pause)
-        continue;
-      xgmii_to_mbuf(get_vtop_eth_tx_ring(), eth_tx_ring, pktmbuf_pool, 0);
-    }
-  } else if (flag == LCORE_ETH_XGMII_RX) {
-    RTE_LOG(INFO, APP, "Lcore %u is converting Ethernet XGMII RX\n",
-            kni_port_params_array[i]->lcore_eth_mii_rx);
-    while (1) {
-      f_stop = __atomic_load_n(&kni_stop, __ATOMIC_RELAXED);
-      f_pause = __atomic_load_n(&kni_pause, __ATOMIC_RELAXED);
-      if (f_stop)
-        break;
-      if (f_pause)
-        continue;
-      mbuf_to_xgmii(eth_rx_ring, get_vtop_eth_rx_ring(), xgmii_pool, 0);
-    }
-  } else if (flag == LCORE_KNI_XGMII_TX) {
-    RTE_LOG(INFO, APP, "Lcore %u is converting PCIe XGMII TX\n",
-            kni_port_params_array[i]->lcore_kni_mii_tx);
-    while (1) {
-      f_stop = __atomic_load_n(&kni_stop, __ATOMIC_RELAXED);
-      f_pause = __atomic_load_n(&kni_pause, __ATOMIC_RELAXED);
-      if (f_stop)
-        break;
-      if (f_pause)
-        continue;
-      xgmii_to_mbuf(get_vtop_pci_tx_ring(), kni_tx_ring, pktmbuf_pool, 1);
-    }
-  } else if (flag == LCORE_KNI_XGMII_RX) {
-    RTE_LOG(INFO, APP, "Lcore %u is converting PCIe XGMII RX\n",
-            kni_port_params_array[i]->lcore_kni_mii_rx);
-    while (1) {
-      f_stop = __atomic_load_n(&kni_stop, __ATOMIC_RELAXED);
-      f_pause = __atomic_load_n(&kni_pause, __ATOMIC_RELAXED);
-      if (f_stop)
-        break;
-      if (f_pause)
-        continue;
-      mbuf_to_xgmii(kni_rx_ring, get_vtop_pci_rx_ring(), xgmii_pool, 1);
+    if (p->lcore_kni_rx == lcore_id)
+      add_stage(&sched, LCORE_KNI_RX, port_id, 0);
+    if (p->lcore_kni_tx == lcore_id)
+      add_stage(&sched, LCORE_KNI_TX, port_id, 0);
+
+    /* In packet mode the Verilator lcore does all of the XGMII conversion */
+    if (vtop_pkt_mode)
+      continue;
+    if (p->lcore_eth_mii_tx == lcore_id)
+      add_stage(&sched, LCORE_ETH_XGMII_TX, port_id, 0);
+    if (p->lcore_eth_mii_rx == lcore_id)
+      add_stage(&sched, LCORE_ETH_XGMII_RX, port_id, 0);
+    if (p->lcore_kni_mii_tx == lcore_id)
+      add_stage(&sched, LCORE_KNI_XGMII_TX, port_id, 0);
+    if (p->lcore_kni_mii_rx == lcore_id)
+      add_stage(&sched, LCORE_KNI_XGMII_RX, port_id, 0);
+
+    /* Further encoders run both directions on each of their lcores */
+    for (q = 1; q < nb_xgmii_encoders; q++) {
+      if (xgmii_enc_lcores[q] == lcore_id) {
+        add_stage(&sched, LCORE_ETH_XGMII_RX, port_id, q);
+        add_stage(&sched, LCORE_KNI_XGMII_RX, port_id, q);
+      }
     }
-  } else if (flag == LCORE_VTOP) {
-    RTE_LOG(INFO, APP, "Lcore %u is running Verilator sim\n",
-            kni_port_params_array[i]->lcore_worker_vtop);
-    while (1) {
-      f_stop = __atomic_load_n(&kni_stop, __ATOMIC_RELAXED);
-      f_pause = __atomic_load_n(&kni_pause, __ATOMIC_RELAXED);
-      if (f_stop)
-        break;
-      if (f_pause)
-        continue;
-      verilator_top_worker();
+    /* And so do further decoders */
+    for (q = 1; q < nb_xgmii_decoders; q++) {
+      if (xgmii_dec_lcores[q] == lcore_id) {
+        add_stage(&sched, LCORE_ETH_XGMII_TX, port_id, q);
+        add_stage(&sched, LCORE_KNI_XGMII_TX, port_id, q);
+      }
     }
-  } else
+  }
+  for (shard = 0; shard < nb_vtop_shards; shard++) {
+    if (vtop_shard_lcores[shard] == lcore_id)
+      add_stage(&sched, LCORE_VTOP, 0, shard);
+  }
+
+  if (sched.nb_stages == 0) {
     RTE_LOG(INFO, APP, "Lcore %u has nothing to do\n", lcore_id);
+    return 0;
+  }
+
+  /* A stage alone on its lcore runs flat out, as if it had no turns to take */
+  if (sched.nb_stages == 1) {
+    sched.stages[0].weight = 1;
+    lcore_roles[lcore_id] = (enum lcore_rxtx)sched.stages[0].role;
+  } else {
+    lcore_roles[lcore_id] = LCORE_SHARED;
+  }
+  sched_idle_init(&idle, &sched, idle_poll);
+
+  while (1) {
+    f_stop = __atomic_load_n(&kni_stop, __ATOMIC_RELAXED);
+    f_pause = __atomic_load_n(&kni_pause, __ATOMIC_RELAXED);
+    if (f_stop)
+      break;
+    if (f_pause) {
+      rte_delay_us_sleep(SCHED_IDLE_SLEEP_US);
+      continue;
+    }
+    __rte_unused cycle_poll poll;
+    sched_idle_update(&idle, sched_round(&sched));
+  }
 
   return 0;
 }
@@ -352,13 +754,159 @@ void print_usage(const char *prgname) {
   RTE_LOG(INFO, APP,
           "\nUsage: %s [EAL options] -- -p PORTMASK -P -m "
           "[--config (port,lcore_rx,lcore_tx,lcore_kthread...)"
-          "[,(port,lcore_rx,lcore_tx,lcore_kthread...)]]\n"
+          "[,(port,lcore_rx,lcore_tx,lcore_kthread...)]] "
+          "[--xgmii-flush-beats BEATS] [--xgmii-flush-us US] [--xgmii-dense] "
+          "[--vtop-pkt-mode] [--vtop-clocking edge|legacy] [--vtop-idle-cycles N]\n"
+          "[--vtop-idle-out drop|rle|keep] [--vtop-threads LCORE[,LCORE...]]\n"
+          "[--vtop-shards LCORE[,LCORE...]] [--eth-rx-queues LCORE[,LCORE...]] "
+          "[--eth-tx-queues LCORE[,LCORE...]]\n"
+          "[--host-backend virtio|tap|kni] [--host-queues N] [--host-gso] [--latency]\n"
+          "[--sched-weights STAGE=N[,STAGE=N...]] [--idle-poll] [--header-split N]\n"
+          "[--dut-sample N] [--dut-flow-sample N] [--dut-rule RULE]...\n"
+          "[--xgmii-encoders LCORE[,LCORE...]] [--xgmii-decoders LCORE[,LCORE...]]\n"
           "    -p PORTMASK: hex bitmask of ports to use\n"
           "    -P : enable promiscuous mode\n"
           "    -m : enable monitoring of port carrier state\n"
           "    --config (port,lcore_rx,lcore_tx,lcore_kthread...): "
-          "port and lcore configurations\n",
-          prgname);
+          "port and lcore configurations. Stages given the same lcore take "
+          "turns on it.\n"
+          "    --xgmii-flush-beats BEATS: flush partial XGMII decoder bursts "
+          "after BEATS beats (default %u)\n"
+          "    --xgmii-flush-us US: flush partial XGMII decoder bursts "
+          "after US microseconds (default %u)\n"
+          "    --xgmii-dense: start packets on lane 0 or 4 and end them in the "
+          "beat with their last bytes, with a deficit idle count gap\n"
+          "    --vtop-pkt-mode: convert packets to and from XGMII on the "
+          "Verilator lcore. The four XGMII lcores are left out of --config.\n"
+          "    --vtop-clocking edge|legacy: evaluate the model on clock edges "
+          "only, or on all ten time steps of a cycle as before (default edge)\n"
+          "    --vtop-idle-cycles N: stop clocking the model and sleep after N "
+          "cycles without traffic, until more arrives (default 0, never)\n"
+          "    --vtop-idle-out drop|rle|keep: leave idle beats out of the model "
+          "off the XGMII rings, send one beat per run of up to %u of them with "
+          "the run length, which the decoders count towards --xgmii-flush-beats, "
+          "or send them all (default drop)\n"
+          "    --vtop-threads LCORE[,LCORE...]: run the Verilated model's "
+          "worker threads on these lcores, one per thread the model was "
+          "built with beyond the first, each pinned to its own\n"
+          "    --vtop-shards LCORE[,LCORE...]: run another instance of the "
+          "model on each of these lcores, and spread flows over all of them. "
+          "Needs --vtop-pkt-mode.\n"
+          "    --eth-rx-queues LCORE[,LCORE...]: read one more RX queue of each "
+          "port on each of these lcores, with packets spread over the queues "
+          "by RSS\n"
+          "    --eth-tx-queues LCORE[,LCORE...]: write one more TX queue of "
+          "each port on each of these lcores\n"
+          "    --host-backend virtio|tap|kni: reach the host through virtio-user "
+          "over vhost-net, falling back to TAP without it, through TAP, or "
+          "through KNI (default virtio)\n"
+          "    --host-queues N: queue pairs on each virtio-user or TAP host "
+          "interface, up to %u (default 1)\n"
+          "    --host-gso: let the kernel send and receive TCP super-frames, "
+          "cut to its MSS on the way to the model and merged again on the way "
+          "back. Needs the virtio host backend.\n"
+          "    --latency: stamp packets at ingress and keep histograms of how "
+          "long they spend in each stage up to egress, through the model\n"
+          "    --sched-weights STAGE=N[,STAGE=N...]: run these stages up to N "
+          "times in a row when they share an lcore, while they have input. "
+          "Stages are eth-rx, eth-tx, host-rx, host-tx, eth-dec, eth-enc, "
+          "pcie-dec, pcie-enc and model (default 1, and %u for model)\n"
+          "    --idle-poll: keep polling flat out when an lcore has nothing to "
+          "do, instead of pausing, waiting on its rings and then sleeping\n"
+          "    --header-split N: only send the first N bytes of each packet "
+          "through the model, from %u up to %u, and put the rest back behind "
+          "what comes out (default 0, all of it)\n"
+          "    --dut-sample N: only send 1 in N packets through the model, and "
+          "the rest straight to the other side of the port\n"
+          "    --dut-flow-sample N: only send 1 in N flows through the model, "
+          "by a hash of their addresses and ports\n"
+          "    --dut-rule RULE: only send packets matching one of up to %u "
+          "rules through the model, either way round. A rule is a comma "
+          "separated list of proto=tcp|udp|sctp|icmp|N, src=ADDR[/LEN], "
+          "dst=ADDR[/LEN], sport=N[-M] and dport=N[-M].\n"
+          "    --xgmii-encoders LCORE[,LCORE...]: run one more XGMII encoder "
+          "for each direction of each port on each of these lcores, keeping "
+          "packets in order. Can't be used with --vtop-pkt-mode.\n"
+          "    --xgmii-decoders LCORE[,LCORE...]: run one more XGMII decoder "
+          "for each direction of each port on each of these lcores, splitting "
+          "the beats between packets and keeping them in order. Can't be used "
+          "with --vtop-pkt-mode.\n",
+          prgname, XGMII_FLUSH_BEATS, XGMII_FLUSH_US, VTOP_IDLE_RUN_MAX, HOST_MAX_QUEUES,
+          SCHED_MODEL_WEIGHT, (unsigned)KNI_ENET_HEADER_SIZE,
+          (unsigned)(MAX_PACKET_SZ - sizeof(split_trailer)), BYPASS_MAX_RULES);
+}
+
+/* Parse a comma separated list of up to max_lcores lcores */
+int parse_lcore_list(const char *arg, unsigned *lcores, uint32_t max_lcores, uint32_t *nb_lcores) {
+  char *end = NULL;
+  unsigned long lcore;
+
+  *nb_lcores = 0;
+  while (*arg != '\0') {
+    errno = 0;
+    lcore = strtoul(arg, &end, 10);
+    if (errno != 0 || end == arg || lcore >= RTE_MAX_LCORE ||
+        *nb_lcores == max_lcores)
+      return -1;
+    lcores[(*nb_lcores)++] = lcore;
+
+    if (*end == ',')
+      end++;
+    else if (*end != '\0')
+      return -1;
+    arg = end;
+  }
+
+  return *nb_lcores ? 0 : -1;
+}
+
+/* Convert decimal string to unsigned number. -1 is returned if error occurs */
+int parse_decimal(const char *arg, uint32_t *val) {
+  char *end = NULL;
+  unsigned long num;
+
+  errno = 0;
+  num = strtoul(arg, &end, 10);
+  if ((arg[0] == '\0') || (end == NULL) || (*end != '\0') || errno != 0 ||
+      num > UINT32_MAX)
+    return -1;
+
+  *val = (uint32_t)num;
+  return 0;
+}
+
+/* Parse a comma separated list of STAGE=WEIGHT, with stages named as in lcore_role_names */
+int parse_sched_weights(const char *arg) {
+  char *end = NULL;
+  const char *eq;
+  unsigned long weight;
+  unsigned role;
+
+  while (*arg != '\0') {
+    if ((eq = strchr(arg, '=')) == NULL)
+      return -1;
+    for (role = LCORE_ETH_RX; role < LCORE_NB_STAGES; role++) {
+      if (strlen(lcore_role_names[role]) == (size_t)(eq - arg) &&
+          !strncmp(arg, lcore_role_names[role], eq - arg))
+        break;
+    }
+    if (role == LCORE_NB_STAGES)
+      return -1;
+
+    errno = 0;
+    weight = strtoul(eq + 1, &end, 10);
+    if (errno != 0 || end == eq + 1 || weight == 0 || weight > UINT16_MAX)
+      return -1;
+    sched_weights[role] = weight;
+
+    if (*end == ',')
+      end++;
+    else if (*end != '\0')
+      return -1;
+    arg = end;
+  }
+
+  return 0;
 }
 
 /* Convert string to unsigned number. 0 is returned if error occurs */
@@ -383,6 +931,10 @@ void print_config(void) {
     RTE_LOG(DEBUG, APP, "Port ID: %d\n", p[i]->port_id);
     RTE_LOG(DEBUG, APP, "Eth Rx lcore ID: %u, Eth Tx lcore ID: %u\n",
             p[i]->lcore_eth_rx, p[i]->lcore_eth_tx);
+    for (j = 1; j < p[i]->nb_eth_rxq; j++)
+      RTE_LOG(DEBUG, APP, "Eth Rx queue %u lcore ID: %u\n", j, p[i]->lcore_eth_rxq[j]);
+    for (j = 1; j < p[i]->nb_eth_txq; j++)
+      RTE_LOG(DEBUG, APP, "Eth Tx queue %u lcore ID: %u\n", j, p[i]->lcore_eth_txq[j]);
     RTE_LOG(DEBUG, APP, "Kni Rx lcore ID: %u, Kni Tx lcore ID: %u\n",
             p[i]->lcore_kni_rx, p[i]->lcore_kni_tx);
     RTE_LOG(DEBUG, APP, "Eth MII Rx lcore ID: %u, Eth MII Tx lcore ID: %u\n",
@@ -393,6 +945,12 @@ void print_config(void) {
     for (j = 0; j < p[i]->nb_lcore_k; j++)
       RTE_LOG(DEBUG, APP, "Kernel thread lcore ID: %u\n", p[i]->lcore_k[j]);
   }
+  for (i = 1; i < nb_vtop_shards; i++)
+    RTE_LOG(DEBUG, APP, "Vtop shard %u lcore ID: %u\n", i, vtop_shard_lcores[i]);
+  for (i = 1; i < nb_xgmii_encoders; i++)
+    RTE_LOG(DEBUG, APP, "XGMII encoder %u lcore ID: %u\n", i, xgmii_enc_lcores[i]);
+  for (i = 1; i < nb_xgmii_decoders; i++)
+    RTE_LOG(DEBUG, APP, "XGMII decoder %u lcore ID: %u\n", i, xgmii_dec_lcores[i]);
 }
 
 int parse_config(const char *arg) {
@@ -454,11 +1012,35 @@ int parse_config(const char *arg) {
     kni_port_params_array[port_id]->lcore_eth_tx = (uint8_t)int_fld[i++];
     kni_port_params_array[port_id]->lcore_kni_rx = (uint8_t)int_fld[i++];
     kni_port_params_array[port_id]->lcore_kni_tx = (uint8_t)int_fld[i++];
-    kni_port_params_array[port_id]->lcore_eth_mii_rx = (uint8_t)int_fld[i++];
-    kni_port_params_array[port_id]->lcore_eth_mii_tx = (uint8_t)int_fld[i++];
-    kni_port_params_array[port_id]->lcore_kni_mii_rx = (uint8_t)int_fld[i++];
-    kni_port_params_array[port_id]->lcore_kni_mii_tx = (uint8_t)int_fld[i++];
-    kni_port_params_array[port_id]->lcore_worker_vtop = (uint8_t)int_fld[i++];
+
+    /* Queues past the first are read and written on the --eth-*-queues lcores */
+    kni_port_params_array[port_id]->nb_eth_rxq = nb_eth_rxq;
+    kni_port_params_array[port_id]->lcore_eth_rxq[0] = kni_port_params_array[port_id]->lcore_eth_rx;
+    for (j = 1; j < (int)nb_eth_rxq; j++)
+      kni_port_params_array[port_id]->lcore_eth_rxq[j] = eth_rxq_lcores[j];
+    kni_port_params_array[port_id]->nb_eth_txq = nb_eth_txq;
+    kni_port_params_array[port_id]->lcore_eth_txq[0] = kni_port_params_array[port_id]->lcore_eth_tx;
+    for (j = 1; j < (int)nb_eth_txq; j++)
+      kni_port_params_array[port_id]->lcore_eth_txq[j] = eth_txq_lcores[j];
+
+    if (vtop_pkt_mode) {
+      /* The Verilator lcore does all of the XGMII conversion */
+      kni_port_params_array[port_id]->lcore_worker_vtop = (uint8_t)int_fld[i++];
+      kni_port_params_array[port_id]->lcore_eth_mii_rx =
+          kni_port_params_array[port_id]->lcore_worker_vtop;
+      kni_port_params_array[port_id]->lcore_eth_mii_tx =
+          kni_port_params_array[port_id]->lcore_worker_vtop;
+      kni_port_params_array[port_id]->lcore_kni_mii_rx =
+          kni_port_params_array[port_id]->lcore_worker_vtop;
+      kni_port_params_array[port_id]->lcore_kni_mii_tx =
+          kni_port_params_array[port_id]->lcore_worker_vtop;
+    } else {
+      kni_port_params_array[port_id]->lcore_eth_mii_rx = (uint8_t)int_fld[i++];
+      kni_port_params_array[port_id]->lcore_eth_mii_tx = (uint8_t)int_fld[i++];
+      kni_port_params_array[port_id]->lcore_kni_mii_rx = (uint8_t)int_fld[i++];
+      kni_port_params_array[port_id]->lcore_kni_mii_tx = (uint8_t)int_fld[i++];
+      kni_port_params_array[port_id]->lcore_worker_vtop = (uint8_t)int_fld[i++];
+    }
     if (kni_port_params_array[port_id]->lcore_kni_mii_tx >= RTE_MAX_LCORE ||
         kni_port_params_array[port_id]->lcore_worker_vtop >= RTE_MAX_LCORE) {
       printf("lcore_eth_rx %u or lcore_eth_tx %u ID could not "
@@ -489,6 +1071,8 @@ fail:
 
 int validate_parameters(uint32_t portmask) {
   uint32_t i;
+  uint16_t port_id, nb_ports = 0;
+  unsigned lcore_vtop = RTE_MAX_LCORE;
 
   if (!portmask) {
     printf("No port configured in port mask\n");
@@ -520,16 +1104,157 @@ int validate_parameters(uint32_t portmask) {
                kni_port_params_array[i]->port_id);
   }
 
+  /* Ports are wired to the model's in order of port ID, and all share its lcore */
+  RTE_ETH_FOREACH_DEV(port_id) {
+    if (!kni_port_params_array[port_id])
+      continue;
+    if (lcore_vtop == RTE_MAX_LCORE)
+      lcore_vtop = kni_port_params_array[port_id]->lcore_worker_vtop;
+    else if (kni_port_params_array[port_id]->lcore_worker_vtop != lcore_vtop)
+      rte_exit(EXIT_FAILURE, "Port %u needs the same Verilator lcore as the others\n", port_id);
+
+    kni_port_params_array[port_id]->vtop_port = nb_ports++;
+  }
+  vtop_shard_lcores[0] = lcore_vtop;
+  if (nb_ports != FESTOON_NUM_PORTS)
+    rte_exit(EXIT_FAILURE, "The model was built for %u ports, but %u are configured\n",
+             FESTOON_NUM_PORTS, nb_ports);
+
+  /* Verilator threads need lcores of their own, one per extra model thread */
+  if (nb_vtop_threads + 1 != FESTOON_VTOP_THREADS)
+    rte_exit(EXIT_FAILURE, "The model was built for %u threads, so --vtop-threads "
+                           "needs %u lcores\n",
+             FESTOON_VTOP_THREADS, FESTOON_VTOP_THREADS - 1);
+
+  for (i = 0; i < nb_vtop_threads; i++) {
+    if (!rte_lcore_is_enabled(vtop_thread_lcores[i]) ||
+        vtop_thread_lcores[i] == rte_get_main_lcore())
+      rte_exit(EXIT_FAILURE, "lcore id %u for Verilator threads not enabled, "
+                             "or is the main lcore\n", vtop_thread_lcores[i]);
+
+    RTE_ETH_FOREACH_DEV(port_id) {
+      if (kni_port_params_array[port_id] &&
+          kni_port_params_array[port_id]->lcore_worker_vtop == vtop_thread_lcores[i])
+        rte_exit(EXIT_FAILURE, "lcore id %u is already running Verilator\n",
+                 vtop_thread_lcores[i]);
+    }
+  }
+
+  /* Further Ethernet queues may share lcores with other stages, which take turns */
+  for (i = 1; i < nb_eth_rxq + nb_eth_txq - 1; i++) {
+    unsigned lcore = i < nb_eth_rxq ? eth_rxq_lcores[i] : eth_txq_lcores[i - nb_eth_rxq + 1];
+
+    if (!rte_lcore_is_enabled(lcore) || lcore == rte_get_main_lcore())
+      rte_exit(EXIT_FAILURE, "lcore id %u for Ethernet queue not enabled, "
+                             "or is the main lcore\n", lcore);
+  }
+
+  /* KNI was dropped in DPDK 23.11, and has one queue per interface */
+  if (host_be == HOST_BACKEND_KNI) {
+#ifndef RTE_LIB_KNI
+    rte_exit(EXIT_FAILURE, "This DPDK was built without KNI\n");
+#endif
+    if (nb_host_queues > 1)
+      rte_exit(EXIT_FAILURE, "--host-queues needs a virtio or tap host backend\n");
+  } else {
+    RTE_ETH_FOREACH_DEV(port_id) {
+      if (kni_port_params_array[port_id] && kni_port_params_array[port_id]->nb_lcore_k)
+        RTE_LOG(WARNING, APP, "Kernel thread lcores of port %u are only used by KNI\n", port_id);
+    }
+  }
+
+  /* Only vhost-net takes super-frames without cutting them up in software */
+  if (host_gso && host_be != HOST_BACKEND_VIRTIO)
+    rte_exit(EXIT_FAILURE, "--host-gso needs the virtio host backend\n");
+
+  /* Shards convert their own packets, and each would need threads of its own */
+  if (nb_vtop_shards > 1 && !vtop_pkt_mode)
+    rte_exit(EXIT_FAILURE, "--vtop-shards needs --vtop-pkt-mode\n");
+  if (nb_vtop_shards > 1 && FESTOON_VTOP_THREADS > 1)
+    rte_exit(EXIT_FAILURE, "--vtop-shards needs a model built for one thread\n");
+
+  for (i = 1; i < nb_vtop_shards; i++) {
+    if (!rte_lcore_is_enabled(vtop_shard_lcores[i]) ||
+        vtop_shard_lcores[i] == rte_get_main_lcore())
+      rte_exit(EXIT_FAILURE, "lcore id %u for Verilator shard not enabled, "
+                             "or is the main lcore\n", vtop_shard_lcores[i]);
+  }
+
+  /* In packet mode the model's lcore encodes for itself */
+  if (nb_xgmii_encoders > 1 && vtop_pkt_mode)
+    rte_exit(EXIT_FAILURE, "--xgmii-encoders can't be used with --vtop-pkt-mode\n");
+  for (i = 1; i < nb_xgmii_encoders; i++) {
+    if (!rte_lcore_is_enabled(xgmii_enc_lcores[i]) ||
+        xgmii_enc_lcores[i] == rte_get_main_lcore())
+      rte_exit(EXIT_FAILURE, "lcore id %u for XGMII encoder not enabled, "
+                             "or is the main lcore\n", xgmii_enc_lcores[i]);
+  }
+
+  /* And decodes for itself */
+  if (nb_xgmii_decoders > 1 && vtop_pkt_mode)
+    rte_exit(EXIT_FAILURE, "--xgmii-decoders can't be used with --vtop-pkt-mode\n");
+  for (i = 1; i < nb_xgmii_decoders; i++) {
+    if (!rte_lcore_is_enabled(xgmii_dec_lcores[i]) ||
+        xgmii_dec_lcores[i] == rte_get_main_lcore())
+      rte_exit(EXIT_FAILURE, "lcore id %u for XGMII decoder not enabled, "
+                             "or is the main lcore\n", xgmii_dec_lcores[i]);
+  }
   return 0;
 }
 
 #define CMDLINE_OPT_CONFIG "config"
+#define CMDLINE_OPT_XGMII_FLUSH_BEATS "xgmii-flush-beats"
+#define CMDLINE_OPT_XGMII_FLUSH_US "xgmii-flush-us"
+#define CMDLINE_OPT_XGMII_DENSE "xgmii-dense"
+#define CMDLINE_OPT_VTOP_PKT_MODE "vtop-pkt-mode"
+#define CMDLINE_OPT_VTOP_CLOCKING "vtop-clocking"
+#define CMDLINE_OPT_VTOP_IDLE_CYCLES "vtop-idle-cycles"
+#define CMDLINE_OPT_VTOP_IDLE_OUT "vtop-idle-out"
+#define CMDLINE_OPT_VTOP_THREADS "vtop-threads"
+#define CMDLINE_OPT_VTOP_SHARDS "vtop-shards"
+#define CMDLINE_OPT_ETH_RX_QUEUES "eth-rx-queues"
+#define CMDLINE_OPT_ETH_TX_QUEUES "eth-tx-queues"
+#define CMDLINE_OPT_HOST_BACKEND "host-backend"
+#define CMDLINE_OPT_HOST_QUEUES "host-queues"
+#define CMDLINE_OPT_HOST_GSO "host-gso"
+#define CMDLINE_OPT_LATENCY "latency"
+#define CMDLINE_OPT_SCHED_WEIGHTS "sched-weights"
+#define CMDLINE_OPT_IDLE_POLL "idle-poll"
+#define CMDLINE_OPT_HEADER_SPLIT "header-split"
+#define CMDLINE_OPT_DUT_SAMPLE "dut-sample"
+#define CMDLINE_OPT_DUT_FLOW_SAMPLE "dut-flow-sample"
+#define CMDLINE_OPT_DUT_RULE "dut-rule"
+#define CMDLINE_OPT_XGMII_ENCODERS "xgmii-encoders"
+#define CMDLINE_OPT_XGMII_DECODERS "xgmii-decoders"
 
 /* Parse the arguments given in the command line of the application */
 int parse_args(int argc, char **argv) {
   int opt, longindex, ret = 0;
-  const char *prgname = argv[0];
+  const char *prgname = argv[0], *config = NULL;
   struct option longopts[] = {{CMDLINE_OPT_CONFIG, required_argument, NULL, 0},
+                              {CMDLINE_OPT_XGMII_FLUSH_BEATS, required_argument, NULL, 0},
+                              {CMDLINE_OPT_XGMII_FLUSH_US, required_argument, NULL, 0},
+                              {CMDLINE_OPT_XGMII_DENSE, no_argument, NULL, 0},
+                              {CMDLINE_OPT_VTOP_PKT_MODE, no_argument, NULL, 0},
+                              {CMDLINE_OPT_VTOP_CLOCKING, required_argument, NULL, 0},
+                              {CMDLINE_OPT_VTOP_IDLE_CYCLES, required_argument, NULL, 0},
+                              {CMDLINE_OPT_VTOP_IDLE_OUT, required_argument, NULL, 0},
+                              {CMDLINE_OPT_VTOP_THREADS, required_argument, NULL, 0},
+                              {CMDLINE_OPT_VTOP_SHARDS, required_argument, NULL, 0},
+                              {CMDLINE_OPT_ETH_RX_QUEUES, required_argument, NULL, 0},
+                              {CMDLINE_OPT_ETH_TX_QUEUES, required_argument, NULL, 0},
+                              {CMDLINE_OPT_HOST_BACKEND, required_argument, NULL, 0},
+                              {CMDLINE_OPT_HOST_QUEUES, required_argument, NULL, 0},
+                              {CMDLINE_OPT_HOST_GSO, no_argument, NULL, 0},
+                              {CMDLINE_OPT_LATENCY, no_argument, NULL, 0},
+                              {CMDLINE_OPT_SCHED_WEIGHTS, required_argument, NULL, 0},
+                              {CMDLINE_OPT_IDLE_POLL, no_argument, NULL, 0},
+                              {CMDLINE_OPT_HEADER_SPLIT, required_argument, NULL, 0},
+                              {CMDLINE_OPT_DUT_SAMPLE, required_argument, NULL, 0},
+                              {CMDLINE_OPT_DUT_FLOW_SAMPLE, required_argument, NULL, 0},
+                              {CMDLINE_OPT_DUT_RULE, required_argument, NULL, 0},
+                              {CMDLINE_OPT_XGMII_ENCODERS, required_argument, NULL, 0},
+                              {CMDLINE_OPT_XGMII_DECODERS, required_argument, NULL, 0},
                               {NULL, 0, NULL, 0}};
 
   /* Disable printing messages within getopt() */
@@ -550,9 +1275,178 @@ int parse_args(int argc, char **argv) {
     case 0:
       if (!strncmp(longopts[longindex].name, CMDLINE_OPT_CONFIG,
                    sizeof(CMDLINE_OPT_CONFIG))) {
-        ret = parse_config(optarg);
-        if (ret) {
-          printf("Invalid config\n");
+        /* Parsed once all options are known, since they change its layout */
+        config = optarg;
+      } else if (!strncmp(longopts[longindex].name, CMDLINE_OPT_VTOP_PKT_MODE,
+                          sizeof(CMDLINE_OPT_VTOP_PKT_MODE))) {
+        vtop_pkt_mode = 1;
+      } else if (!strncmp(longopts[longindex].name, CMDLINE_OPT_VTOP_CLOCKING,
+                          sizeof(CMDLINE_OPT_VTOP_CLOCKING))) {
+        if (!strcmp(optarg, "edge")) {
+          vtop_clocking = VTOP_CLOCK_EDGE;
+        } else if (!strcmp(optarg, "legacy")) {
+          vtop_clocking = VTOP_CLOCK_LEGACY;
+        } else {
+          printf("Invalid Verilator clocking %s\n", optarg);
+          print_usage(prgname);
+          return -1;
+        }
+      } else if (!strncmp(longopts[longindex].name, CMDLINE_OPT_XGMII_DENSE,
+                          sizeof(CMDLINE_OPT_XGMII_DENSE))) {
+        xgmii_dense = 1;
+      } else if (!strncmp(longopts[longindex].name, CMDLINE_OPT_VTOP_THREADS,
+                          sizeof(CMDLINE_OPT_VTOP_THREADS))) {
+        if (parse_lcore_list(optarg, vtop_thread_lcores, RTE_MAX_LCORE, &nb_vtop_threads) < 0) {
+          printf("Invalid Verilator thread lcores\n");
+          print_usage(prgname);
+          return -1;
+        }
+      } else if (!strncmp(longopts[longindex].name, CMDLINE_OPT_VTOP_SHARDS,
+                          sizeof(CMDLINE_OPT_VTOP_SHARDS))) {
+        /* Shard 0 runs on the Verilator lcore from --config */
+        if (parse_lcore_list(optarg, &vtop_shard_lcores[1], VTOP_MAX_SHARDS - 1,
+                             &nb_vtop_shards) < 0) {
+          printf("Invalid Verilator shard lcores\n");
+          print_usage(prgname);
+          return -1;
+        }
+        nb_vtop_shards++;
+      } else if (!strncmp(longopts[longindex].name, CMDLINE_OPT_XGMII_ENCODERS,
+                          sizeof(CMDLINE_OPT_XGMII_ENCODERS))) {
+        /* Encoder 0 runs on the XGMII lcores from --config */
+        if (parse_lcore_list(optarg, &xgmii_enc_lcores[1], XGMII_MAX_ENCODERS - 1,
+                             &nb_xgmii_encoders) < 0) {
+          printf("Invalid XGMII encoder lcores\n");
+          print_usage(prgname);
+          return -1;
+        }
+        nb_xgmii_encoders++;
+      } else if (!strncmp(longopts[longindex].name, CMDLINE_OPT_XGMII_DECODERS,
+                          sizeof(CMDLINE_OPT_XGMII_DECODERS))) {
+        /* Decoder 0 runs on the XGMII lcores from --config */
+        if (parse_lcore_list(optarg, &xgmii_dec_lcores[1], XGMII_MAX_DECODERS - 1,
+                             &nb_xgmii_decoders) < 0) {
+          printf("Invalid XGMII decoder lcores\n");
+          print_usage(prgname);
+          return -1;
+        }
+        nb_xgmii_decoders++;
+      } else if (!strncmp(longopts[longindex].name, CMDLINE_OPT_ETH_RX_QUEUES,
+                          sizeof(CMDLINE_OPT_ETH_RX_QUEUES))) {
+        /* Queue 0 is read on the RX lcore from --config */
+        if (parse_lcore_list(optarg, &eth_rxq_lcores[1], ETH_MAX_QUEUES - 1, &nb_eth_rxq) < 0) {
+          printf("Invalid Ethernet RX queue lcores\n");
+          print_usage(prgname);
+          return -1;
+        }
+        nb_eth_rxq++;
+      } else if (!strncmp(longopts[longindex].name, CMDLINE_OPT_ETH_TX_QUEUES,
+                          sizeof(CMDLINE_OPT_ETH_TX_QUEUES))) {
+        /* Queue 0 is written on the TX lcore from --config */
+        if (parse_lcore_list(optarg, &eth_txq_lcores[1], ETH_MAX_QUEUES - 1, &nb_eth_txq) < 0) {
+          printf("Invalid Ethernet TX queue lcores\n");
+          print_usage(prgname);
+          return -1;
+        }
+        nb_eth_txq++;
+      } else if (!strncmp(longopts[longindex].name, CMDLINE_OPT_HOST_BACKEND,
+                          sizeof(CMDLINE_OPT_HOST_BACKEND))) {
+        if (!strcmp(optarg, "virtio")) {
+          host_be = HOST_BACKEND_VIRTIO;
+        } else if (!strcmp(optarg, "tap")) {
+          host_be = HOST_BACKEND_TAP;
+        } else if (!strcmp(optarg, "kni")) {
+          host_be = HOST_BACKEND_KNI;
+        } else {
+          printf("Invalid host backend %s\n", optarg);
+          print_usage(prgname);
+          return -1;
+        }
+      } else if (!strncmp(longopts[longindex].name, CMDLINE_OPT_HOST_QUEUES,
+                          sizeof(CMDLINE_OPT_HOST_QUEUES))) {
+        if (parse_decimal(optarg, &nb_host_queues) < 0 || nb_host_queues == 0 ||
+            nb_host_queues > HOST_MAX_QUEUES) {
+          printf("Invalid host queues\n");
+          print_usage(prgname);
+          return -1;
+        }
+      } else if (!strncmp(longopts[longindex].name, CMDLINE_OPT_HOST_GSO,
+                          sizeof(CMDLINE_OPT_HOST_GSO))) {
+        host_gso = 1;
+      } else if (!strncmp(longopts[longindex].name, CMDLINE_OPT_LATENCY,
+                          sizeof(CMDLINE_OPT_LATENCY))) {
+        latency_on = 1;
+      } else if (!strncmp(longopts[longindex].name, CMDLINE_OPT_IDLE_POLL,
+                          sizeof(CMDLINE_OPT_IDLE_POLL))) {
+        idle_poll = 1;
+      } else if (!strncmp(longopts[longindex].name, CMDLINE_OPT_HEADER_SPLIT,
+                          sizeof(CMDLINE_OPT_HEADER_SPLIT))) {
+        if (parse_decimal(optarg, &header_split) < 0 ||
+            (header_split != 0 && (header_split < KNI_ENET_HEADER_SIZE ||
+                                   header_split > MAX_PACKET_SZ - sizeof(split_trailer)))) {
+          printf("Invalid header split length\n");
+          print_usage(prgname);
+          return -1;
+        }
+      } else if (!strncmp(longopts[longindex].name, CMDLINE_OPT_DUT_SAMPLE,
+                          sizeof(CMDLINE_OPT_DUT_SAMPLE))) {
+        if (parse_decimal(optarg, &bypass_conf.sample) < 0 || bypass_conf.sample == 0) {
+          printf("Invalid packet sample rate\n");
+          print_usage(prgname);
+          return -1;
+        }
+      } else if (!strncmp(longopts[longindex].name, CMDLINE_OPT_DUT_FLOW_SAMPLE,
+                          sizeof(CMDLINE_OPT_DUT_FLOW_SAMPLE))) {
+        if (parse_decimal(optarg, &bypass_conf.flow_sample) < 0 || bypass_conf.flow_sample == 0) {
+          printf("Invalid flow sample rate\n");
+          print_usage(prgname);
+          return -1;
+        }
+      } else if (!strncmp(longopts[longindex].name, CMDLINE_OPT_DUT_RULE,
+                          sizeof(CMDLINE_OPT_DUT_RULE))) {
+        if (bypass_add_rule(optarg) < 0) {
+          printf("Invalid rule %s\n", optarg);
+          print_usage(prgname);
+          return -1;
+        }
+      } else if (!strncmp(longopts[longindex].name, CMDLINE_OPT_SCHED_WEIGHTS,
+                          sizeof(CMDLINE_OPT_SCHED_WEIGHTS))) {
+        if (parse_sched_weights(optarg) < 0) {
+          printf("Invalid stage weights\n");
+          print_usage(prgname);
+          return -1;
+        }
+      } else if (!strncmp(longopts[longindex].name, CMDLINE_OPT_VTOP_IDLE_OUT,
+                          sizeof(CMDLINE_OPT_VTOP_IDLE_OUT))) {
+        if (!strcmp(optarg, "drop")) {
+          vtop_idle_out = VTOP_IDLE_OUT_DROP;
+        } else if (!strcmp(optarg, "rle")) {
+          vtop_idle_out = VTOP_IDLE_OUT_RLE;
+        } else if (!strcmp(optarg, "keep")) {
+          vtop_idle_out = VTOP_IDLE_OUT_KEEP;
+        } else {
+          printf("Invalid idle output mode %s\n", optarg);
+          print_usage(prgname);
+          return -1;
+        }
+      } else if (!strncmp(longopts[longindex].name, CMDLINE_OPT_VTOP_IDLE_CYCLES,
+                          sizeof(CMDLINE_OPT_VTOP_IDLE_CYCLES))) {
+        if (parse_decimal(optarg, &vtop_idle_cycles) < 0) {
+          printf("Invalid Verilator idle cycles\n");
+          print_usage(prgname);
+          return -1;
+        }
+      } else if (!strncmp(longopts[longindex].name, CMDLINE_OPT_XGMII_FLUSH_BEATS,
+                          sizeof(CMDLINE_OPT_XGMII_FLUSH_BEATS))) {
+        if (parse_decimal(optarg, &xgmii_flush_beats) < 0) {
+          printf("Invalid XGMII flush beats\n");
+          print_usage(prgname);
+          return -1;
+        }
+      } else if (!strncmp(longopts[longindex].name, CMDLINE_OPT_XGMII_FLUSH_US,
+                          sizeof(CMDLINE_OPT_XGMII_FLUSH_US))) {
+        if (parse_decimal(optarg, &xgmii_flush_us) < 0) {
+          printf("Invalid XGMII flush timeout\n");
           print_usage(prgname);
           return -1;
         }
@@ -564,6 +1458,15 @@ int parse_args(int argc, char **argv) {
     }
   }
 
+  if (config != NULL) {
+    ret = parse_config(config);
+    if (ret) {
+      printf("Invalid config\n");
+      print_usage(prgname);
+      return -1;
+    }
+  }
+
   /* Check that options were parsed ok */
   if (validate_parameters(ports_mask) < 0) {
     print_usage(prgname);
@@ -573,6 +1476,7 @@ int parse_args(int argc, char **argv) {
   return ret;
 }
 
+#ifdef RTE_LIB_KNI
 /* Initialize KNI subsystem */
 void init_kni(void) {
   unsigned int num_of_kni_ports = 0, i;
@@ -588,59 +1492,96 @@ void init_kni(void) {
   /* Invoke rte KNI init to preallocate the ports */
   rte_kni_init(num_of_kni_ports);
 }
+#endif
 
-/* Initialise a single port on an Ethernet device */
-void init_port(uint16_t port) {
+/* Configure a port and set up each of its RX and TX queues, with flows spread
+   over the RX queues by RSS when there is more than one. Used when the port is
+   first brought up, and again when its MTU changes. */
+static int setup_port_queues(uint16_t port, struct rte_eth_conf *conf) {
   int ret;
+  uint16_t q, nb_rxq = nb_eth_rxq, nb_txq = nb_eth_txq;
   uint16_t nb_rxd = NB_RXD;
   uint16_t nb_txd = NB_TXD;
   struct rte_eth_dev_info dev_info;
   struct rte_eth_rxconf rxq_conf;
   struct rte_eth_txconf txq_conf;
-  struct rte_eth_conf local_port_conf = port_conf;
-
-  /* Initialise device and RX/TX queues */
-  RTE_LOG(INFO, APP, "Initialising port %u ...\n", (unsigned)port);
-  fflush(stdout);
 
   ret = rte_eth_dev_info_get(port, &dev_info);
-  if (ret != 0)
-    rte_exit(EXIT_FAILURE, "Error during getting device (port %u) info: %s\n",
-             port, strerror(-ret));
+  if (ret != 0) {
+    RTE_LOG(ERR, APP, "Error during getting device (port %u) info: %s\n",
+            port, strerror(-ret));
+    return ret;
+  }
 
   if (dev_info.tx_offload_capa & RTE_ETH_TX_OFFLOAD_MBUF_FAST_FREE)
-    local_port_conf.txmode.offloads |= RTE_ETH_TX_OFFLOAD_MBUF_FAST_FREE;
-  ret = rte_eth_dev_configure(port, 1, 1, &local_port_conf);
-  if (ret < 0)
-    rte_exit(EXIT_FAILURE, "Could not configure port%u (%d)\n", (unsigned)port,
-             ret);
+    conf->txmode.offloads |= RTE_ETH_TX_OFFLOAD_MBUF_FAST_FREE;
+
+  if (nb_rxq > dev_info.max_rx_queues || nb_txq > dev_info.max_tx_queues) {
+    RTE_LOG(ERR, APP, "Port %u has at most %u RX and %u TX queues\n", port,
+            dev_info.max_rx_queues, dev_info.max_tx_queues);
+    return -EINVAL;
+  }
+
+  /* Spread flows over the RX queues by their addresses and ports */
+  if (nb_rxq > 1) {
+    conf->rxmode.mq_mode = RTE_ETH_MQ_RX_RSS;
+    conf->rx_adv_conf.rss_conf.rss_key = NULL;
+    conf->rx_adv_conf.rss_conf.rss_hf =
+        (RTE_ETH_RSS_IP | RTE_ETH_RSS_TCP | RTE_ETH_RSS_UDP) & dev_info.flow_type_rss_offloads;
+  }
+
+  ret = rte_eth_dev_configure(port, nb_rxq, nb_txq, conf);
+  if (ret < 0) {
+    RTE_LOG(ERR, APP, "Could not configure port%u (%d)\n", (unsigned)port, ret);
+    return ret;
+  }
 
   ret = rte_eth_dev_adjust_nb_rx_tx_desc(port, &nb_rxd, &nb_txd);
-  if (ret < 0)
-    rte_exit(EXIT_FAILURE,
-             "Could not adjust number of descriptors "
-             "for port%u (%d)\n",
-             (unsigned)port, ret);
+  if (ret < 0) {
+    RTE_LOG(ERR, APP, "Could not adjust number of descriptors for port%u (%d)\n",
+            (unsigned)port, ret);
+    return ret;
+  }
 
   rxq_conf = dev_info.default_rxconf;
-  rxq_conf.offloads = local_port_conf.rxmode.offloads;
-  ret = rte_eth_rx_queue_setup(port, 0, nb_rxd, rte_eth_dev_socket_id(port),
-                               &rxq_conf, pktmbuf_pool);
-  if (ret < 0)
-    rte_exit(EXIT_FAILURE,
-             "Could not setup up RX queue for "
-             "port%u (%d)\n",
-             (unsigned)port, ret);
+  rxq_conf.offloads = conf->rxmode.offloads;
+  for (q = 0; q < nb_rxq; q++) {
+    ret = rte_eth_rx_queue_setup(port, q, nb_rxd, rte_eth_dev_socket_id(port),
+                                 &rxq_conf, pktmbuf_pool);
+    if (ret < 0) {
+      RTE_LOG(ERR, APP, "Could not setup up RX queue %u for port%u (%d)\n", q,
+              (unsigned)port, ret);
+      return ret;
+    }
+  }
 
   txq_conf = dev_info.default_txconf;
-  txq_conf.offloads = local_port_conf.txmode.offloads;
-  ret = rte_eth_tx_queue_setup(port, 0, nb_txd, rte_eth_dev_socket_id(port),
-                               &txq_conf);
+  txq_conf.offloads = conf->txmode.offloads;
+  for (q = 0; q < nb_txq; q++) {
+    ret = rte_eth_tx_queue_setup(port, q, nb_txd, rte_eth_dev_socket_id(port),
+                                 &txq_conf);
+    if (ret < 0) {
+      RTE_LOG(ERR, APP, "Could not setup up TX queue %u for port%u (%d)\n", q,
+              (unsigned)port, ret);
+      return ret;
+    }
+  }
+
+  return 0;
+}
+
+/* Initialise a single port on an Ethernet device */
+void init_port(uint16_t port) {
+  int ret;
+  struct rte_eth_conf local_port_conf = port_conf;
+
+  /* Initialise device and RX/TX queues */
+  RTE_LOG(INFO, APP, "Initialising port %u ...\n", (unsigned)port);
+  fflush(stdout);
+
+  ret = setup_port_queues(port, &local_port_conf);
   if (ret < 0)
-    rte_exit(EXIT_FAILURE,
-             "Could not setup up TX queue for "
-             "port%u (%d)\n",
-             (unsigned)port, ret);
+    rte_exit(EXIT_FAILURE, "Could not set up port%u (%d)\n", (unsigned)port, ret);
 
   ret = rte_eth_dev_start(port);
   if (ret < 0)
@@ -711,6 +1652,7 @@ void check_all_ports_link_status(uint32_t port_mask) {
   }
 }
 
+#ifdef RTE_LIB_KNI
 void log_link_state(struct rte_kni *kni, int prev, struct rte_eth_link *link) {
   char link_status_text[RTE_ETH_LINK_MAX_STR_LEN];
   if (kni == NULL || link == NULL)
@@ -720,6 +1662,7 @@ void log_link_state(struct rte_kni *kni, int prev, struct rte_eth_link *link) {
   if (prev != link->link_status)
     RTE_LOG(INFO, APP, "%s NIC %s", rte_kni_get_name(kni), link_status_text);
 }
+#endif
 
 /*
  * Monitor the link status of all ports and update the
@@ -728,9 +1671,11 @@ void log_link_state(struct rte_kni *kni, int prev, struct rte_eth_link *link) {
 void *monitor_all_ports_link_status(void *arg) {
   uint16_t portid;
   struct rte_eth_link link;
-  unsigned int i;
   struct kni_port_params **p = kni_port_params_array;
+#ifdef RTE_LIB_KNI
+  unsigned int i;
   int prev;
+#endif
   (void)arg;
   int ret;
 
@@ -746,23 +1691,25 @@ void *monitor_all_ports_link_status(void *arg) {
                 rte_strerror(-ret));
         continue;
       }
-      for (i = 0; i < p[portid]->nb_kni; i++) {
-        prev = rte_kni_update_link(p[portid]->kni[i], link.link_status);
-        log_link_state(p[portid]->kni[i], prev, &link);
+#ifdef RTE_LIB_KNI
+      if (host_be == HOST_BACKEND_KNI) {
+        for (i = 0; i < p[portid]->nb_kni; i++) {
+          prev = rte_kni_update_link(p[portid]->kni[i], link.link_status);
+          log_link_state(p[portid]->kni[i], prev, &link);
+        }
+        continue;
       }
+#endif
+      virtio_host_update_link(p[portid], link.link_status);
     }
   }
   return NULL;
 }
 
+#ifdef RTE_LIB_KNI
 int kni_change_mtu_(uint16_t port_id, unsigned int new_mtu) {
   int ret;
-  uint16_t nb_rxd = NB_RXD;
-  uint16_t nb_txd = NB_TXD;
   struct rte_eth_conf conf;
-  struct rte_eth_dev_info dev_info;
-  struct rte_eth_rxconf rxq_conf;
-  struct rte_eth_txconf txq_conf;
 
   if (!rte_eth_dev_is_valid_port(port_id)) {
     RTE_LOG(ERR, APP, "Invalid port id %d\n", port_id);
@@ -779,49 +1726,15 @@ int kni_change_mtu_(uint16_t port_id, unsigned int new_mtu) {
     return ret;
   }
 
+  /* Bring every queue back the way init_port set them up */
   memcpy(&conf, &port_conf, sizeof(conf));
-
   conf.rxmode.mtu = new_mtu;
-  ret = rte_eth_dev_configure(port_id, 1, 1, &conf);
+  ret = setup_port_queues(port_id, &conf);
   if (ret < 0) {
     RTE_LOG(ERR, APP, "Fail to reconfigure port %d\n", port_id);
     return ret;
   }
 
-  ret = rte_eth_dev_adjust_nb_rx_tx_desc(port_id, &nb_rxd, &nb_txd);
-  if (ret < 0)
-    rte_exit(EXIT_FAILURE,
-             "Could not adjust number of descriptors "
-             "for port%u (%d)\n",
-             (unsigned int)port_id, ret);
-
-  ret = rte_eth_dev_info_get(port_id, &dev_info);
-  if (ret != 0) {
-    RTE_LOG(ERR, APP, "Error during getting device (port %u) info: %s\n",
-            port_id, strerror(-ret));
-
-    return ret;
-  }
-
-  rxq_conf = dev_info.default_rxconf;
-  rxq_conf.offloads = conf.rxmode.offloads;
-  ret =
-      rte_eth_rx_queue_setup(port_id, 0, nb_rxd, rte_eth_dev_socket_id(port_id),
-                             &rxq_conf, pktmbuf_pool);
-  if (ret < 0) {
-    RTE_LOG(ERR, APP, "Fail to setup Rx queue of port %d\n", port_id);
-    return ret;
-  }
-
-  txq_conf = dev_info.default_txconf;
-  txq_conf.offloads = conf.txmode.offloads;
-  ret = rte_eth_tx_queue_setup(port_id, 0, nb_txd,
-                               rte_eth_dev_socket_id(port_id), &txq_conf);
-  if (ret < 0) {
-    RTE_LOG(ERR, APP, "Fail to setup Tx queue of port %d\n", port_id);
-    return ret;
-  }
-
   /* Restart specific port */
   ret = rte_eth_dev_start(port_id);
   if (ret < 0) {
@@ -979,23 +1892,161 @@ int kni_alloc(uint16_t port_id) {
 
   return 0;
 }
+#endif
+
+/* Create the host interface of a port */
+int host_alloc(uint16_t port_id) {
+  uint64_t rx_offloads = 0, tx_offloads = 0;
+
+  if (port_id >= RTE_MAX_ETHPORTS || !kni_port_params_array[port_id])
+    return -1;
+
+#ifdef RTE_LIB_KNI
+  if (host_be == HOST_BACKEND_KNI)
+    return kni_alloc(port_id);
+#endif
+
+  /* Let the kernel leave L4 checksums to us on virtio-user. TAP would only
+   * check them in software. */
+  if (host_be == HOST_BACKEND_VIRTIO)
+    rx_offloads |= RTE_ETH_RX_OFFLOAD_TCP_CKSUM | RTE_ETH_RX_OFFLOAD_UDP_CKSUM;
+
+  /* Super-frames both ways. The ones from the kernel come in chained mbufs. */
+  if (host_gso) {
+    rx_offloads |= RTE_ETH_RX_OFFLOAD_TCP_LRO;
+    tx_offloads |= RTE_ETH_TX_OFFLOAD_TCP_TSO | RTE_ETH_TX_OFFLOAD_TCP_CKSUM |
+                   RTE_ETH_TX_OFFLOAD_MULTI_SEGS;
+  }
+
+  if (virtio_host_create(kni_port_params_array[port_id], host_be, nb_host_queues, rx_offloads,
+                         tx_offloads, pktmbuf_pool) != 0)
+    rte_exit(EXIT_FAILURE, "Fail to create host interface for port: %d\n", port_id);
+
+  return 0;
+}
+
+void init_port_pipeline(uint16_t port) {
+  xgmii_encoder_mode mode = xgmii_dense ? XGMII_ENC_DENSE : XGMII_ENC_SPARSE;
+  char name[RTE_RING_NAMESIZE];
+  unsigned tx_flags = nb_vtop_shards > 1 || bypass_enabled() ? 0 : RING_F_SP_ENQ;
+  unsigned rx_flags = nb_eth_rxq > 1 ? 0 : RING_F_SP_ENQ;
+  port_pipeline *pl;
+  unsigned i;
+
+  pl = (port_pipeline *)rte_zmalloc("port_pipeline", sizeof(port_pipeline), RTE_CACHE_LINE_SIZE);
+  if (pl == NULL)
+    rte_exit(EXIT_FAILURE, "Could not allocate pipeline for port %u\n", port);
+  port_pipelines[port] = pl;
+
+  // Generate TX and RX queues for pkt_mbufs. Every shard sends to the TX
+  // queues, one for each Ethernet TX queue so that flows stay in order, and
+  // each has RX queues of its own that every Ethernet RX queue sends to.
+  for (i = 0; i < nb_eth_txq; i++) {
+    snprintf(name, sizeof(name), "eth ring TX %u.%u", port, i);
+    pl->eth_tx_rings[i] = rte_ring_create(name, PKT_RING_SZ, rte_socket_id(), tx_flags);
+    if (pl->eth_tx_rings[i] == NULL)
+      rte_exit(EXIT_FAILURE, "Could not create packet rings\n");
+  }
+  snprintf(name, sizeof(name), "kni ring TX %u", port);
+  pl->kni_tx_ring = rte_ring_create(name, PKT_RING_SZ, rte_socket_id(), tx_flags);
+  if (pl->kni_tx_ring == NULL)
+    rte_exit(EXIT_FAILURE, "Could not create packet rings\n");
+
+  for (i = 0; i < nb_vtop_shards; i++) {
+    snprintf(name, sizeof(name), "eth ring RX %u.%u", port, i);
+    pl->eth_rx_rings[i] = rte_ring_create(name, PKT_RING_SZ, rte_socket_id(), rx_flags);
+    snprintf(name, sizeof(name), "kni ring RX %u.%u", port, i);
+    pl->kni_rx_rings[i] = rte_ring_create(name, PKT_RING_SZ, rte_socket_id(), RING_F_SP_ENQ);
+    if (pl->eth_rx_rings[i] == NULL || pl->kni_rx_rings[i] == NULL)
+      rte_exit(EXIT_FAILURE, "Could not create packet rings\n");
+
+    // Generate XGMII encoders and decoders for both directions
+    xgmii_encoder_init(&pl->eth_encoders[i], port, 0, mode);
+    xgmii_encoder_init(&pl->kni_encoders[i], port, 1, mode);
+    pl->eth_decoders[i] = xgmii_decoder_create(pktmbuf_pool, port, 0, xgmii_flush_beats, xgmii_flush_us);
+    pl->kni_decoders[i] = xgmii_decoder_create(pktmbuf_pool, port, 1, xgmii_flush_beats, xgmii_flush_us);
+    if (pl->eth_decoders[i] == NULL || pl->kni_decoders[i] == NULL)
+      rte_exit(EXIT_FAILURE, "Could not allocate XGMII decoders\n");
+  }
+
+  // With more than one encoder per direction, all of them take turns in a group
+  xgmii_group_init(&pl->eth_enc_group);
+  xgmii_group_init(&pl->kni_enc_group);
+  for (i = 0; nb_xgmii_encoders > 1 && i < nb_xgmii_encoders; i++) {
+    pl->eth_block_encoders[i] = xgmii_block_encoder_create(&pl->eth_enc_group, port, 0, mode);
+    pl->kni_block_encoders[i] = xgmii_block_encoder_create(&pl->kni_enc_group, port, 1, mode);
+    if (pl->eth_block_encoders[i] == NULL || pl->kni_block_encoders[i] == NULL)
+      rte_exit(EXIT_FAILURE, "Could not allocate XGMII encoders\n");
+  }
+
+  // And the same for decoders
+  xgmii_dec_group_init(&pl->eth_dec_group);
+  xgmii_dec_group_init(&pl->kni_dec_group);
+  for (i = 0; nb_xgmii_decoders > 1 && i < nb_xgmii_decoders; i++) {
+    pl->eth_block_decoders[i] = xgmii_block_decoder_create(&pl->eth_dec_group, pktmbuf_pool, port, 0);
+    pl->kni_block_decoders[i] = xgmii_block_decoder_create(&pl->kni_dec_group, pktmbuf_pool, port, 1);
+    if (pl->eth_block_decoders[i] == NULL || pl->kni_block_decoders[i] == NULL)
+      rte_exit(EXIT_FAILURE, "Could not allocate XGMII decoders\n");
+  }
+
+  // Packets kept out of the model go from one side's RX lcores to the other's TX ring
+  bypass_set_rings(port, 0, &pl->kni_tx_ring, 1);
+  bypass_set_rings(port, 1, pl->eth_tx_rings, nb_eth_txq);
+
+  for (i = 0; i < nb_eth_txq; i++)
+    telemetry_add_ring(port, pl->eth_tx_rings[i]);
+  telemetry_add_ring(port, pl->kni_tx_ring);
+  for (i = 0; i < nb_vtop_shards; i++) {
+    telemetry_add_ring(port, pl->eth_rx_rings[i]);
+    telemetry_add_ring(port, pl->kni_rx_rings[i]);
+  }
+}
 
 void init_worker_buffers() {
-  // Generate TX and RX queues for pkt_mbufs
-  eth_tx_ring = rte_ring_create("eth ring TX", PKT_RING_SZ, rte_socket_id(), RING_F_SP_ENQ);
-  eth_rx_ring = rte_ring_create("eth ring RX", PKT_RING_SZ, rte_socket_id(), RING_F_SP_ENQ);
-  kni_tx_ring = rte_ring_create("kni ring TX", PKT_RING_SZ, rte_socket_id(), RING_F_SP_ENQ);
-  kni_rx_ring = rte_ring_create("kni ring RX", PKT_RING_SZ, rte_socket_id(), RING_F_SP_ENQ);
+  uint16_t port;
+
+  RTE_ETH_FOREACH_DEV(port) {
+    if (kni_port_params_array[port])
+      init_port_pipeline(port);
+  }
 }
 
 void free_worker_buffers() {
-  // Generate TX and RX queues for pkt_mbufs
-  rte_ring_free(eth_tx_ring);
-  rte_ring_free(eth_rx_ring);
-  rte_ring_free(kni_tx_ring);
-  rte_ring_free(kni_rx_ring);
+  port_pipeline *pl;
+  uint16_t port;
+  unsigned i;
+
+  RTE_ETH_FOREACH_DEV(port) {
+    pl = port_pipelines[port];
+    if (pl == NULL)
+      continue;
+
+    for (i = 0; i < nb_eth_txq; i++)
+      rte_ring_free(pl->eth_tx_rings[i]);
+    rte_ring_free(pl->kni_tx_ring);
+
+    for (i = 0; i < nb_vtop_shards; i++) {
+      rte_ring_free(pl->eth_rx_rings[i]);
+      rte_ring_free(pl->kni_rx_rings[i]);
+
+      xgmii_decoder_free(pl->eth_decoders[i]);
+      xgmii_decoder_free(pl->kni_decoders[i]);
+    }
+    for (i = 0; i < XGMII_MAX_ENCODERS; i++) {
+      xgmii_block_encoder_free(pl->eth_block_encoders[i]);
+      xgmii_block_encoder_free(pl->kni_block_encoders[i]);
+    }
+    for (i = 0; i < XGMII_MAX_DECODERS; i++) {
+      xgmii_block_decoder_free(pl->eth_block_decoders[i]);
+      xgmii_block_decoder_free(pl->kni_block_decoders[i]);
+    }
+
+    rte_free(pl);
+    port_pipelines[port] = NULL;
+  }
 }
 
+#ifdef RTE_LIB_KNI
 int kni_free_kni(uint16_t port_id) {
   uint8_t i;
   int ret;
@@ -1017,6 +2068,29 @@ int kni_free_kni(uint16_t port_id) {
 
   return 0;
 }
+#endif
+
+/* Release the host interface of a port, and the port */
+int host_free(uint16_t port_id) {
+  int ret;
+
+  if (port_id >= RTE_MAX_ETHPORTS || !kni_port_params_array[port_id])
+    return -1;
+
+#ifdef RTE_LIB_KNI
+  if (host_be == HOST_BACKEND_KNI)
+    return kni_free_kni(port_id);
+#endif
+
+  virtio_host_free(kni_port_params_array[port_id]);
+  ret = rte_eth_dev_stop(port_id);
+  if (ret != 0)
+    RTE_LOG(ERR, APP, "Failed to stop port %d: %s\n", port_id,
+            rte_strerror(-ret));
+  rte_eth_dev_close(port_id);
+
+  return 0;
+}
 
 /* Initialise ports/queues etc. and start main loop on each core */
 int main(int argc, char **argv) {
@@ -1024,8 +2098,9 @@ int main(int argc, char **argv) {
   uint16_t nb_sys_ports, port;
   unsigned i;
   void *retval;
-  pthread_t kni_link_tid;
+  pthread_t kni_link_tid, stats_tid;
   int pid;
+  static rte_cpuset_t vtop_thread_cpus[RTE_MAX_LCORE];
 
   /* Associate signal_handler function with USR signals */
   signal(SIGUSR1, signal_handler);
@@ -1046,6 +2121,12 @@ int main(int argc, char **argv) {
   if (ret < 0)
     rte_exit(EXIT_FAILURE, "Could not parse input parameters\n");
 
+#ifdef FESTOON_AXIS_WIDTH
+  /* The AXI-Stream top carries packets, so there's no XGMII to convert */
+  if (!vtop_pkt_mode)
+    rte_exit(EXIT_FAILURE, "The AXI-Stream top needs --vtop-pkt-mode\n");
+#endif
+
   /* Create the mbuf pool */
   pktmbuf_pool = rte_pktmbuf_pool_create("mbuf_pool", NB_MBUF, MEMPOOL_CACHE_SZ, 0, MBUF_DATA_SZ, rte_socket_id());
   if (pktmbuf_pool == NULL) {
@@ -1053,12 +2134,16 @@ int main(int argc, char **argv) {
     return -1;
   }
 
-  /* Create the mii frame pool */
-  xgmii_pool = rte_pktmbuf_pool_create("mii_pool", XGMII_NB_MBUF, MEMPOOL_CACHE_SZ, 0, XGMII_MBUF_SZ, rte_socket_id());
-  if (xgmii_pool == NULL) {
-    rte_exit(EXIT_FAILURE, "Could not initialise mbuf pool\n");
-    return -1;
-  }
+  /* Pick the XGMII decoder for this CPU */
+  xgmii_init();
+
+  /* Stamps have to be registered before the lcores start timing packets */
+  if (latency_on && (ret = lat_init()) != 0)
+    rte_exit(EXIT_FAILURE, "Could not set up latency stamps: %s\n", rte_strerror(-ret));
+
+  /* So does the table split packets are parked in */
+  if (header_split && (ret = split_init(header_split)) != 0)
+    rte_exit(EXIT_FAILURE, "Could not set up header split: %s\n", rte_strerror(-ret));
 
   /* Get number of ports found in scan */
   nb_sys_ports = rte_eth_dev_count_avail();
@@ -1074,11 +2159,58 @@ int main(int argc, char **argv) {
                i);
 
   /* Initialize Verilated module and tranlation */
+  bypass_init();
   init_worker_buffers();
-  init_verilated_top(pktmbuf_pool);
+  for (i = 0; i < nb_vtop_threads; i++)
+    vtop_thread_cpus[i] = rte_lcore_cpuset(vtop_thread_lcores[i]);
+  init_verilated_top(nb_vtop_shards, nb_vtop_threads, vtop_thread_cpus);
+  vtop_set_clocking(vtop_clocking);
+  vtop_set_idle_skip(vtop_idle_cycles);
+  vtop_set_idle_out(vtop_idle_out);
+  RTE_ETH_FOREACH_DEV(port) {
+    port_pipeline *pl = port_pipelines[port];
+    unsigned vport;
+
+    if (pl)
+      vtop_set_port_id(kni_port_params_array[port]->vtop_port, port);
+
+    /* The XGMII rings are only used without packet mode */
+    for (i = 0; pl && !vtop_pkt_mode && i < nb_vtop_shards; i++) {
+      vport = kni_port_params_array[port]->vtop_port;
+      telemetry_add_ring(port, get_vtop_eth_rx_ring(i, vport));
+      telemetry_add_ring(port, get_vtop_eth_tx_ring(i, vport));
+      telemetry_add_ring(port, get_vtop_pci_rx_ring(i, vport));
+      telemetry_add_ring(port, get_vtop_pci_tx_ring(i, vport));
+    }
 
+    /* Packets are timed through the model against its clock */
+    for (i = 0; pl && i < nb_vtop_shards; i++) {
+      pl->eth_encoders[i].clock = vtop_get_clock(i);
+      pl->kni_encoders[i].clock = vtop_get_clock(i);
+      pl->eth_decoders[i]->clock = vtop_get_clock(i);
+      pl->kni_decoders[i]->clock = vtop_get_clock(i);
+    }
+    for (i = 0; pl && nb_xgmii_encoders > 1 && i < nb_xgmii_encoders; i++) {
+      pl->eth_block_encoders[i]->enc.clock = vtop_get_clock(0);
+      pl->kni_block_encoders[i]->enc.clock = vtop_get_clock(0);
+    }
+    for (i = 0; pl && nb_xgmii_decoders > 1 && i < nb_xgmii_decoders; i++) {
+      pl->eth_block_decoders[i]->dec->clock = vtop_get_clock(0);
+      pl->kni_block_decoders[i]->dec->clock = vtop_get_clock(0);
+    }
+
+    for (i = 0; pl && vtop_pkt_mode && i < nb_vtop_shards; i++)
+      vtop_set_pkt_mode(i, kni_port_params_array[port]->vtop_port, pl->eth_rx_rings[i],
+                        pl->eth_tx_rings, nb_eth_txq, &pl->eth_encoders[i], pl->eth_decoders[i],
+                        pl->kni_rx_rings[i], &pl->kni_tx_ring, 1, &pl->kni_encoders[i],
+                        pl->kni_decoders[i]);
+  }
+
+#ifdef RTE_LIB_KNI
   /* Initialize KNI subsystem */
-  init_kni();
+  if (host_be == HOST_BACKEND_KNI)
+    init_kni();
+#endif
 
   /* Initialise each port */
   RTE_ETH_FOREACH_DEV(port) {
@@ -1093,10 +2225,17 @@ int main(int argc, char **argv) {
                "%d ports for kni\n",
                RTE_MAX_ETHPORTS);
 
-    kni_alloc(port);
+    host_alloc(port);
+    telemetry_add_port(kni_port_params_array[port]);
   }
   check_all_ports_link_status(ports_mask);
 
+  if (telemetry_init() != 0)
+    RTE_LOG(WARNING, APP, "Could not register telemetry commands\n");
+  ret = rte_ctrl_thread_create(&stats_tid, "festoon stats", NULL, stats_thread, NULL);
+  if (ret < 0)
+    rte_exit(EXIT_FAILURE, "Could not create stats thread!\n");
+
   pid = getpid();
   RTE_LOG(INFO, APP, "========================\n");
   RTE_LOG(INFO, APP, "KNI Running\n");
@@ -1104,6 +2243,12 @@ int main(int argc, char **argv) {
   RTE_LOG(INFO, APP, "    Show KNI Statistics.\n");
   RTE_LOG(INFO, APP, "kill -USR2 %d\n", pid);
   RTE_LOG(INFO, APP, "    Zero KNI Statistics.\n");
+  RTE_LOG(INFO, APP, "dpdk-telemetry.py, /festoon/stats,PORT\n");
+  RTE_LOG(INFO, APP, "    Show statistics and rates of each stage.\n");
+  if (lat_enabled()) {
+    RTE_LOG(INFO, APP, "dpdk-telemetry.py, /festoon/latency,PORT\n");
+    RTE_LOG(INFO, APP, "    Show latency through each stage.\n");
+  }
   RTE_LOG(INFO, APP, "========================\n");
   fflush(stdout);
 
@@ -1120,6 +2265,8 @@ int main(int argc, char **argv) {
   }
   monitor_links = 0;
   pthread_join(kni_link_tid, &retval);
+  telemetry_stop();
+  pthread_join(stats_tid, &retval);
 
   /* Release resources */
   stop_verilated_top();
@@ -1127,7 +2274,7 @@ int main(int argc, char **argv) {
   RTE_ETH_FOREACH_DEV(port) {
     if (!(ports_mask & (1 << port)))
       continue;
-    kni_free_kni(port);
+    host_free(port);
   }
   for (i = 0; i < RTE_MAX_ETHPORTS; i++)
     if (kni_port_params_array[i]) {
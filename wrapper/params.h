@@ -24,18 +24,68 @@
 /* How many objects (mbufs) to keep in per-lcore mempool cache */
 #define MEMPOOL_CACHE_SZ PKT_BURST_SZ
 
-/* Number of mbufs in xgmii mempool */
-#define XGMII_NB_MBUF (8192 * 2048)
+/* Most XGMII beats a single packet can encode to (idle + start + data + terminate) */
+#define XGMII_PKT_BEATS (MAX_PACKET_SZ / 8 + 4)
+
+/* Minimum inter-packet gap in dense XGMII mode, in bytes including /T/ */
+#define XGMII_IPG 12
 
 /* How many XGMII frames per packet burst */
 #define XGMII_BURST_SZ 2 * (PKT_BURST_SZ * MAX_PACKET_SZ / 64)
 
-/* Size of the data buffer in each mbuf */
-#define XGMII_MBUF_SZ (64 + 8 + RTE_PKTMBUF_HEADROOM)
+/* How many XGMII beats the decoder reads from its ring in one go */
+#define XGMII_DEC_BURST_SZ 64
 
-/* Size of XGMII ring buffers */
+/* Default beats and microseconds before a partial packet burst is flushed */
+#define XGMII_FLUSH_BEATS (4 * XGMII_DEC_BURST_SZ)
+#define XGMII_FLUSH_US 20
+
+/* Size of XGMII ring buffers, in beats */
 #define XGMII_RING_SZ 32 * XGMII_BURST_SZ
 
+/* Most XGMII encoders that can feed one direction of a port */
+#define XGMII_MAX_ENCODERS 16
+
+/* Most XGMII decoders that can drain one direction of a port */
+#define XGMII_MAX_DECODERS 16
+
+/* Most beats a parallel decoder takes in one chunk. Room for two of the longest packets, so
+   there's always a packet boundary to cut the chunk at. */
+#define XGMII_SPLIT_BEATS (2 * XGMII_PKT_BEATS)
+
+/* Most idle beats out of the model sent on as one beat, with --vtop-idle-out rle */
+#define VTOP_IDLE_RUN_MAX XGMII_DEC_BURST_SZ
+
+/* Most model clock cycles skipped per second while idle, the 10G XGMII clock rate */
+#define VTOP_CLOCK_HZ 156250000
+
+/* Most pipeline stages that can take turns on one lcore */
+#define SCHED_MAX_STAGES 64
+
+/* Model clock cycles run in each turn on a shared lcore, by default */
+#define SCHED_MODEL_WEIGHT XGMII_DEC_BURST_SZ
+
+/* Rounds with nothing to do an lcore spins through, then pauses in, before it waits for work */
+#define SCHED_IDLE_SPIN 64
+#define SCHED_IDLE_PAUSE 1024
+
+/* Longest an idle lcore waits on its rings in a low power state, in microseconds */
+#define SCHED_IDLE_WAIT_US 50
+
+/* How long an lcore is idle before it sleeps instead, giving up the CPU */
+#define SCHED_IDLE_SLEEP_MS 100
+#define SCHED_IDLE_SLEEP_US 50
+
+/* Most instances of the model that flows can be spread over */
+#define VTOP_MAX_SHARDS 16
+
+/* Most RX or TX queues used on each Ethernet port */
+#define ETH_MAX_QUEUES 16
+
+/* Most rings and packets flows can be spread over in one go */
+#define FLOW_STEER_MAX_RINGS (VTOP_MAX_SHARDS > ETH_MAX_QUEUES ? VTOP_MAX_SHARDS : ETH_MAX_QUEUES)
+#define FLOW_STEER_MAX_BURST (PKT_BURST_SZ + XGMII_DEC_BURST_SZ)
+
 /* Number of RX ring descriptors */
 #define NB_RXD 2048
 
@@ -53,4 +103,34 @@
 
 #define KNI_MAX_KTHREAD 32
 
+/* Most queue pairs on a virtio-user or TAP host interface */
+#define HOST_MAX_QUEUES 8
+
+/* Descriptors on each host interface queue */
+#define HOST_RING_SZ 1024
+
+/* How often counters are sampled for telemetry rates */
+#define TELEMETRY_PERIOD_MS 1000
+
+/* Most rings reported on for each port */
+#define TELEMETRY_MAX_RINGS 128
+
+/* How often the stats thread checks for signals to print or reset stats */
+#define STATS_POLL_MS 100
+
+/* Packets that can be timed through the model at once. A power of two. */
+#define LAT_TABLE_SZ 16384
+
+/* Bytes at the start of a packet hashed to match it up across the model */
+#define LAT_SIG_BYTES 128
+
+/* How long a timed packet can be in the model before it's taken as lost */
+#define LAT_MAX_AGE_MS 1000
+
+/* Most rules picking the traffic the model sees */
+#define BYPASS_MAX_RULES 16
+
+/* Packets whose header can be in the model at once, in header split mode. A power of two. */
+#define SPLIT_TABLE_SZ 16384
+
 #endif